@@ -66,13 +66,24 @@ VOID FuseCacheExpirationRoutine(FUSE_CACHE *Cache,
 NTSTATUS FuseCacheReferenceGen(FUSE_CACHE *Cache, PVOID *PGen);
 VOID FuseCacheDereferenceGen(FUSE_CACHE *Cache, PVOID Gen);
 BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
-    FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
+    FUSE_PROTO_ENTRY *Entry, FUSE_CACHE_ACCESS *Access, PVOID *PItem);
 VOID FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
     FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
 VOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name);
+VOID FuseCacheMoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    UINT64 NewParentIno, PSTRING NewName);
 VOID FuseCacheReferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheDereferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheQuickExpireItem(FUSE_CACHE *Cache, PVOID Item);
+UINT32 FuseCacheGetItemDataVersion(FUSE_CACHE *Cache, PVOID Item);
+BOOLEAN FuseCacheGetItemAttr(FUSE_CACHE *Cache, PVOID Item, FUSE_PROTO_ATTR *Attr);
+VOID FuseCacheSetItemAccess(FUSE_CACHE *Cache, PVOID Item,
+    FUSE_PROTO_ATTR *Attr, FUSE_CACHE_ACCESS *Access);
+PVOID FuseCacheGetItemDirtyFile(FUSE_CACHE *Cache, PVOID Item);
+PVOID FuseCacheCompareExchangeItemDirtyFile(FUSE_CACHE *Cache, PVOID Item,
+    PVOID Exchange, PVOID Comparand);
+VOID FuseCacheSetItemWritebackStatus(FUSE_CACHE *Cache, PVOID Item, NTSTATUS Status);
+NTSTATUS FuseCacheTakeItemWritebackStatus(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheDeleteForgotten(PLIST_ENTRY ForgetList);
 BOOLEAN FuseCacheForgetOne(PLIST_ENTRY ForgetList, FUSE_PROTO_FORGET_ONE *PForgetOne);
 
@@ -85,9 +96,17 @@ BOOLEAN FuseCacheForgetOne(PLIST_ENTRY ForgetList, FUSE_PROTO_FORGET_ONE *PForge
 #pragma alloc_text(PAGE, FuseCacheGetEntry)
 #pragma alloc_text(PAGE, FuseCacheSetEntry)
 #pragma alloc_text(PAGE, FuseCacheRemoveEntry)
+#pragma alloc_text(PAGE, FuseCacheMoveEntry)
 #pragma alloc_text(PAGE, FuseCacheReferenceItem)
 #pragma alloc_text(PAGE, FuseCacheDereferenceItem)
 #pragma alloc_text(PAGE, FuseCacheQuickExpireItem)
+#pragma alloc_text(PAGE, FuseCacheGetItemDataVersion)
+#pragma alloc_text(PAGE, FuseCacheGetItemAttr)
+#pragma alloc_text(PAGE, FuseCacheSetItemAccess)
+#pragma alloc_text(PAGE, FuseCacheGetItemDirtyFile)
+#pragma alloc_text(PAGE, FuseCacheCompareExchangeItemDirtyFile)
+#pragma alloc_text(PAGE, FuseCacheSetItemWritebackStatus)
+#pragma alloc_text(PAGE, FuseCacheTakeItemWritebackStatus)
 #pragma alloc_text(PAGE, FuseCacheDeleteForgotten)
 #pragma alloc_text(PAGE, FuseCacheForgetOne)
 #endif
@@ -126,11 +145,23 @@ struct _FUSE_CACHE_ITEM
     UINT64 ExpirationTime;
     UINT64 LastUsedTime;
     FUSE_PROTO_ENTRY Entry;
+    FUSE_CACHE_ACCESS Access;           /* protected by the cache Mutex */
     LONG QuickExpiry;
+    LONG DataVersion;
+    PVOID DirtyFile;
+    LONG WritebackStatus;
     LONG RefCount;
     CHAR NameBuf[];
 };
 
+static inline VOID FuseCacheFreeItem(FUSE_CACHE_ITEM *Item)
+{
+    /* an item that was moved to a longer name has its name allocated separately */
+    if (Item->NameBuf != Item->Name.Buffer)
+        FuseFree(Item->Name.Buffer);
+    FuseFree(Item);
+}
+
 static inline UINT64 FuseCacheForgetTime(FUSE_CACHE *Cache, UINT64 InterruptTime)
 {
     if (!IsListEmpty(&Cache->GenList))
@@ -263,6 +294,7 @@ static inline FUSE_CACHE_ITEM *FuseCacheUpdateHashedItem(FUSE_CACHE *Cache,
             Item->ExpirationTime = ExpirationTime;
             Item->LastUsedTime = LastUsedTime;
             RtlCopyMemory(&Item->Entry, Entry, sizeof Item->Entry);
+            RtlZeroMemory(&Item->Access, sizeof Item->Access);
 
             /* mark as most-recently used */
             RemoveEntryList(&Item->ListEntry);
@@ -354,7 +386,7 @@ VOID FuseCacheExpirationRoutine(FUSE_CACHE *Cache,
         if (Item->NoForget)
         {
             RemoveEntryList(&Item->ListEntry);
-            FuseFree(Item);
+            FuseCacheFreeItem(Item);
         }
     }
 
@@ -472,7 +504,11 @@ VOID FuseCacheDereferenceGen(FUSE_CACHE *Cache, PVOID Gen0)
 }
 
 BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
-    FUSE_PROTO_ENTRY *Entry, PVOID *PItem)
+    FUSE_PROTO_ENTRY *Entry, FUSE_CACHE_ACCESS *Access, PVOID *PItem)
+    /*
+     * If Access is not NULL, it receives the access mask memoized for the entry's attributes
+     * by FuseCacheSetItemAccess (Access->Mask is 0 if there is none).
+     */
 {
     PAGED_CODE();
 
@@ -490,6 +526,8 @@ BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
         {
             Item->LastUsedTime = InterruptTime;
             RtlCopyMemory(Entry, &Item->Entry, sizeof Item->Entry);
+            if (0 != Access)
+                RtlCopyMemory(Access, &Item->Access, sizeof Item->Access);
 
             /* mark as most-recently used */
             RemoveEntryList(&Item->ListEntry);
@@ -587,6 +625,75 @@ VOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name)
     ExReleaseFastMutex(&Cache->Mutex);
 }
 
+VOID FuseCacheMoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    UINT64 NewParentIno, PSTRING NewName)
+    /*
+     * Move an entry after a successful RENAME. The item keeps its identity (nodeid, attributes,
+     * lookup count, references from open files) and only its parent inode number and name are
+     * changed, so that the renamed file (and for a directory any cached descendants, which are
+     * keyed by the directory's inode number) remain in the cache. Any item for the new name
+     * refers to the file that was replaced and is expired.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item, *NewItem, **P;
+    ULONG Hash = FuseCacheHash(ParentIno, Name, Cache->CaseInsensitive);
+    ULONG NewHash = FuseCacheHash(NewParentIno, NewName, Cache->CaseInsensitive);
+    PCHAR NewNameBuf, FreeNameBuf;
+    ULONG HashIndex;
+
+    NewNameBuf = FuseAllocMustSucceed(0 != NewName->Length ? NewName->Length : 1);
+    FreeNameBuf = NewNameBuf;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+
+    Item = FuseCacheLookupHashedItem(Cache, Hash, ParentIno, Name);
+
+    NewItem = FuseCacheLookupHashedItem(Cache, NewHash, NewParentIno, NewName);
+    if (0 != NewItem && Item != NewItem)
+        FuseCacheExpireItem(Cache, NewItem);
+
+    if (0 != Item)
+    {
+        if (!InterlockedCompareExchange(&Item->QuickExpiry, 1, 1))
+        {
+            HashIndex = Item->Hash % Cache->ItemBucketCount;
+            for (P = (PVOID)&Cache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
+                if (*P == Item)
+                {
+                    *P = (*P)->DictNext;
+                    break;
+                }
+
+            if (NewName->Length > Item->Name.MaximumLength)
+            {
+                if (Item->NameBuf != Item->Name.Buffer)
+                    FreeNameBuf = Item->Name.Buffer;
+                else
+                    FreeNameBuf = 0;
+                Item->Name.Buffer = NewNameBuf;
+                Item->Name.MaximumLength = NewName->Length;
+            }
+            RtlCopyMemory(Item->Name.Buffer, NewName->Buffer, NewName->Length);
+            Item->Name.Length = NewName->Length;
+            Item->ParentIno = NewParentIno;
+            Item->Hash = NewHash;
+
+            HashIndex = Item->Hash % Cache->ItemBucketCount;
+            Item->DictNext = Cache->ItemBuckets[HashIndex];
+            Cache->ItemBuckets[HashIndex] = Item;
+        }
+        else
+            FuseCacheExpireItem(Cache, Item);
+    }
+
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    if (0 != FreeNameBuf)
+        FuseFree(FreeNameBuf);
+}
+
 VOID FuseCacheReferenceItem(FUSE_CACHE *Cache, PVOID Item0)
 {
     PAGED_CODE();
@@ -622,6 +729,132 @@ VOID FuseCacheQuickExpireItem(FUSE_CACHE *Cache, PVOID Item0)
     FUSE_CACHE_ITEM *Item = Item0;
 
     InterlockedExchange(&Item->QuickExpiry, 1);
+    InterlockedIncrement(&Item->DataVersion);
+}
+
+UINT32 FuseCacheGetItemDataVersion(FUSE_CACHE *Cache, PVOID Item0)
+    /*
+     * The data version of an item changes every time the item is quick expired (i.e. every
+     * time the file data or attributes are changed by us). It is used to validate data that
+     * are cached outside of the entry cache (e.g. read-ahead data).
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item)
+        return 0;
+
+    return (UINT32)InterlockedCompareExchange(&Item->DataVersion, 0, 0);
+}
+
+BOOLEAN FuseCacheGetItemAttr(FUSE_CACHE *Cache, PVOID Item0, FUSE_PROTO_ATTR *Attr)
+    /*
+     * Get the attributes of an item (typically one referenced by an open file) if they have
+     * not expired yet.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+    UINT64 InterruptTime = KeQueryInterruptTime();
+    BOOLEAN Result = FALSE;
+
+    if (0 == Item)
+        return FALSE;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    if (InterruptTime < Item->ExpirationTime &&
+        !InterlockedCompareExchange(&Item->QuickExpiry, 1, 1))
+    {
+        RtlCopyMemory(Attr, &Item->Entry.attr, sizeof *Attr);
+        Result = TRUE;
+    }
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    return Result;
+}
+
+VOID FuseCacheSetItemAccess(FUSE_CACHE *Cache, PVOID Item0,
+    FUSE_PROTO_ATTR *Attr, FUSE_CACHE_ACCESS *Access)
+    /*
+     * Memoize the access mask of the item for a caller. The mask is computed from Attr, so
+     * it is only memoized if the item still has the same owner and mode. The memo is forgotten
+     * when the item's entry is updated.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item)
+        return;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    if (Attr->uid == Item->Entry.attr.uid &&
+        Attr->gid == Item->Entry.attr.gid &&
+        Attr->mode == Item->Entry.attr.mode)
+        RtlCopyMemory(&Item->Access, Access, sizeof Item->Access);
+    ExReleaseFastMutex(&Cache->Mutex);
+}
+
+PVOID FuseCacheGetItemDirtyFile(FUSE_CACHE *Cache, PVOID Item0)
+    /*
+     * The dirty file of an item is the open file (if any) that holds dirty data for it
+     * (FUSE_PROTO_INIT_WRITEBACK_CACHE). There is at most one such open file per item.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item)
+        return 0;
+
+    return InterlockedCompareExchangePointer(&Item->DirtyFile, 0, 0);
+}
+
+PVOID FuseCacheCompareExchangeItemDirtyFile(FUSE_CACHE *Cache, PVOID Item0,
+    PVOID Exchange, PVOID Comparand)
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    return InterlockedCompareExchangePointer(&Item->DirtyFile, Exchange, Comparand);
+}
+
+VOID FuseCacheSetItemWritebackStatus(FUSE_CACHE *Cache, PVOID Item0, NTSTATUS Status)
+    /*
+     * The writeback status of an item is the first failure to write back dirty data of the
+     * file since it was last reported (FuseCacheTakeItemWritebackStatus). It is kept in the
+     * item, because the open file that held the dirty data may be gone by then.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item || NT_SUCCESS(Status))
+        return;
+
+    InterlockedCompareExchange(&Item->WritebackStatus, Status, STATUS_SUCCESS);
+}
+
+NTSTATUS FuseCacheTakeItemWritebackStatus(FUSE_CACHE *Cache, PVOID Item0)
+{
+    PAGED_CODE();
+
+    FUSE_CACHE_ITEM *Item = Item0;
+
+    if (0 == Item)
+        return STATUS_SUCCESS;
+
+    if (STATUS_SUCCESS == InterlockedCompareExchange(&Item->WritebackStatus, 0, 0))
+        return STATUS_SUCCESS;
+
+    return InterlockedExchange(&Item->WritebackStatus, STATUS_SUCCESS);
 }
 
 VOID FuseCacheDeleteForgotten(PLIST_ENTRY ForgetList)
@@ -632,7 +865,7 @@ VOID FuseCacheDeleteForgotten(PLIST_ENTRY ForgetList)
     {
         FUSE_CACHE_ITEM *Item = CONTAINING_RECORD(Entry, FUSE_CACHE_ITEM, ListEntry);
         Entry = Entry->Flink;
-        FuseFree(Item);
+        FuseCacheFreeItem(Item);
     }
 }
 
@@ -648,7 +881,7 @@ BOOLEAN FuseCacheForgetOne(PLIST_ENTRY ForgetList, FUSE_PROTO_FORGET_ONE *PForge
     ASSERT(!Item->NoForget);
     PForgetOne->nodeid = Item->Entry.nodeid;
     PForgetOne->nlookup = Item->NLookup;
-    FuseFree(Item);
+    FuseCacheFreeItem(Item);
 
     return TRUE;
 }
@@ -24,10 +24,20 @@
 VOID FuseContextCreate(FUSE_CONTEXT **PContext,
     FUSE_INSTANCE *Instance, FSP_FSCTL_TRANSACT_REQ *InternalRequest);
 VOID FuseContextDelete(FUSE_CONTEXT *Context);
+NTSTATUS FuseContextMapPosixPath(FUSE_CONTEXT_PATH_ARENA *PathArena,
+    PWSTR WindowsPath, PSTR *PPosixPath);
+VOID FuseContextDeletePosixPath(FUSE_CONTEXT_PATH_ARENA *PathArena, PSTR PosixPath);
+VOID FuseContextCreateChild(FUSE_CONTEXT **PContext,
+    FUSE_CONTEXT *Parent, UINT32 Hint);
+BOOLEAN FuseContextPostChildren(FUSE_CONTEXT *Context);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FuseContextCreate)
 #pragma alloc_text(PAGE, FuseContextDelete)
+#pragma alloc_text(PAGE, FuseContextMapPosixPath)
+#pragma alloc_text(PAGE, FuseContextDeletePosixPath)
+#pragma alloc_text(PAGE, FuseContextCreateChild)
+#pragma alloc_text(PAGE, FuseContextPostChildren)
 #endif
 
 VOID FuseContextCreate(FUSE_CONTEXT **PContext,
@@ -60,6 +70,7 @@ VOID FuseContextCreate(FUSE_CONTEXT **PContext,
     Context->InternalResponse->Size = sizeof(FSP_FSCTL_TRANSACT_RSP);
     Context->InternalResponse->Kind = Kind;
     Context->InternalResponse->Hint = 0 != InternalRequest ? InternalRequest->Hint : 0;
+    InitializeListHead(&Context->ChildList);
     *PContext = Context;
 }
 
@@ -67,6 +78,17 @@ VOID FuseContextDelete(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    FUSE_CONTEXT *Parent = Context->Parent;
+
+    /* delete children that were never posted; they must not post us back */
+    while (!IsListEmpty(&Context->ChildList))
+    {
+        FUSE_CONTEXT *Child = CONTAINING_RECORD(
+            RemoveHeadList(&Context->ChildList), FUSE_CONTEXT, ListEntry);
+        Child->Parent = 0;
+        FuseContextDelete(Child);
+    }
+
     if (FuseOpGuardTrue == Context->OpGuardResult)
     {
         UINT32 Kind = 0 == Context->InternalRequest ?
@@ -76,6 +98,14 @@ VOID FuseContextDelete(FUSE_CONTEXT *Context)
 
     if (0 != Context->Fini)
         Context->Fini(Context);
+    if (0 != Context->Writeback.File)
+    {
+        /* the Context is deleted while writing back dirty data or waiting for their writeback */
+        if (0 != Context->Writeback.Buffer)
+            FuseFileWritebackComplete(Context->Instance, Context->Writeback.File, STATUS_CANCELLED);
+        else
+            FuseFileDereference(Context->Instance, Context->Writeback.File);
+    }
     if (0 != Context->InternalRequest)
         FuseFree(Context->InternalRequest);
     if ((PVOID)&Context->InternalResponseBuf != Context->InternalResponse)
@@ -83,4 +113,121 @@ VOID FuseContextDelete(FUSE_CONTEXT *Context)
 
     DEBUGFILL(Context, sizeof *Context);
     FuseFree(Context);
+
+    /* the last child to go posts its parent for processing */
+    if (0 != Parent && 0 == InterlockedDecrement(&Parent->ChildCount))
+        FuseIoqPostPending(Parent->Instance->Ioq, Parent);
+}
+
+NTSTATUS FuseContextMapPosixPath(FUSE_CONTEXT_PATH_ARENA *PathArena,
+    PWSTR WindowsPath, PSTR *PPosixPath)
+    /*
+     * Map a Windows path to a POSIX path. Pure ASCII paths only need their backslashes
+     * translated, so they are converted directly into the PathArena if they fit;
+     * all other paths are mapped by FspPosixMapWindowsToPosixPathEx into pool memory.
+     * The returned path must be freed with FuseContextDeletePosixPath.
+     */
+{
+    PAGED_CODE();
+
+    PWSTR P;
+    PSTR PosixPath;
+    ULONG Length;
+
+    for (P = WindowsPath; L'\0' != *P && 0x80 > *P; P++)
+        ;
+    Length = (ULONG)(P - WindowsPath);
+
+    if (L'\0' == *P && sizeof PathArena->Buffer - PathArena->Length > Length)
+    {
+        PosixPath = PathArena->Buffer + PathArena->Length;
+        for (ULONG I = 0; Length > I; I++)
+            PosixPath[I] = L'\\' == WindowsPath[I] ? '/' : (CHAR)WindowsPath[I];
+        PosixPath[Length] = '\0';
+        PathArena->Length += Length + 1;
+
+        *PPosixPath = PosixPath;
+        return STATUS_SUCCESS;
+    }
+
+    return FspPosixMapWindowsToPosixPathEx(WindowsPath, PPosixPath, TRUE);
+}
+
+VOID FuseContextDeletePosixPath(FUSE_CONTEXT_PATH_ARENA *PathArena, PSTR PosixPath)
+{
+    PAGED_CODE();
+
+    if (PathArena->Buffer <= PosixPath &&
+        PosixPath < PathArena->Buffer + sizeof PathArena->Buffer)
+        return;
+
+    FspPosixDeletePath(PosixPath);
+        /* handles NULL paths */
+}
+
+VOID FuseContextCreateChild(FUSE_CONTEXT **PContext,
+    FUSE_CONTEXT *Parent, UINT32 Hint)
+{
+    PAGED_CODE();
+
+    FUSE_CONTEXT *Context;
+
+    FuseContextCreate(&Context, Parent->Instance, 0);
+    ASSERT(0 != Context);
+    if (FuseContextIsStatus(Context))
+    {
+        *PContext = Context;
+        return;
+    }
+
+    Context->InternalResponse->Hint = Hint;
+    Context->OrigUid = Parent->OrigUid;
+    Context->OrigGid = Parent->OrigGid;
+    Context->OrigPid = Parent->OrigPid;
+    Context->File = Parent->File;
+    Context->Parent = Parent;
+
+    Parent->ChildCount++;
+    InsertTailList(&Parent->ChildList, &Context->ListEntry);
+
+    *PContext = Context;
+}
+
+BOOLEAN FuseContextPostChildren(FUSE_CONTEXT *Context)
+    /*
+     * This function is called after the processing of a Context has been suspended.
+     * If the Context has created children, they are posted for processing and the Context
+     * is "parked" until the last child completes and posts it again. Similarly a Context
+     * that waits for the writeback of dirty data by another Context is parked until the
+     * writeback completes (see FuseWriteback). The caller MUST NOT access the Context after
+     * this function returns TRUE.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_IOQ *Ioq = Context->Instance->Ioq;
+    LIST_ENTRY ChildList;
+
+    if (Context->Writeback.Wait)
+    {
+        Context->Writeback.Wait = FALSE;
+        if (!FuseFileWritebackWait(Context->Instance, Context->Writeback.File, Context))
+            FuseIoqPostPending(Ioq, Context);
+        return TRUE;
+    }
+
+    if (IsListEmpty(&Context->ChildList))
+        return FALSE;
+
+    ChildList = Context->ChildList;
+    /* fixup first/last list entry */
+    ChildList.Flink->Blink = &ChildList;
+    ChildList.Blink->Flink = &ChildList;
+    InitializeListHead(&Context->ChildList);
+
+    while (!IsListEmpty(&ChildList))
+        FuseIoqPostPending(Ioq,
+            CONTAINING_RECORD(RemoveHeadList(&ChildList), FUSE_CONTEXT, ListEntry));
+
+    return TRUE;
 }
@@ -411,6 +411,28 @@ VOID FuseDebugLogRequest(FUSE_PROTO_REQ *Request)
         LOG("count=%u",
             Request->req.batch_forget.count);
         break;
+    case FUSE_PROTO_OPCODE_FALLOCATE:
+        LOG("fh=%llu, offset=%llu, length=%llu, mode=0x%x",
+            Request->req.fallocate.fh,
+            Request->req.fallocate.offset,
+            Request->req.fallocate.length,
+            Request->req.fallocate.mode);
+        break;
+    case FUSE_PROTO_OPCODE_LSEEK:
+        LOG("fh=%llu, offset=%llu, whence=%u",
+            Request->req.lseek.fh,
+            Request->req.lseek.offset,
+            Request->req.lseek.whence);
+        break;
+    case FUSE_PROTO_OPCODE_COPY_FILE_RANGE:
+        LOG("fh_in=%llu, off_in=%llu, ino_out=%llu, fh_out=%llu, off_out=%llu, len=%llu",
+            Request->req.copy_file_range.fh_in,
+            Request->req.copy_file_range.off_in,
+            Request->req.copy_file_range.nodeid_out,
+            Request->req.copy_file_range.fh_out,
+            Request->req.copy_file_range.off_out,
+            Request->req.copy_file_range.len);
+        break;
     default:
         LOG("", 0);
         break;
@@ -506,12 +528,15 @@ VOID FuseDebugLogResponse(FUSE_PROTO_RSP *Response)
             Response->rsp.listxattr.size);
         break;
     case FUSE_PROTO_OPCODE_INIT:
-        LOG("major=%u, minor=%u, flags=0x%x, max_readahead=%u, max_write=%u",
+        LOG("major=%u, minor=%u, flags=0x%x, max_readahead=%u, max_write=%u, max_pages=%u, "
+            "max_background=%u",
             Response->rsp.init.major,
             Response->rsp.init.minor,
             Response->rsp.init.flags,
             Response->rsp.init.max_readahead,
-            Response->rsp.init.max_write);
+            Response->rsp.init.max_write,
+            Response->rsp.init.max_pages,
+            Response->rsp.init.max_background);
         break;
     case FUSE_PROTO_OPCODE_CREATE:
         LOG("entry=%s, fh=%llu, open_flags=0x%x",
@@ -519,6 +544,14 @@ VOID FuseDebugLogResponse(FUSE_PROTO_RSP *Response)
             Response->rsp.create.fh,
             Response->rsp.create.open_flags);
         break;
+    case FUSE_PROTO_OPCODE_LSEEK:
+        LOG("offset=%llu",
+            Response->rsp.lseek.offset);
+        break;
+    case FUSE_PROTO_OPCODE_COPY_FILE_RANGE:
+        LOG("size=%u",
+            Response->rsp.copy_file_range.size);
+        break;
     default:
         LOG("", 0);
         break;
@@ -20,11 +20,13 @@
  */
 
 #include <shared/km/shared.h>
+#include <bcrypt.h>
 
 VOID FuseFileInstanceInit(FUSE_INSTANCE *Instance)
 {
     KeInitializeSpinLock(&Instance->FileListLock);
     InitializeListHead(&Instance->FileList);
+    ExInitializeFastMutex(&Instance->WritebackMutex);
 }
 
 VOID FuseFileInstanceFini(FUSE_INSTANCE *Instance)
@@ -36,6 +38,10 @@ VOID FuseFileInstanceFini(FUSE_INSTANCE *Instance)
         File = CONTAINING_RECORD(Entry, FUSE_FILE, ListEntry);
         Entry = Entry->Flink;
         FuseCacheDereferenceItem(Instance->Cache, File->CacheItem);
+        if (0 != File->ReadAheadBuffer)
+            FuseFree(File->ReadAheadBuffer);
+        if (0 != File->DirtyBuffer)
+            FuseFree(File->DirtyBuffer);
         FuseFree(File);
     }
 }
@@ -53,6 +59,10 @@ NTSTATUS FuseFileCreate(FUSE_INSTANCE *Instance, FUSE_FILE **PFile)
         return STATUS_INSUFFICIENT_RESOURCES;
 
     RtlZeroMemory(File, sizeof *File);
+    File->RefCount = 1;
+    ExInitializeFastMutex(&File->Mutex);
+    File->ReadAheadNextOffset = (UINT64)-1LL;
+    InitializeListHead(&File->WritebackWaitList);
 
     KeAcquireSpinLock(&Instance->FileListLock, &Irql);
     InsertTailList(&Instance->FileList, &File->ListEntry);
@@ -63,16 +73,666 @@ NTSTATUS FuseFileCreate(FUSE_INSTANCE *Instance, FUSE_FILE **PFile)
     return STATUS_SUCCESS;
 }
 
-VOID FuseFileDelete(FUSE_INSTANCE *Instance, FUSE_FILE *File)
+VOID FuseFileReference(FUSE_FILE *File)
+{
+    InterlockedIncrement(&File->RefCount);
+}
+
+VOID FuseFileDereference(FUSE_INSTANCE *Instance, FUSE_FILE *File)
+    /*
+     * Release a reference to the File. The File is created with a reference that belongs to
+     * the open file (and is released by CLOSE); other references are held by work that may
+     * outlive the open file (e.g. read-ahead). The last reference deletes the File.
+     */
 {
     KIRQL Irql;
 
+    if (0 != InterlockedDecrement(&File->RefCount))
+        return;
+
     KeAcquireSpinLock(&Instance->FileListLock, &Irql);
     RemoveEntryList(&File->ListEntry);
     KeReleaseSpinLock(&Instance->FileListLock, Irql);
 
+    /* the dirty file slot of the cache item holds a reference; we cannot be in it */
+    ASSERT(File != FuseCacheGetItemDirtyFile(Instance->Cache, File->CacheItem));
+    ASSERT(IsListEmpty(&File->WritebackWaitList));
     FuseCacheDereferenceItem(Instance->Cache, File->CacheItem);
 
+    if (0 != File->ReadAheadBuffer)
+        FuseFree(File->ReadAheadBuffer);
+    if (0 != File->DirtyBuffer)
+        FuseFree(File->DirtyBuffer);
+
     DEBUGFILL(File, sizeof *File);
     FuseFree(File);
 }
+
+BOOLEAN FuseFileGetAttr(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_PROTO_ATTR *Attr, PUINT64 PExpirationTime)
+    /*
+     * Get the cached attributes of the File. Returns FALSE if they are unknown, expired or
+     * if the file has been changed since they were cached.
+     */
+{
+    UINT32 DataVersion = FuseCacheGetItemDataVersion(Instance->Cache, File->CacheItem);
+    BOOLEAN Result;
+
+    ExAcquireFastMutex(&File->Mutex);
+
+    Result = KeQueryInterruptTime() < File->AttrExpirationTime &&
+        DataVersion == File->AttrDataVersion;
+    if (Result)
+    {
+        *Attr = File->Attr;
+        *PExpirationTime = File->AttrExpirationTime;
+    }
+
+    ExReleaseFastMutex(&File->Mutex);
+
+    return Result;
+}
+
+VOID FuseFileSetAttr(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_PROTO_ATTR *Attr, UINT64 ExpirationTime)
+    /*
+     * Cache the attributes of the File. This must be called after any
+     * FuseCacheQuickExpireItem that accounts for the change that produced the attributes.
+     */
+{
+    UINT32 DataVersion = FuseCacheGetItemDataVersion(Instance->Cache, File->CacheItem);
+
+    ExAcquireFastMutex(&File->Mutex);
+
+    File->Attr = *Attr;
+    File->AttrExpirationTime = ExpirationTime;
+    File->AttrDataVersion = DataVersion;
+
+    ExReleaseFastMutex(&File->Mutex);
+}
+
+NTSTATUS FuseFileReadAheadGet(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PVOID Buffer, UINT32 Length,
+    PUINT32 PBytesTransferred, PBOOLEAN PSequential)
+    /*
+     * Copy the part of the read-ahead data that starts at Offset into Buffer (which may be
+     * a user mode buffer). Also report whether a read at Offset continues a sequential stream.
+     *
+     * The read-ahead buffer is detached from the File while it is copied, so that the copy
+     * (which may fault) is done without holding the File Mutex.
+     */
+{
+    UINT32 DataVersion = FuseCacheGetItemDataVersion(Instance->Cache, File->CacheItem);
+    PUINT8 ReadAheadBuffer = 0;
+    UINT64 ReadAheadOffset;
+    UINT32 ReadAheadLength, ReadAheadDataVersion;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    *PBytesTransferred = 0;
+
+    ExAcquireFastMutex(&File->Mutex);
+
+    *PSequential = File->ReadAheadNextOffset == Offset;
+
+    if (0 != File->ReadAheadBuffer && DataVersion != File->ReadAheadDataVersion)
+    {
+        /* file data have changed since the read-ahead; discard */
+        FuseFree(File->ReadAheadBuffer);
+        File->ReadAheadBuffer = 0;
+        File->ReadAheadLength = 0;
+    }
+
+    if (0 != File->ReadAheadBuffer &&
+        File->ReadAheadOffset <= Offset && Offset < File->ReadAheadOffset + File->ReadAheadLength)
+    {
+        ReadAheadBuffer = File->ReadAheadBuffer;
+        ReadAheadOffset = File->ReadAheadOffset;
+        ReadAheadLength = File->ReadAheadLength;
+        ReadAheadDataVersion = File->ReadAheadDataVersion;
+        File->ReadAheadBuffer = 0;
+        File->ReadAheadLength = 0;
+    }
+
+    ExReleaseFastMutex(&File->Mutex);
+
+    if (0 == ReadAheadBuffer)
+        return STATUS_SUCCESS;
+
+    UINT32 Delta = (UINT32)(Offset - ReadAheadOffset);
+    if (Length > ReadAheadLength - Delta)
+        Length = ReadAheadLength - Delta;
+
+    Result = FuseSafeCopyMemory(Buffer, ReadAheadBuffer + Delta, Length);
+    if (NT_SUCCESS(Result))
+        *PBytesTransferred = Length;
+
+    /* reattach the read-ahead buffer unless it has been consumed or replaced meanwhile */
+    if (Delta + *PBytesTransferred < ReadAheadLength)
+    {
+        ExAcquireFastMutex(&File->Mutex);
+        if (0 == File->ReadAheadBuffer)
+        {
+            File->ReadAheadOffset = ReadAheadOffset;
+            File->ReadAheadBuffer = ReadAheadBuffer;
+            File->ReadAheadLength = ReadAheadLength;
+            File->ReadAheadDataVersion = ReadAheadDataVersion;
+            ReadAheadBuffer = 0;
+        }
+        ExReleaseFastMutex(&File->Mutex);
+    }
+
+    if (0 != ReadAheadBuffer)
+        FuseFree(ReadAheadBuffer);
+
+    return Result;
+}
+
+BOOLEAN FuseFileReadAheadSet(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 NextOffset, BOOLEAN Sequential, PUINT32 PDataVersion)
+    /*
+     * Record the offset where the next sequential read is expected to start. If the read
+     * that ends at NextOffset was Sequential, no read-ahead is outstanding and the read-ahead
+     * data do not extend past NextOffset, TRUE is returned: the caller must then READ ahead
+     * at NextOffset and hand the data to FuseFileReadAheadComplete. The read-ahead data are
+     * validated by the data version of the CacheItem, so there is no read-ahead for a File
+     * without a CacheItem.
+     */
+{
+    BOOLEAN Result;
+
+    *PDataVersion = FuseCacheGetItemDataVersion(Instance->Cache, File->CacheItem);
+
+    ExAcquireFastMutex(&File->Mutex);
+
+    File->ReadAheadNextOffset = NextOffset;
+
+    Result = Sequential && 0 != Instance->MaxReadahead && 0 != File->CacheItem &&
+        !File->ReadAheadPending &&
+        (0 == File->ReadAheadBuffer ||
+            NextOffset >= File->ReadAheadOffset + File->ReadAheadLength);
+    if (Result)
+        File->ReadAheadPending = TRUE;
+
+    ExReleaseFastMutex(&File->Mutex);
+
+    return Result;
+}
+
+BOOLEAN FuseFileReadAheadComplete(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PUINT8 Buffer, UINT32 Length, UINT32 DataVersion)
+    /*
+     * Complete a read-ahead that was started because of FuseFileReadAheadSet. Buffer (which
+     * may be NULL) contains Length bytes of file data at Offset that were read while the data
+     * version of the file was DataVersion; the File takes ownership of the Buffer. Returns
+     * TRUE if the File was closed while the read-ahead was outstanding (FuseFileReleaseDefer);
+     * the caller must then RELEASE it.
+     */
+{
+    UINT32 CurrentDataVersion = FuseCacheGetItemDataVersion(Instance->Cache, File->CacheItem);
+    BOOLEAN Result;
+
+    ExAcquireFastMutex(&File->Mutex);
+
+    ASSERT(File->ReadAheadPending);
+    File->ReadAheadPending = FALSE;
+    Result = File->ReleaseDeferred;
+
+    if (0 != Buffer && 0 != Length && CurrentDataVersion == DataVersion && !Result)
+    {
+        if (0 != File->ReadAheadBuffer)
+            FuseFree(File->ReadAheadBuffer);
+        File->ReadAheadOffset = Offset;
+        File->ReadAheadBuffer = Buffer;
+        File->ReadAheadLength = Length;
+        File->ReadAheadDataVersion = DataVersion;
+        Buffer = 0;
+    }
+
+    ExReleaseFastMutex(&File->Mutex);
+
+    if (0 != Buffer)
+        FuseFree(Buffer);
+
+    return Result;
+}
+
+BOOLEAN FuseFileReleaseDefer(FUSE_INSTANCE *Instance, FUSE_FILE *File)
+    /*
+     * Called by CLOSE before it RELEASE's the File. If a read-ahead is outstanding, the
+     * RELEASE must wait for it; in this case TRUE is returned and the read-ahead sends
+     * the RELEASE when it completes (see FuseFileReadAheadComplete).
+     */
+{
+    BOOLEAN Result;
+
+    ExAcquireFastMutex(&File->Mutex);
+
+    Result = File->ReadAheadPending;
+    if (Result)
+        File->ReleaseDeferred = TRUE;
+
+    ExReleaseFastMutex(&File->Mutex);
+
+    return Result;
+}
+
+static FUSE_FILE *FuseFileWritebackReference(FUSE_INSTANCE *Instance, FUSE_FILE *File)
+    /*
+     * Get the open file (if any) that holds the dirty data of the File and reference it.
+     * The dirty file slot of the cache item holds its own reference, so the dirty file
+     * cannot go away between getting it from the slot and referencing it.
+     */
+{
+    FUSE_FILE *DirtyFile;
+
+    if (0 == FuseCacheGetItemDirtyFile(Instance->Cache, File->CacheItem))
+        return 0;
+
+    ExAcquireFastMutex(&Instance->WritebackMutex);
+    DirtyFile = FuseCacheGetItemDirtyFile(Instance->Cache, File->CacheItem);
+    if (0 != DirtyFile)
+        FuseFileReference(DirtyFile);
+    ExReleaseFastMutex(&Instance->WritebackMutex);
+
+    return DirtyFile;
+}
+
+static BOOLEAN FuseFileWritebackRelease(FUSE_INSTANCE *Instance, FUSE_FILE *DirtyFile)
+    /*
+     * Release the dirty file slot of the cache item. Must be called with the DirtyFile Mutex
+     * held. Returns TRUE if the caller must release the reference of the slot.
+     */
+{
+    BOOLEAN Result;
+
+    ExAcquireFastMutex(&Instance->WritebackMutex);
+    Result = DirtyFile == FuseCacheCompareExchangeItemDirtyFile(Instance->Cache,
+        DirtyFile->CacheItem, 0, DirtyFile);
+    ExReleaseFastMutex(&Instance->WritebackMutex);
+
+    return Result;
+}
+
+NTSTATUS FuseFileWritebackWrite(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PVOID Buffer, UINT32 Length, PBOOLEAN PAbsorbed)
+    /*
+     * Absorb a small write of Length bytes at Offset from Buffer (which may be a user mode
+     * buffer) into the dirty data of the File. The write is not absorbed if another open file
+     * holds dirty data for the file, or if it does not extend the existing dirty data
+     * contiguously, or if the dirty data would grow beyond MaxWrite or are older than
+     * FUSE_FILE_WRITEBACK_TIMEOUT or are being written back. In this case the dirty data
+     * must be written back first.
+     *
+     * A failure to write back earlier dirty data of the file is reported (once) here.
+     */
+{
+    PVOID DirtyFile;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    *PAbsorbed = FALSE;
+
+    if (0 == File->CacheItem || Instance->MaxWrite < Length)
+        return STATUS_SUCCESS;
+
+    Result = FuseCacheTakeItemWritebackStatus(Instance->Cache, File->CacheItem);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    ExAcquireFastMutex(&Instance->WritebackMutex);
+    DirtyFile = FuseCacheGetItemDirtyFile(Instance->Cache, File->CacheItem);
+    if (0 == DirtyFile)
+    {
+        /* the dirty file slot holds a reference to the dirty file */
+        FuseCacheCompareExchangeItemDirtyFile(Instance->Cache, File->CacheItem, File, 0);
+        FuseFileReference(File);
+        DirtyFile = File;
+    }
+    ExReleaseFastMutex(&Instance->WritebackMutex);
+
+    if (File != DirtyFile)
+        return STATUS_SUCCESS;
+
+    ExAcquireFastMutex(&File->Mutex);
+
+    /* the dirty file slot is only released under the File Mutex; recheck it there */
+    if (File->WritebackPending ||
+        File != FuseCacheGetItemDirtyFile(Instance->Cache, File->CacheItem))
+        /* not absorbed */;
+    else if (0 == File->DirtyLength)
+    {
+        if (0 == File->DirtyBuffer)
+            File->DirtyBuffer = FuseAlloc(Instance->MaxWrite);
+        if (0 != File->DirtyBuffer)
+        {
+            File->DirtyOffset = Offset;
+            *PAbsorbed = TRUE;
+        }
+    }
+    else
+        *PAbsorbed =
+            File->DirtyOffset <= Offset && Offset <= File->DirtyOffset + File->DirtyLength &&
+            Offset + Length - File->DirtyOffset <= Instance->MaxWrite &&
+            KeQueryInterruptTime() < File->DirtyTime + FUSE_FILE_WRITEBACK_TIMEOUT;
+
+    if (*PAbsorbed)
+    {
+        UINT32 Delta = (UINT32)(Offset - File->DirtyOffset);
+
+        Result = FuseSafeCopyMemory(File->DirtyBuffer + Delta, Buffer, Length);
+        if (NT_SUCCESS(Result))
+        {
+            if (0 == File->DirtyLength)
+                File->DirtyTime = KeQueryInterruptTime();
+            if (File->DirtyLength < Delta + Length)
+                File->DirtyLength = Delta + Length;
+        }
+        else
+            *PAbsorbed = FALSE;
+    }
+
+    ExReleaseFastMutex(&File->Mutex);
+
+    return Result;
+}
+
+NTSTATUS FuseFileWritebackRead(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PVOID Buffer, UINT32 Length, PUINT32 PBytesTransferred)
+    /*
+     * Overlay the dirty data of the file (which may be held by another open file) onto the
+     * result of a read of Length bytes at Offset into Buffer (which may be a user mode buffer),
+     * of which *PBytesTransferred bytes were read from the user mode file system. Dirty data
+     * that continue past the end of the data read extend the read.
+     */
+{
+    FUSE_FILE *DirtyFile;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    DirtyFile = FuseFileWritebackReference(Instance, File);
+    if (0 == DirtyFile)
+        return STATUS_SUCCESS;
+
+    ExAcquireFastMutex(&DirtyFile->Mutex);
+
+    if (0 != DirtyFile->DirtyLength &&
+        DirtyFile->DirtyOffset < Offset + Length &&
+        Offset < DirtyFile->DirtyOffset + DirtyFile->DirtyLength)
+    {
+        UINT64 StartOffset = Offset < DirtyFile->DirtyOffset ?
+            DirtyFile->DirtyOffset : Offset;
+        UINT64 EndOffset = Offset + Length < DirtyFile->DirtyOffset + DirtyFile->DirtyLength ?
+            Offset + Length : DirtyFile->DirtyOffset + DirtyFile->DirtyLength;
+
+        /* dirty data never start past the end of file, so there is no hole to fill */
+        if (StartOffset <= Offset + *PBytesTransferred)
+        {
+            Result = FuseSafeCopyMemory(
+                (PUINT8)Buffer + (StartOffset - Offset),
+                DirtyFile->DirtyBuffer + (StartOffset - DirtyFile->DirtyOffset),
+                (UINT32)(EndOffset - StartOffset));
+            if (NT_SUCCESS(Result) && *PBytesTransferred < EndOffset - Offset)
+                *PBytesTransferred = (UINT32)(EndOffset - Offset);
+        }
+    }
+
+    ExReleaseFastMutex(&DirtyFile->Mutex);
+
+    FuseFileDereference(Instance, DirtyFile);
+
+    return Result;
+}
+
+VOID FuseFileWritebackAttr(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_PROTO_ATTR *Attr)
+    /*
+     * Account for the dirty data of the file (which may be held by another open file) in
+     * attributes that were reported by the user mode file system.
+     */
+{
+    FUSE_FILE *DirtyFile;
+
+    DirtyFile = FuseFileWritebackReference(Instance, File);
+    if (0 == DirtyFile)
+        return;
+
+    ExAcquireFastMutex(&DirtyFile->Mutex);
+
+    if (0 != DirtyFile->DirtyLength &&
+        Attr->size < DirtyFile->DirtyOffset + DirtyFile->DirtyLength)
+        Attr->size = DirtyFile->DirtyOffset + DirtyFile->DirtyLength;
+
+    ExReleaseFastMutex(&DirtyFile->Mutex);
+
+    FuseFileDereference(Instance, DirtyFile);
+}
+
+BOOLEAN FuseFileWritebackTake(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_FILE **PDirtyFile, PUINT8 *PBuffer, PUINT64 POffset, PUINT32 PLength)
+    /*
+     * Take the dirty data of the file (which may be held by another open file) in order to
+     * write them back using the handle of the returned DirtyFile, which is referenced. The
+     * dirty data remain with the DirtyFile (and visible to reads) until the caller completes
+     * the writeback with FuseFileWritebackComplete.
+     *
+     * Returns TRUE if the dirty data are already being written back; in this case Buffer is
+     * NULL and the caller must wait for the writeback (FuseFileWritebackWait), release the
+     * DirtyFile and try again.
+     */
+{
+    FUSE_FILE *DirtyFile;
+    BOOLEAN Pending, Release = FALSE;
+
+    *PDirtyFile = 0;
+    *PBuffer = 0;
+    *POffset = 0;
+    *PLength = 0;
+
+    DirtyFile = FuseFileWritebackReference(Instance, File);
+    if (0 == DirtyFile)
+        return FALSE;
+
+    ExAcquireFastMutex(&DirtyFile->Mutex);
+
+    Pending = DirtyFile->WritebackPending;
+    if (Pending)
+        ;
+    else if (0 != DirtyFile->DirtyLength)
+    {
+        DirtyFile->WritebackPending = TRUE;
+        *PBuffer = DirtyFile->DirtyBuffer;
+        *POffset = DirtyFile->DirtyOffset;
+        *PLength = DirtyFile->DirtyLength;
+    }
+    else
+    {
+        /* no dirty data (e.g. the dirty buffer could not be allocated) */
+        DirtyFile->DirtyTime = 0;
+        Release = FuseFileWritebackRelease(Instance, DirtyFile);
+    }
+
+    ExReleaseFastMutex(&DirtyFile->Mutex);
+
+    if (!Pending && 0 == *PBuffer)
+    {
+        if (Release)
+            FuseFileDereference(Instance, DirtyFile);
+        FuseFileDereference(Instance, DirtyFile);
+        return FALSE;
+    }
+
+    *PDirtyFile = DirtyFile;
+
+    return Pending;
+}
+
+VOID FuseFileWritebackComplete(FUSE_INSTANCE *Instance, FUSE_FILE *DirtyFile,
+    NTSTATUS Status)
+    /*
+     * Complete the writeback of dirty data that were taken with FuseFileWritebackTake. The
+     * dirty data are discarded, a failure is recorded in the cache item (to be reported by
+     * the next operation on the file that can fail), the Context's that wait for the
+     * writeback are posted and the DirtyFile is released.
+     */
+{
+    LIST_ENTRY WaitList;
+    BOOLEAN Release;
+
+    ExAcquireFastMutex(&DirtyFile->Mutex);
+
+    ASSERT(DirtyFile->WritebackPending);
+    DirtyFile->WritebackPending = FALSE;
+    DirtyFile->DirtyLength = 0;
+    DirtyFile->DirtyTime = 0;
+
+    InitializeListHead(&WaitList);
+    if (!IsListEmpty(&DirtyFile->WritebackWaitList))
+    {
+        WaitList = DirtyFile->WritebackWaitList;
+        /* fixup first/last list entry */
+        WaitList.Flink->Blink = &WaitList;
+        WaitList.Blink->Flink = &WaitList;
+        InitializeListHead(&DirtyFile->WritebackWaitList);
+    }
+
+    Release = FuseFileWritebackRelease(Instance, DirtyFile);
+
+    ExReleaseFastMutex(&DirtyFile->Mutex);
+
+    FuseCacheSetItemWritebackStatus(Instance->Cache, DirtyFile->CacheItem, Status);
+
+    while (!IsListEmpty(&WaitList))
+        FuseIoqPostPending(Instance->Ioq,
+            CONTAINING_RECORD(RemoveHeadList(&WaitList), FUSE_CONTEXT, ListEntry));
+
+    if (Release)
+        FuseFileDereference(Instance, DirtyFile);
+    FuseFileDereference(Instance, DirtyFile);
+}
+
+BOOLEAN FuseFileWritebackWait(FUSE_INSTANCE *Instance, FUSE_FILE *DirtyFile,
+    FUSE_CONTEXT *Context)
+    /*
+     * Park the Context until the writeback of the dirty data of the DirtyFile completes;
+     * FuseFileWritebackComplete posts it then. Returns FALSE if the writeback has already
+     * completed; in this case the Context is not parked.
+     */
+{
+    BOOLEAN Result;
+
+    ExAcquireFastMutex(&DirtyFile->Mutex);
+
+    Result = DirtyFile->WritebackPending;
+    if (Result)
+        InsertTailList(&DirtyFile->WritebackWaitList, &Context->ListEntry);
+
+    ExReleaseFastMutex(&DirtyFile->Mutex);
+
+    return Result;
+}
+
+FUSE_FILE *FuseFileWritebackExpired(FUSE_INSTANCE *Instance, UINT64 ExpirationTime)
+    /*
+     * Get (and reference) an open file with dirty data that are older than
+     * FUSE_FILE_WRITEBACK_TIMEOUT and queue it for writeback. The file is dequeued with
+     * FuseFileWritebackDequeue after the writeback.
+     */
+{
+    FUSE_FILE *File, *Result = 0;
+    UINT64 DirtyTime;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Instance->FileListLock, &Irql);
+
+    for (PLIST_ENTRY Entry = Instance->FileList.Flink; &Instance->FileList != Entry;
+        Entry = Entry->Flink)
+    {
+        File = CONTAINING_RECORD(Entry, FUSE_FILE, ListEntry);
+        /* DirtyTime is protected by the File Mutex; a stale value only delays the writeback */
+        DirtyTime = *(volatile UINT64 *)&File->DirtyTime;
+        if (!File->WritebackQueued &&
+            0 != DirtyTime && DirtyTime + FUSE_FILE_WRITEBACK_TIMEOUT <= ExpirationTime)
+        {
+            File->WritebackQueued = TRUE;
+            FuseFileReference(File);
+            Result = File;
+            break;
+        }
+    }
+
+    KeReleaseSpinLock(&Instance->FileListLock, Irql);
+
+    return Result;
+}
+
+VOID FuseFileWritebackDequeue(FUSE_INSTANCE *Instance, FUSE_FILE *File)
+{
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Instance->FileListLock, &Irql);
+    File->WritebackQueued = FALSE;
+    KeReleaseSpinLock(&Instance->FileListLock, Irql);
+
+    FuseFileDereference(Instance, File);
+}
+
+NTSTATUS FuseFileCopySourceSet(FUSE_INSTANCE *Instance, FUSE_FILE *File, PUINT64 PCopyToken)
+    /*
+     * Make the File the source of a server-side copy and return the token that designates
+     * it. The token is a 64-bit number from the system RNG, so that it cannot be guessed
+     * (0 is reserved to mean no token).
+     */
+{
+    UINT64 CopyToken;
+    KIRQL Irql;
+    NTSTATUS Result;
+
+    Result = BCryptGenRandom(0, (PUCHAR)&CopyToken, sizeof CopyToken,
+        BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (!NT_SUCCESS(Result))
+        return Result;
+    if (0 == CopyToken)
+        CopyToken = 1;
+
+    KeAcquireSpinLock(&Instance->FileListLock, &Irql);
+    File->CopyToken = CopyToken;
+    File->CopyExpirationTime = KeQueryInterruptTime() + FUSE_FILE_COPY_SOURCE_TIMEOUT;
+    KeReleaseSpinLock(&Instance->FileListLock, Irql);
+
+    *PCopyToken = CopyToken;
+
+    return STATUS_SUCCESS;
+}
+
+FUSE_FILE *FuseFileCopySourceTake(FUSE_INSTANCE *Instance, UINT64 CopyToken)
+    /*
+     * Take the source file of a server-side copy that is designated by the CopyToken.
+     * If the CopyToken is 0, take any source file that has expired instead. A taken file
+     * no longer has a token; the caller must RELEASE and delete it.
+     *
+     * Source files live in the FileList with all other open files. Server-side copies
+     * are infrequent, so a linear search is preferable to maintaining another list.
+     */
+{
+    UINT64 ExpirationTime = KeQueryInterruptTime();
+    FUSE_FILE *Result = 0, *File;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Instance->FileListLock, &Irql);
+    for (PLIST_ENTRY Entry = Instance->FileList.Flink; &Instance->FileList != Entry;
+        Entry = Entry->Flink)
+    {
+        File = CONTAINING_RECORD(Entry, FUSE_FILE, ListEntry);
+        if (0 == File->CopyToken)
+            continue;
+        if (0 != CopyToken ?
+            CopyToken == File->CopyToken && ExpirationTime < File->CopyExpirationTime :
+            ExpirationTime >= File->CopyExpirationTime)
+        {
+            File->CopyToken = 0;
+            Result = File;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&Instance->FileListLock, Irql);
+
+    return Result;
+}
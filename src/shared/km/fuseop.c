@@ -24,12 +24,32 @@
 static BOOLEAN FuseOpReserved_Init(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpReserved_Destroy(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpReserved_Forget(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_Lookup(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_Read(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_Write(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_ReadAhead(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpReserved_Writeback(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpReserved(FUSE_CONTEXT *Context);
 static VOID FuseLookup(FUSE_CONTEXT *Context);
+static VOID FuseUpdateFileAttr(FUSE_CONTEXT *Context);
+static VOID FuseWriteback(FUSE_CONTEXT *Context);
+static VOID FuseReadAhead(FUSE_CONTEXT *Context, UINT64 Offset, UINT32 DataVersion);
+static VOID FuseReadAhead_ContextFini(FUSE_CONTEXT *Context);
+static ULONG FuseOpGuardDirIndex(PWSTR FileName, BOOLEAN Parent);
+static INT FuseOpGuardDirs(FUSE_CONTEXT *Context, BOOLEAN Acquire,
+    ULONG Index1, ULONG Index2, BOOLEAN Exclusive);
+static UINT32 FuseAccessMask(
+    UINT32 FileUid, UINT32 FileGid, UINT32 FileMode,
+    UINT32 OrigUid, UINT32 OrigGid);
+static NTSTATUS FuseAccessCheckMask(
+    UINT32 FileAccess, UINT32 DesiredAccess,
+    PUINT32 PGrantedAccess);
 static NTSTATUS FuseAccessCheck(
     UINT32 FileUid, UINT32 FileGid, UINT32 FileMode,
     UINT32 OrigUid, UINT32 OrigGid, UINT32 DesiredAccess,
     PUINT32 PGrantedAccess);
+static NTSTATUS FuseLookupPathAccessCheck(FUSE_CONTEXT *Context,
+    UINT32 DesiredAccess, PUINT32 PGrantedAccess);
 static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context);
 static VOID FusePrepareLookupPath2(FUSE_CONTEXT *Context);
 static VOID FusePrepareLookupPath_ContextFini(FUSE_CONTEXT *Context);
@@ -39,7 +59,9 @@ static VOID FuseOpenCheck(FUSE_CONTEXT *Context);
 static VOID FuseOverwriteCheck(FUSE_CONTEXT *Context);
 static VOID FuseOpenTargetDirectoryCheck(FUSE_CONTEXT *Context);
 static VOID FuseRenameCheck(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpenResult(FUSE_CONTEXT *Context, FUSE_FILE *File, PUINT32 POpenFlags);
 static VOID FuseCreate(FUSE_CONTEXT *Context);
+static VOID FuseCreateOptimistic(FUSE_CONTEXT *Context);
 static VOID FuseOpen(FUSE_CONTEXT *Context);
 static VOID FuseOpCreate_FileCreate(FUSE_CONTEXT *Context);
 static VOID FuseOpCreate_FileOpen(FUSE_CONTEXT *Context);
@@ -54,8 +76,14 @@ static BOOLEAN FuseOpCleanup(FUSE_CONTEXT *Context);
 static INT FuseOgCleanup(FUSE_CONTEXT *Context, BOOLEAN Acquire);
 static BOOLEAN FuseOpClose(FUSE_CONTEXT *Context);
 static VOID FuseOpClose_ContextFini(FUSE_CONTEXT *Context);
+static VOID FuseOpRead_ReadChunks(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpRead_CompleteChunks(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpRead(FUSE_CONTEXT *Context);
+static VOID FuseOpRead_ContextFini(FUSE_CONTEXT *Context);
+static VOID FuseOpWrite_WriteChunks(FUSE_CONTEXT *Context);
+static BOOLEAN FuseOpWrite_CompleteChunks(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpWrite(FUSE_CONTEXT *Context);
+static VOID FuseOpWrite_ContextFini(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpQueryInformation(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpSetInformation_SetBasicInfo(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpSetInformation_SetAllocationSize(FUSE_CONTEXT *Context);
@@ -72,12 +100,21 @@ static BOOLEAN FuseAddDirInfo(FUSE_CONTEXT *Context,
     PSTRING Name, UINT64 NextOffset, FUSE_PROTO_ATTR *Attr,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred);
 static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context);
+static VOID FuseOpQueryDirectory_CacheEntries(FUSE_CONTEXT *Context);
+static VOID FuseOpQueryDirectory_LookupEntries(FUSE_CONTEXT *Context);
 static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpQueryDirectory(FUSE_CONTEXT *Context);
 static VOID FuseOpQueryDirectory_ContextFini(FUSE_CONTEXT *Context);
 static INT FuseOgQueryDirectory(FUSE_CONTEXT *Context, BOOLEAN Acquire);
 static BOOLEAN FuseOpFileSystemControl(FUSE_CONTEXT *Context);
+static NTSTATUS FuseOpDeviceControl_SetOutput(FUSE_CONTEXT *Context,
+    PVOID Buffer, ULONG Length);
+static VOID FuseOpDeviceControl_ReleaseSource(FUSE_CONTEXT *Context);
+static VOID FuseOpDeviceControl_CopySource(FUSE_CONTEXT *Context);
+static VOID FuseOpDeviceControl_CopyFileRange(FUSE_CONTEXT *Context);
+static VOID FuseOpDeviceControl_Seek(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpDeviceControl(FUSE_CONTEXT *Context);
+static VOID FuseOpDeviceControl_ContextFini(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpQuerySecurity(FUSE_CONTEXT *Context);
 static BOOLEAN FuseOpSetSecurity(FUSE_CONTEXT *Context);
 static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
@@ -86,9 +123,23 @@ static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
 #pragma alloc_text(PAGE, FuseOpReserved_Init)
 #pragma alloc_text(PAGE, FuseOpReserved_Destroy)
 #pragma alloc_text(PAGE, FuseOpReserved_Forget)
+#pragma alloc_text(PAGE, FuseOpReserved_Lookup)
+#pragma alloc_text(PAGE, FuseOpReserved_Read)
+#pragma alloc_text(PAGE, FuseOpReserved_Write)
+#pragma alloc_text(PAGE, FuseOpReserved_ReadAhead)
+#pragma alloc_text(PAGE, FuseOpReserved_Writeback)
 #pragma alloc_text(PAGE, FuseOpReserved)
 #pragma alloc_text(PAGE, FuseLookup)
+#pragma alloc_text(PAGE, FuseUpdateFileAttr)
+#pragma alloc_text(PAGE, FuseWriteback)
+#pragma alloc_text(PAGE, FuseReadAhead)
+#pragma alloc_text(PAGE, FuseReadAhead_ContextFini)
+#pragma alloc_text(PAGE, FuseOpGuardDirIndex)
+#pragma alloc_text(PAGE, FuseOpGuardDirs)
+#pragma alloc_text(PAGE, FuseAccessMask)
+#pragma alloc_text(PAGE, FuseAccessCheckMask)
 #pragma alloc_text(PAGE, FuseAccessCheck)
+#pragma alloc_text(PAGE, FuseLookupPathAccessCheck)
 #pragma alloc_text(PAGE, FusePrepareLookupPath)
 #pragma alloc_text(PAGE, FusePrepareLookupPath2)
 #pragma alloc_text(PAGE, FusePrepareLookupPath_ContextFini)
@@ -98,7 +149,9 @@ static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
 #pragma alloc_text(PAGE, FuseOverwriteCheck)
 #pragma alloc_text(PAGE, FuseOpenTargetDirectoryCheck)
 #pragma alloc_text(PAGE, FuseRenameCheck)
+#pragma alloc_text(PAGE, FuseOpenResult)
 #pragma alloc_text(PAGE, FuseCreate)
+#pragma alloc_text(PAGE, FuseCreateOptimistic)
 #pragma alloc_text(PAGE, FuseOpen)
 #pragma alloc_text(PAGE, FuseOpCreate_FileCreate)
 #pragma alloc_text(PAGE, FuseOpCreate_FileOpen)
@@ -113,8 +166,14 @@ static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
 #pragma alloc_text(PAGE, FuseOgCleanup)
 #pragma alloc_text(PAGE, FuseOpClose)
 #pragma alloc_text(PAGE, FuseOpClose_ContextFini)
+#pragma alloc_text(PAGE, FuseOpRead_ReadChunks)
+#pragma alloc_text(PAGE, FuseOpRead_CompleteChunks)
 #pragma alloc_text(PAGE, FuseOpRead)
+#pragma alloc_text(PAGE, FuseOpRead_ContextFini)
+#pragma alloc_text(PAGE, FuseOpWrite_WriteChunks)
+#pragma alloc_text(PAGE, FuseOpWrite_CompleteChunks)
 #pragma alloc_text(PAGE, FuseOpWrite)
+#pragma alloc_text(PAGE, FuseOpWrite_ContextFini)
 #pragma alloc_text(PAGE, FuseOpQueryInformation)
 #pragma alloc_text(PAGE, FuseOpSetInformation_SetBasicInfo)
 #pragma alloc_text(PAGE, FuseOpSetInformation_SetAllocationSize)
@@ -129,12 +188,20 @@ static VOID FuseSecurity_ContextFini(FUSE_CONTEXT *Context);
 #pragma alloc_text(PAGE, FuseOpQueryVolumeInformation)
 #pragma alloc_text(PAGE, FuseAddDirInfo)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory_GetDirInfoByName)
+#pragma alloc_text(PAGE, FuseOpQueryDirectory_CacheEntries)
+#pragma alloc_text(PAGE, FuseOpQueryDirectory_LookupEntries)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory_ReadDirectory)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory)
 #pragma alloc_text(PAGE, FuseOpQueryDirectory_ContextFini)
 #pragma alloc_text(PAGE, FuseOgQueryDirectory)
 #pragma alloc_text(PAGE, FuseOpFileSystemControl)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_SetOutput)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_ReleaseSource)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_CopySource)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_CopyFileRange)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_Seek)
 #pragma alloc_text(PAGE, FuseOpDeviceControl)
+#pragma alloc_text(PAGE, FuseOpDeviceControl_ContextFini)
 #pragma alloc_text(PAGE, FuseOpQuerySecurity)
 #pragma alloc_text(PAGE, FuseOpSetSecurity)
 #pragma alloc_text(PAGE, FuseSecurity_ContextFini)
@@ -162,7 +229,48 @@ static BOOLEAN FuseOpReserved_Init(FUSE_CONTEXT *Context)
 
         Instance->VersionMajor = Context->FuseResponse->rsp.init.major;
         Instance->VersionMinor = Context->FuseResponse->rsp.init.minor;
-        // !!!: REVISIT
+
+        /* see linux/fs/fuse/inode.c:process_init_reply */
+        Instance->InitFlags = 0;
+        Instance->MaxReadahead = 0;
+        Instance->MaxPages = FUSE_PROTO_DEFAULT_MAX_PAGES;
+        Instance->MaxWrite = FUSE_PROTO_PAGE_SIZE;
+        Instance->MaxBackground = FUSE_PROTO_DEFAULT_MAX_BACKGROUND;
+        if (6 <= Instance->VersionMinor)
+        {
+            Instance->InitFlags = Context->FuseResponse->rsp.init.flags & FUSE_PROTO_INIT_FLAGS;
+            Instance->MaxReadahead = Context->FuseResponse->rsp.init.max_readahead;
+            if (Instance->MaxReadahead > FUSE_PROTO_INIT_MAX_READAHEAD)
+                Instance->MaxReadahead = FUSE_PROTO_INIT_MAX_READAHEAD;
+        }
+        if (FlagOn(Instance->InitFlags, FUSE_PROTO_INIT_MAX_PAGES))
+        {
+            Instance->MaxPages = Context->FuseResponse->rsp.init.max_pages;
+            if (1 > Instance->MaxPages)
+                Instance->MaxPages = 1;
+            else if (FUSE_PROTO_MAX_MAX_PAGES < Instance->MaxPages)
+                Instance->MaxPages = FUSE_PROTO_MAX_MAX_PAGES;
+        }
+        if (5 <= Instance->VersionMinor &&
+            FUSE_PROTO_PAGE_SIZE < Context->FuseResponse->rsp.init.max_write)
+            Instance->MaxWrite = Context->FuseResponse->rsp.init.max_write;
+        Instance->MaxRead = Instance->MaxPages * FUSE_PROTO_PAGE_SIZE;
+        if (Instance->MaxWrite > Instance->MaxRead)
+            Instance->MaxWrite = Instance->MaxRead;
+        if (13 <= Instance->VersionMinor &&
+            0 != Context->FuseResponse->rsp.init.max_background)
+            Instance->MaxBackground = Context->FuseResponse->rsp.init.max_background;
+
+        DEBUGLOG("version=%u.%u, flags=0x%x, max_readahead=%u, max_pages=%u, max_read=%u, max_write=%u, "
+            "max_background=%u",
+            Instance->VersionMajor, Instance->VersionMinor,
+            Instance->InitFlags,
+            Instance->MaxReadahead,
+            Instance->MaxPages,
+            Instance->MaxRead,
+            Instance->MaxWrite,
+            Instance->MaxBackground);
+
         KeSetEvent(&Instance->InitEvent, 1, FALSE);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -202,6 +310,147 @@ static BOOLEAN FuseOpReserved_Forget(FUSE_CONTEXT *Context)
     return FALSE;
 }
 
+static BOOLEAN FuseOpReserved_Lookup(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    coro_block (Context->CoroState)
+    {
+        coro_await (FuseLookup(Context));
+
+        Context->LookupChild.Result->Status = Context->InternalResponse->IoStatus.Status;
+        if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            Context->LookupChild.Result->Attr = Context->LookupChild.Attr;
+    }
+
+    return coro_active();
+}
+
+static BOOLEAN FuseOpReserved_Read(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    coro_block (Context->CoroState)
+    {
+        /* the data are copied to the chunk destination when the response arrives */
+        Context->ResponseData.Address = Context->ReadChild.Address + Context->ReadChild.Offset;
+        Context->ResponseData.Length = Context->ReadChild.Length;
+
+        coro_await (FuseProtoSendRead(Context));
+        if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+        {
+            UINT32 BytesTransferred = Context->FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE;
+            if (Context->ReadChild.Length < BytesTransferred)
+                Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
+            else
+            {
+                Context->InternalResponse->IoStatus.Status = Context->ResponseData.Status;
+                Context->ReadChild.Result->BytesTransferred = BytesTransferred;
+            }
+        }
+
+        Context->ReadChild.Result->Status = Context->InternalResponse->IoStatus.Status;
+    }
+
+    return coro_active();
+}
+
+static BOOLEAN FuseOpReserved_Write(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    coro_block (Context->CoroState)
+    {
+        /* a chunk is normally sent in one WRITE, unless the request buffer is too small */
+        while (0 != Context->WriteChild.Remain)
+        {
+            FuseContextWaitRequest(Context);
+
+            Context->WriteChild.Length = Context->WriteChild.Remain;
+            if (Context->WriteChild.Length > Context->Instance->MaxWrite)
+                Context->WriteChild.Length = Context->Instance->MaxWrite;
+            if (Context->WriteChild.Length > Context->FuseRequestLength - FUSE_PROTO_REQ_SIZE(write))
+                Context->WriteChild.Length = Context->FuseRequestLength - FUSE_PROTO_REQ_SIZE(write);
+
+            Context->InternalResponse->IoStatus.Status = FuseSafeCopyMemory(
+                (PUINT8)Context->FuseRequest + FUSE_PROTO_REQ_SIZE(write),
+                Context->WriteChild.Address + Context->WriteChild.Offset,
+                Context->WriteChild.Length);
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                break;
+
+            coro_await (FuseProtoSendWrite(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                break;
+
+            UINT32 BytesTransferred = Context->FuseResponse->rsp.write.size;
+            if (Context->WriteChild.Length < BytesTransferred)
+            {
+                Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
+                break;
+            }
+
+            Context->WriteChild.Remain -= BytesTransferred;
+            Context->WriteChild.Offset += BytesTransferred;
+            Context->WriteChild.Result->BytesTransferred += BytesTransferred;
+
+            if (Context->WriteChild.Length > BytesTransferred)
+                break;
+        }
+
+        Context->WriteChild.Result->Status = Context->InternalResponse->IoStatus.Status;
+    }
+
+    return coro_active();
+}
+
+static BOOLEAN FuseOpReserved_ReadAhead(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    coro_block (Context->CoroState)
+    {
+        Context->ResponseData.Address = Context->ReadAhead.Buffer;
+        Context->ResponseData.Length = Context->ReadAhead.Length;
+
+        coro_await (FuseProtoSendRead(Context));
+
+        UINT32 BytesTransferred = 0;
+        if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+            NT_SUCCESS(Context->ResponseData.Status))
+        {
+            BytesTransferred = Context->FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE;
+            if (Context->ReadAhead.Length < BytesTransferred)
+                BytesTransferred = 0;
+        }
+
+        BOOLEAN Release = FuseFileReadAheadComplete(Context->Instance, Context->File,
+            Context->ReadAhead.StartOffset,
+            Context->ReadAhead.Buffer, BytesTransferred,
+            Context->ReadAhead.DataVersion);
+        Context->ReadAhead.Buffer = 0;
+
+        /* the file was closed while we were reading ahead; CLOSE left the RELEASE to us */
+        if (Release)
+            coro_await (FuseProtoSendRelease(Context));
+    }
+
+    return coro_active();
+}
+
+static BOOLEAN FuseOpReserved_Writeback(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    coro_block (Context->CoroState)
+    {
+        /* timed writeback of dirty data (see FuseProtoPostWriteback) */
+        coro_await (FuseWriteback(Context));
+    }
+
+    return coro_active();
+}
+
 static BOOLEAN FuseOpReserved(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
@@ -215,6 +464,16 @@ static BOOLEAN FuseOpReserved(FUSE_CONTEXT *Context)
     case FUSE_PROTO_OPCODE_FORGET:
     case FUSE_PROTO_OPCODE_BATCH_FORGET:
         return FuseOpReserved_Forget(Context);
+    case FUSE_PROTO_OPCODE_LOOKUP:
+        return FuseOpReserved_Lookup(Context);
+    case FUSE_PROTO_OPCODE_READ:
+        /* a READ without a parent is a read-ahead (see FuseReadAhead) */
+        return 0 != Context->Parent ?
+            FuseOpReserved_Read(Context) : FuseOpReserved_ReadAhead(Context);
+    case FUSE_PROTO_OPCODE_WRITE:
+        /* a WRITE without a parent is a timed writeback (see FuseProtoPostWriteback) */
+        return 0 != Context->Parent ?
+            FuseOpReserved_Write(Context) : FuseOpReserved_Writeback(Context);
     default:
         return FALSE;
     }
@@ -229,9 +488,13 @@ static VOID FuseLookup(FUSE_CONTEXT *Context)
 
     coro_block (Context->CoroState)
     {
-        if (!FuseCacheGetEntry(Context->Instance->Cache,
-            Context->Lookup.Ino, &Context->Lookup.Name, Entry, &CacheItem))
+        Context->Lookup.Cached = FuseCacheGetEntry(Context->Instance->Cache,
+            Context->Lookup.Ino, &Context->Lookup.Name, Entry, &Context->Lookup.Access,
+            &CacheItem);
+        if (!Context->Lookup.Cached)
         {
+            RtlZeroMemory(&Context->Lookup.Access, sizeof Context->Lookup.Access);
+
             if (FUSE_PROTO_ROOT_INO == Context->Lookup.Ino &&
                 1 == Context->Lookup.Name.Length && '/' == Context->Lookup.Name.Buffer[0])
             {
@@ -283,24 +546,280 @@ static inline ACCESS_MASK FusePosixMapPermissionToAccessMask(UINT32 Mode, UINT32
         ((Perm & 1) ? FILE_EXECUTE : 0);
 }
 
-static NTSTATUS FuseAccessCheck(
-    UINT32 FileUid, UINT32 FileGid, UINT32 FileMode,
-    UINT32 OrigUid, UINT32 OrigGid, UINT32 DesiredAccess,
-    PUINT32 PGrantedAccess)
+static VOID FuseUpdateFileAttr(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /* remember the attributes from a GETATTR (or SETATTR) reply on the open File */
+    FuseFileSetAttr(Context->Instance, Context->File,
+        &Context->FuseResponse->rsp.getattr.attr,
+        KeQueryInterruptTime() +
+            Context->FuseResponse->rsp.getattr.attr_valid * 10000000 +
+            Context->FuseResponse->rsp.getattr.attr_valid_nsec / 100);
+}
+
+static VOID FuseWriteback(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Write back the dirty data of the file (FUSE_PROTO_INIT_WRITEBACK_CACHE) as a single
+     * large WRITE. The dirty data may be held by another open file, in which case they are
+     * written using the handle of that open file (which we reference meanwhile). The dirty
+     * data stay visible to reads until the WRITE completes. If they are already being
+     * written back by another Context (e.g. a timed writeback), we wait for it.
+     *
+     * A failure is recorded in the cache item. Unless the current operation cannot fail
+     * (Cleanup, Close, timed writeback) any recorded failure (including one from earlier
+     * writebacks) is then reported (once) as the status of the current operation.
+     */
+
+    FUSE_CONTEXT *Child;
+    UINT64 Offset;
+    UINT32 Length;
+    NTSTATUS Result;
+
+    coro_block (Context->CoroState)
+    {
+        if (!FlagOn(Context->Instance->InitFlags, FUSE_PROTO_INIT_WRITEBACK_CACHE))
+            coro_break;
+
+        while (FuseFileWritebackTake(Context->Instance, Context->File,
+            &Context->Writeback.File, &Context->Writeback.Buffer, &Offset, &Length))
+        {
+            /* parked by FuseContextPostChildren until the other writeback completes */
+            Context->Writeback.Wait = TRUE;
+            coro_yield;
+
+            FuseFileDereference(Context->Instance, Context->Writeback.File);
+            Context->Writeback.File = 0;
+        }
+
+        if (0 != Context->Writeback.Buffer)
+        {
+            Context->Writeback.Result.Status = STATUS_CANCELLED;
+            Context->Writeback.Result.Length = Length;
+            Context->Writeback.Result.BytesTransferred = 0;
+
+            FuseContextCreateChild(&Child, Context, FUSE_PROTO_OPCODE_WRITE);
+            ASSERT(0 != Child);
+            if (FuseContextIsStatus(Child))
+                Context->Writeback.Result.Status = FuseContextToStatus(Child);
+            else
+            {
+                Child->File = Context->Writeback.File;
+                Child->WriteChild.StartOffset = Offset;
+                Child->WriteChild.Offset = 0;
+                Child->WriteChild.Remain = Length;
+                Child->WriteChild.Address = Context->Writeback.Buffer;
+                Child->WriteChild.Result = &Context->Writeback.Result;
+
+                FuseContextWaitChildren(Context);
+            }
+
+            if (NT_SUCCESS(Context->Writeback.Result.Status) &&
+                Context->Writeback.Result.Length > Context->Writeback.Result.BytesTransferred)
+                Context->Writeback.Result.Status = STATUS_IO_DEVICE_ERROR;
+
+            /* the dirty buffer belongs to the dirty file; it is kept for reuse */
+            FuseFileWritebackComplete(Context->Instance, Context->Writeback.File,
+                Context->Writeback.Result.Status);
+            Context->Writeback.File = 0;
+            Context->Writeback.Buffer = 0;
+
+            /* file data have changed: invalidate cached attributes and read-ahead data */
+            FuseCacheQuickExpireItem(Context->Instance->Cache,
+                Context->File->CacheItem);
+        }
+
+        if (0 != Context->InternalRequest &&
+            FspFsctlTransactCleanupKind != Context->InternalRequest->Kind &&
+            FspFsctlTransactCloseKind != Context->InternalRequest->Kind)
+        {
+            Result = FuseCacheTakeItemWritebackStatus(Context->Instance->Cache,
+                Context->File->CacheItem);
+            if (!NT_SUCCESS(Result))
+                Context->InternalResponse->IoStatus.Status = (UINT32)Result;
+        }
+    }
+}
+
+static VOID FuseReadAhead(FUSE_CONTEXT *Context, UINT64 Offset, UINT32 DataVersion)
+{
+    PAGED_CODE();
+
+    /*
+     * Start a read-ahead of the file data at Offset in the background. The READ is sent
+     * by a detached reserved Context that holds a reference on the File and is completed
+     * by FuseOpReserved_ReadAhead. The current operation does not wait for it.
+     */
+
+    FUSE_CONTEXT *ReadAheadContext;
+    UINT32 Length;
+
+    Length = Context->Instance->MaxReadahead;
+    if (Length > Context->Instance->MaxRead)
+        Length = Context->Instance->MaxRead;
+
+    FuseContextCreate(&ReadAheadContext, Context->Instance, 0);
+    ASSERT(0 != ReadAheadContext);
+    if (FuseContextIsStatus(ReadAheadContext))
+    {
+        FuseFileReadAheadComplete(Context->Instance, Context->File, Offset, 0, 0, DataVersion);
+        return;
+    }
+
+    ReadAheadContext->Fini = FuseReadAhead_ContextFini;
+    ReadAheadContext->InternalResponse->Hint = FUSE_PROTO_OPCODE_READ;
+    ReadAheadContext->OrigUid = Context->OrigUid;
+    ReadAheadContext->OrigGid = Context->OrigGid;
+    ReadAheadContext->OrigPid = Context->OrigPid;
+    ReadAheadContext->ReadAhead.StartOffset = Offset;
+    ReadAheadContext->ReadAhead.Offset = 0;
+    ReadAheadContext->ReadAhead.Length = Length;
+    ReadAheadContext->ReadAhead.DataVersion = DataVersion;
+    ReadAheadContext->ReadAhead.Buffer = FuseAlloc(Length);
+    if (0 == ReadAheadContext->ReadAhead.Buffer)
+    {
+        FuseFileReadAheadComplete(Context->Instance, Context->File, Offset, 0, 0, DataVersion);
+        FuseContextDelete(ReadAheadContext);
+        return;
+    }
+
+    FuseFileReference(Context->File);
+    ReadAheadContext->File = Context->File;
+
+    FuseIoqPostPending(Context->Instance->Ioq, ReadAheadContext);
+}
+
+static VOID FuseReadAhead_ContextFini(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
-    UINT32 FileAccess, RequiredAccess;
+    if (0 != Context->ReadAhead.Buffer)
+        FuseFree(Context->ReadAhead.Buffer);
+
+    if (0 != Context->File)
+        FuseFileDereference(Context->Instance, Context->File);
+}
+
+static ULONG FuseOpGuardDirIndex(PWSTR FileName, BOOLEAN Parent)
+{
+    PAGED_CODE();
+
+    /*
+     * Return the index of the OpGuardDirLocks entry of a directory. If Parent is TRUE the
+     * FileName is that of a file in the directory; else it is that of the directory itself.
+     * The volume is case-sensitive, so the directory path is hashed as is.
+     */
+
+    ULONG Length, Hash;
+
+    for (Length = 0; L'\0' != FileName[Length]; Length++)
+        ;
+
+    if (Parent)
+    {
+        while (1 < Length && L'\\' != FileName[Length - 1])
+            Length--;
+        if (1 < Length)
+            Length--;
+    }
+
+    Hash = 0;
+    for (ULONG Index = 0; Length > Index; Index++)
+        Hash = Hash * 31 + FileName[Index];
+
+    return FuseHashMix32(Hash) % FUSE_OPGUARD_DIRLOCK_COUNT;
+}
+
+static INT FuseOpGuardDirs(FUSE_CONTEXT *Context, BOOLEAN Acquire,
+    ULONG Index1, ULONG Index2, BOOLEAN Exclusive)
+{
+    PAGED_CODE();
+
+    /*
+     * Acquire or release the op guard for one or two directories. The OpGuardLock is
+     * acquired shared (so that the directories are excluded from operations that lock the
+     * whole volume), followed by the directory locks in index order (so that two-directory
+     * renames do not deadlock).
+     *
+     * Opens and directory queries acquire the directory locks shared even when the user
+     * mode file system does not advertise FUSE_PROTO_INIT_PARALLEL_DIROPS; this matches
+     * the volume-wide op guard that preceded the directory locks, which also let them run
+     * concurrently.
+     */
+
+    FUSE_INSTANCE *Instance = Context->Instance;
+    FUSE_RWLOCK *DirLock1, *DirLock2;
+
+    DirLock1 = &Instance->OpGuardDirLocks[Index1 < Index2 ? Index1 : Index2];
+    DirLock2 = Index1 != Index2 ? &Instance->OpGuardDirLocks[Index1 < Index2 ? Index2 : Index1] : 0;
+
+    if (Acquire)
+    {
+        if (!FuseRwlockEnterReader(&Instance->OpGuardLock, Context))
+            goto fail0;
+        if (!(Exclusive ?
+            FuseRwlockEnterWriter(DirLock1, Context) : FuseRwlockEnterReader(DirLock1, Context)))
+            goto fail1;
+        if (0 != DirLock2 && !(Exclusive ?
+            FuseRwlockEnterWriter(DirLock2, Context) : FuseRwlockEnterReader(DirLock2, Context)))
+            goto fail2;
+        return FuseOpGuardTrue;
+
+    fail2:
+        if (Exclusive)
+            FuseRwlockLeaveWriter(DirLock1, Context);
+        else
+            FuseRwlockLeaveReader(DirLock1, Context);
+    fail1:
+        FuseRwlockLeaveReader(&Instance->OpGuardLock, Context);
+    fail0:
+        return FuseOpGuardCancel;
+    }
+    else
+    {
+        if (0 != DirLock2)
+        {
+            if (Exclusive)
+                FuseRwlockLeaveWriter(DirLock2, Context);
+            else
+                FuseRwlockLeaveReader(DirLock2, Context);
+        }
+        if (Exclusive)
+            FuseRwlockLeaveWriter(DirLock1, Context);
+        else
+            FuseRwlockLeaveReader(DirLock1, Context);
+        FuseRwlockLeaveReader(&Instance->OpGuardLock, Context);
+        return FuseOpGuardFalse;
+    }
+}
+
+static UINT32 FuseAccessMask(
+    UINT32 FileUid, UINT32 FileGid, UINT32 FileMode,
+    UINT32 OrigUid, UINT32 OrigGid)
+{
+    PAGED_CODE();
 
     if (OrigUid == FileUid)
-        FileAccess = FusePosixOwnerDefaultPerm |
+        return FusePosixOwnerDefaultPerm |
             FusePosixMapPermissionToAccessMask(FileMode & ~001000, (FileMode & 0700) >> 6);
     else if (OrigGid == FileGid)
-        FileAccess = FusePosixDefaultPerm |
+        return FusePosixDefaultPerm |
             FusePosixMapPermissionToAccessMask(FileMode, (FileMode & 0070) >> 3);
     else
-        FileAccess = FusePosixDefaultPerm |
+        return FusePosixDefaultPerm |
             FusePosixMapPermissionToAccessMask(FileMode, (FileMode & 0007));
+}
+
+static NTSTATUS FuseAccessCheckMask(
+    UINT32 FileAccess, UINT32 DesiredAccess,
+    PUINT32 PGrantedAccess)
+{
+    PAGED_CODE();
+
+    UINT32 RequiredAccess;
 
     RequiredAccess = DesiredAccess & (STANDARD_RIGHTS_ALL | SPECIFIC_RIGHTS_ALL);
 
@@ -318,6 +837,46 @@ static NTSTATUS FuseAccessCheck(
     }
 }
 
+static NTSTATUS FuseAccessCheck(
+    UINT32 FileUid, UINT32 FileGid, UINT32 FileMode,
+    UINT32 OrigUid, UINT32 OrigGid, UINT32 DesiredAccess,
+    PUINT32 PGrantedAccess)
+{
+    PAGED_CODE();
+
+    return FuseAccessCheckMask(
+        FuseAccessMask(FileUid, FileGid, FileMode, OrigUid, OrigGid),
+        DesiredAccess, PGrantedAccess);
+}
+
+static NTSTATUS FuseLookupPathAccessCheck(FUSE_CONTEXT *Context,
+    UINT32 DesiredAccess, PUINT32 PGrantedAccess)
+{
+    PAGED_CODE();
+
+    /*
+     * Access check the file that was last looked up by FuseLookupPath. FuseLookup retrieves
+     * the access mask memoized with a cached entry while it holds the cache mutex anyway;
+     * if it was computed for another caller (or not at all), compute and memoize it here.
+     */
+
+    FUSE_CACHE_ACCESS *Access = &Context->LookupPath.Access;
+
+    if (0 == Access->Mask || Context->OrigUid != Access->Uid || Context->OrigGid != Access->Gid)
+    {
+        Access->Uid = Context->OrigUid;
+        Access->Gid = Context->OrigGid;
+        Access->Mask = FuseAccessMask(
+            Context->LookupPath.Attr.uid, Context->LookupPath.Attr.gid,
+            Context->LookupPath.Attr.mode,
+            Access->Uid, Access->Gid);
+        FuseCacheSetItemAccess(Context->Instance->Cache, Context->LookupPath.CacheItem,
+            &Context->LookupPath.Attr, Access);
+    }
+
+    return FuseAccessCheckMask(Access->Mask, DesiredAccess, PGrantedAccess);
+}
+
 static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
@@ -367,8 +926,8 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
 
-        Context->InternalResponse->IoStatus.Status = FspPosixMapWindowsToPosixPathEx(
-            FileName, &PosixPath, TRUE);
+        Context->InternalResponse->IoStatus.Status = FuseContextMapPosixPath(
+            &Context->LookupPath.PathArena, FileName, &PosixPath);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
     }
@@ -385,18 +944,12 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
 
-        Context->InternalResponse->IoStatus.Status = FuseGetTokenUid(
-            AccessTokenObject, TokenUser, &Uid);
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            goto exit;
-
-        Context->InternalResponse->IoStatus.Status = FuseGetTokenUid(
-            AccessTokenObject, TokenPrimaryGroup, &Gid);
+        Context->InternalResponse->IoStatus.Status = FuseInstanceGetTokenUidGid(
+            Context->Instance, AccessTokenObject, &Uid, &Gid);
+        ObDereferenceObject(AccessTokenObject);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
 
-        ObDereferenceObject(AccessTokenObject);
-
         Pid = FSP_FSCTL_TRANSACT_REQ_TOKEN_PID(AccessToken);
     }
 
@@ -417,7 +970,7 @@ static VOID FusePrepareLookupPath(FUSE_CONTEXT *Context)
 exit:
     if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
     {
-        FspPosixDeletePath(PosixPath);
+        FuseContextDeletePosixPath(&Context->LookupPath.PathArena, PosixPath);
             /* handles NULL paths */
         FuseCacheDereferenceGen(Context->Instance->Cache, CacheGen);
             /* handles NULL gens */
@@ -446,8 +999,8 @@ static VOID FusePrepareLookupPath2(FUSE_CONTEXT *Context)
 
     if (0 != FileName)
     {
-        Context->InternalResponse->IoStatus.Status = FspPosixMapWindowsToPosixPathEx(
-            FileName, &PosixPath, TRUE);
+        Context->InternalResponse->IoStatus.Status = FuseContextMapPosixPath(
+            &Context->LookupPath.PathArena, FileName, &PosixPath);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             goto exit;
     }
@@ -461,7 +1014,7 @@ static VOID FusePrepareLookupPath2(FUSE_CONTEXT *Context)
 exit:
     if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
     {
-        FspPosixDeletePath(PosixPath);
+        FuseContextDeletePosixPath(&Context->LookupPath.PathArena, PosixPath);
             /* handles NULL paths */
     }
 }
@@ -472,11 +1025,13 @@ static VOID FusePrepareLookupPath_ContextFini(FUSE_CONTEXT *Context)
 
     if (FspFsctlTransactCreateKind == Context->InternalRequest->Kind &&
         0 != Context->File)
-        FuseFileDelete(Context->Instance, Context->File);
+        FuseFileDereference(Context->Instance, Context->File);
 
-    FspPosixDeletePath(Context->LookupPath.OrigPath2.Buffer);
+    FuseContextDeletePosixPath(&Context->LookupPath.PathArena,
+        Context->LookupPath.OrigPath2.Buffer);
         /* handles NULL paths */
-    FspPosixDeletePath(Context->LookupPath.OrigPath.Buffer);
+    FuseContextDeletePosixPath(&Context->LookupPath.PathArena,
+        Context->LookupPath.OrigPath.Buffer);
         /* handles NULL paths */
     FuseCacheDereferenceGen(Context->Instance->Cache, Context->LookupPath.CacheGen);
         /* handles NULL gens */
@@ -495,9 +1050,40 @@ static VOID FuseLookupPath(FUSE_CONTEXT *Context)
     {
         Context->LookupPath.Ino = FUSE_PROTO_ROOT_INO;
         DEBUGFILL(&Context->Lookup.Attr, sizeof Context->Lookup.Attr);
+
+        /*
+         * Split the path into its components in a single pass. Components past the
+         * capacity of the Components array (very deep paths) are split one at a time.
+         */
+        Context->LookupPath.ComponentBase = Context->LookupPath.Remain.Buffer;
+        Context->LookupPath.ComponentCount = FusePosixPathComponents(&Context->LookupPath.Remain,
+            Context->LookupPath.Components, FUSE_CONTEXT_LOOKUPPATH_COMPONENT_COUNT);
+        Context->LookupPath.ComponentIndex = 0;
+
         while (1) /* for (;;) produces "warning C4702: unreachable code" */
         {
-            FusePosixPathPrefix(&Context->LookupPath.Remain, &Context->LookupPath.Name, &Context->LookupPath.Remain);
+            if (FUSE_CONTEXT_LOOKUPPATH_COMPONENT_COUNT > Context->LookupPath.ComponentIndex &&
+                Context->LookupPath.ComponentCount > Context->LookupPath.ComponentIndex)
+            {
+                FUSE_POSIX_PATH_COMPONENT *Component =
+                    &Context->LookupPath.Components[Context->LookupPath.ComponentIndex++];
+                PSTR P, EndP;
+
+                Context->LookupPath.Name.Length = Context->LookupPath.Name.MaximumLength =
+                    Component->Length;
+                Context->LookupPath.Name.Buffer =
+                    Context->LookupPath.ComponentBase + Component->Offset;
+
+                P = Context->LookupPath.Name.Buffer + Context->LookupPath.Name.Length;
+                EndP = Context->LookupPath.Remain.Buffer + Context->LookupPath.Remain.Length;
+                while (EndP > P && '/' == *P)
+                    P++;
+                Context->LookupPath.Remain.Length = Context->LookupPath.Remain.MaximumLength =
+                    (USHORT)(EndP - P);
+                Context->LookupPath.Remain.Buffer = P;
+            }
+            else
+                FusePosixPathPrefix(&Context->LookupPath.Remain, &Context->LookupPath.Name, &Context->LookupPath.Remain);
 
             /*
              * - RootName:
@@ -529,21 +1115,16 @@ static VOID FuseLookupPath(FUSE_CONTEXT *Context)
                 {
                     if (!LastName && !TravPriv)
                     {
-                        Context->InternalResponse->IoStatus.Status = FuseAccessCheck(
-                            Context->LookupPath.Attr.uid, Context->LookupPath.Attr.gid,
-                            Context->LookupPath.Attr.mode,
-                            Context->OrigUid, Context->OrigGid,
-                            FILE_TRAVERSE, 0);
+                        Context->InternalResponse->IoStatus.Status = FuseLookupPathAccessCheck(
+                            Context, FILE_TRAVERSE, 0);
                         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                             coro_break;
                     }
                     else if (LastName)
                     {
-                        Context->InternalResponse->IoStatus.Status = FuseAccessCheck(
-                            Context->LookupPath.Attr.uid, Context->LookupPath.Attr.gid,
-                            Context->LookupPath.Attr.mode,
-                            Context->OrigUid, Context->OrigGid,
-                            Context->LookupPath.DesiredAccess, &Context->LookupPath.GrantedAccess);
+                        Context->InternalResponse->IoStatus.Status = FuseLookupPathAccessCheck(
+                            Context, Context->LookupPath.DesiredAccess,
+                            &Context->LookupPath.GrantedAccess);
                         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                             coro_break;
                     }
@@ -770,17 +1351,48 @@ static VOID FuseRenameCheck(FUSE_CONTEXT *Context)
     }
 }
 
-static VOID FuseCreate(FUSE_CONTEXT *Context)
+static BOOLEAN FuseOpenResult(FUSE_CONTEXT *Context, FUSE_FILE *File, PUINT32 POpenFlags)
+    /*
+     * Retrieve the file handle of File and the open flags from an OPEN or OPENDIR response.
+     *
+     * A file system that does not implement OPEN or OPENDIR answers ENOSYS
+     * (NO_OPEN_SUPPORT/NO_OPENDIR_SUPPORT). In this case the open succeeds with a zero
+     * file handle and no further OPEN/OPENDIR messages are sent. The File is marked NoOpen,
+     * so that it is not RELEASE'd; files opened by CREATE are still RELEASE'd.
+     */
 {
     PAGED_CODE();
 
-    coro_block (Context->CoroState)
+    if (STATUS_INVALID_DEVICE_REQUEST == Context->InternalResponse->IoStatus.Status)
     {
-        Context->InternalResponse->IoStatus.Status = FuseFileCreate(Context->Instance, &Context->File);
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
+        Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+        File->Fh = 0;
+        File->NoOpen = TRUE;
+        *POpenFlags = 0;
+        return TRUE;
+    }
 
-        Context->File->OpenFlags = 0x0100 | 0x0400 | 2 /*O_CREAT|O_EXCL|O_RDWR*/;
+    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+        return FALSE;
+
+    File->Fh = Context->FuseResponse->rsp.open.fh;
+    *POpenFlags = Context->FuseResponse->rsp.open.open_flags;
+    return TRUE;
+}
+
+static VOID FuseCreate(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    UINT32 OpenFlags;
+
+    coro_block (Context->CoroState)
+    {
+        Context->InternalResponse->IoStatus.Status = FuseFileCreate(Context->Instance, &Context->File);
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        Context->File->OpenFlags = 0x0100 | 0x0400 | 2 /*O_CREAT|O_EXCL|O_RDWR*/;
 
         Context->LookupPath.Attr.rdev = 0;
         Context->LookupPath.Attr.mode = 0777;
@@ -817,14 +1429,12 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
             Context->LookupPath.Attr = Context->FuseResponse->rsp.mkdir.entry.attr;
 
             coro_await (FuseProtoSendOpendir(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            if (!FuseOpenResult(Context, Context->File, &OpenFlags))
                 coro_break;
 
-            Context->LookupPath.DisableCache =
-                BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+            Context->LookupPath.DisableCache = BooleanFlagOn(OpenFlags, FUSE_PROTO_OPEN_DIRECT_IO);
 
             Context->File->Ino = Context->LookupPath.Ino;
-            Context->File->Fh = Context->FuseResponse->rsp.open.fh;
             Context->File->IsDirectory = TRUE;
             Context->File->CacheItem = Context->LookupPath.CacheItem;
             FuseCacheReferenceItem(Context->Instance->Cache,
@@ -871,14 +1481,12 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
                 Context->LookupPath.Attr = Context->FuseResponse->rsp.mknod.entry.attr;
 
                 coro_await (FuseProtoSendOpen(Context));
-                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                if (!FuseOpenResult(Context, Context->File, &OpenFlags))
                     coro_break;
 
-                Context->LookupPath.DisableCache =
-                    BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+                Context->LookupPath.DisableCache = BooleanFlagOn(OpenFlags, FUSE_PROTO_OPEN_DIRECT_IO);
 
                 Context->File->Ino = Context->LookupPath.Ino;
-                Context->File->Fh = Context->FuseResponse->rsp.open.fh;
                 Context->File->CacheItem = Context->LookupPath.CacheItem;
                 FuseCacheReferenceItem(Context->Instance->Cache,
                     Context->File->CacheItem);
@@ -932,10 +1540,74 @@ static VOID FuseCreate(FUSE_CONTEXT *Context)
     }
 }
 
+static VOID FuseCreateOptimistic(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * CreateOptimistic attempts to create the file before looking it up,
+     * thus saving the LOOKUP that would fail for a new file. We only bet that
+     * the file is new when its parent directory was found in the entry cache
+     * (i.e. the directory is in active use); there is no negative cache that
+     * could tell us that the file does not exist.
+     *
+     * If we do not try, if the file is already known to exist, if the create
+     * checks fail in a way that an open might not (access to the parent
+     * directory, trailing backslash) or if the file exists on the file system
+     * (EEXIST), we return STATUS_OBJECT_NAME_COLLISION and the caller falls back
+     * to the open path. Other failures (e.g. a missing parent directory) would
+     * fail the open path too and are reported as is.
+     *
+     * The CREATE or MKDIR is still sent with exclusive semantics, because we
+     * must be able to tell a file that was created from one that was opened.
+     */
+
+    FUSE_PROTO_ENTRY Entry;
+    PVOID CacheItem;
+
+    coro_block (Context->CoroState)
+    {
+        coro_await (FuseCreateCheck(Context));
+        if (STATUS_ACCESS_DENIED == Context->InternalResponse->IoStatus.Status ||
+            STATUS_OBJECT_NAME_INVALID == Context->InternalResponse->IoStatus.Status)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_OBJECT_NAME_COLLISION;
+            coro_break;
+        }
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        if (!Context->LookupPath.Cached)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_OBJECT_NAME_COLLISION;
+            coro_break;
+        }
+
+        FusePosixPathSuffix(&Context->LookupPath.OrigPath, 0, &Context->LookupPath.Name);
+        if (FuseCacheGetEntry(Context->Instance->Cache,
+            Context->LookupPath.Ino, &Context->LookupPath.Name, &Entry, 0, &CacheItem))
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_OBJECT_NAME_COLLISION;
+            coro_break;
+        }
+
+        coro_await (FuseCreate(Context));
+        if (STATUS_OBJECT_NAME_COLLISION == Context->InternalResponse->IoStatus.Status &&
+            0 != Context->File)
+        {
+            /* the open path will create its own file */
+            FuseFileDereference(Context->Instance, Context->File);
+            Context->File = 0;
+        }
+    }
+}
+
 static VOID FuseOpen(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    UINT32 OpenFlags;
+
     coro_block (Context->CoroState)
     {
         Context->InternalResponse->IoStatus.Status = FuseFileCreate(Context->Instance, &Context->File);
@@ -973,14 +1645,12 @@ static VOID FuseOpen(FUSE_CONTEXT *Context)
         if (0040000/* S_IFDIR  */ == Type)
         {
             coro_await (FuseProtoSendOpendir(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            if (!FuseOpenResult(Context, Context->File, &OpenFlags))
                 coro_break;
 
-            Context->LookupPath.DisableCache =
-                BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+            Context->LookupPath.DisableCache = BooleanFlagOn(OpenFlags, FUSE_PROTO_OPEN_DIRECT_IO);
 
             Context->File->Ino = Context->LookupPath.Ino;
-            Context->File->Fh = Context->FuseResponse->rsp.open.fh;
             Context->File->IsDirectory = TRUE;
         }
         else
@@ -1000,14 +1670,12 @@ static VOID FuseOpen(FUSE_CONTEXT *Context)
             }
 
             coro_await (FuseProtoSendOpen(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            if (!FuseOpenResult(Context, Context->File, &OpenFlags))
                 coro_break;
 
-            Context->LookupPath.DisableCache =
-                BooleanFlagOn(Context->FuseResponse->rsp.open.open_flags, FUSE_PROTO_OPEN_DIRECT_IO);
+            Context->LookupPath.DisableCache = BooleanFlagOn(OpenFlags, FUSE_PROTO_OPEN_DIRECT_IO);
 
             Context->File->Ino = Context->LookupPath.Ino;
-            Context->File->Fh = Context->FuseResponse->rsp.open.fh;
         }
 
         Context->File->CacheItem = Context->LookupPath.CacheItem;
@@ -1064,6 +1732,10 @@ static VOID FuseOpCreate_FileOpenIf(FUSE_CONTEXT *Context)
 
     coro_block (Context->CoroState)
     {
+        coro_await (FuseCreateOptimistic(Context));
+        if (STATUS_OBJECT_NAME_COLLISION != Context->InternalResponse->IoStatus.Status)
+            coro_break;
+
         coro_await (FuseOpenCheck(Context));
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
         {
@@ -1106,6 +1778,10 @@ static VOID FuseOpCreate_FileOverwriteIf(FUSE_CONTEXT *Context)
 
     coro_block (Context->CoroState)
     {
+        coro_await (FuseCreateOptimistic(Context));
+        if (STATUS_OBJECT_NAME_COLLISION != Context->InternalResponse->IoStatus.Status)
+            coro_break;
+
         coro_await (FuseOverwriteCheck(Context));
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
         {
@@ -1198,13 +1874,14 @@ static INT FuseOgCreate(FUSE_CONTEXT *Context, BOOLEAN Acquire)
 {
     PAGED_CODE();
 
+    /* creates lock the parent directory; opens only need to exclude creates */
+    ULONG Index = FuseOpGuardDirIndex((PWSTR)Context->InternalRequest->Buffer, TRUE);
+    BOOLEAN Exclusive =
+        FILE_OPEN != ((Context->InternalRequest->Req.Create.CreateOptions >> 24) & 0xff);
+
     if (Acquire)
     {
-        INT Result;
-        if (FILE_OPEN != ((Context->InternalRequest->Req.Create.CreateOptions >> 24) & 0xff))
-            Result = FuseOpGuardAcquireExclusive(Context);
-        else
-            Result = FuseOpGuardAcquireShared(Context);
+        INT Result = FuseOpGuardDirs(Context, TRUE, Index, Index, Exclusive);
 #if DBG
         /*
          * In debug builds we add an artificial delay to our opens to test alertable locks.
@@ -1228,12 +1905,7 @@ static INT FuseOgCreate(FUSE_CONTEXT *Context, BOOLEAN Acquire)
         return Result;
     }
     else
-    {
-        if (FILE_OPEN != ((Context->InternalRequest->Req.Create.CreateOptions >> 24) & 0xff))
-            return FuseOpGuardReleaseExclusive(Context);
-        else
-            return FuseOpGuardReleaseShared(Context);
-    }
+        return FuseOpGuardDirs(Context, FALSE, Index, Index, Exclusive);
 }
 
 static BOOLEAN FuseOpOverwrite(FUSE_CONTEXT *Context)
@@ -1244,6 +1916,10 @@ static BOOLEAN FuseOpOverwrite(FUSE_CONTEXT *Context)
     {
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Overwrite.UserContext2;
 
+        coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
         //Context->Setattr.Attr.size = 0;
         coro_await (FuseProtoSendFtruncate(Context));
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
@@ -1255,6 +1931,7 @@ static BOOLEAN FuseOpOverwrite(FUSE_CONTEXT *Context)
 
         FuseCacheQuickExpireItem(Context->Instance->Cache,
             Context->File->CacheItem);
+        FuseUpdateFileAttr(Context);
 
         FuseAttrToFileInfo(Context->Instance, &Context->FuseResponse->rsp.getattr.attr,
             &Context->InternalResponse->Rsp.Overwrite.FileInfo);
@@ -1271,12 +1948,41 @@ static BOOLEAN FuseOpCleanup(FUSE_CONTEXT *Context)
 
     coro_block (Context->CoroState)
     {
-        if (Context->InternalRequest->Req.Cleanup.Delete)
+        /* NOTE: CLEANUP cannot report failure! */
+
+        Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Cleanup.UserContext2;
+
+        coro_await (FuseWriteback(Context));
+
+        if (!Context->InternalRequest->Req.Cleanup.Delete &&
+            Context->File->Preallocated)
         {
-            /* NOTE: CLEANUP cannot report failure! */
+            /*
+             * Trim the space that was preallocated past the end of file through this handle
+             * (see SetAllocationSize). We do not track how much was preallocated, but it
+             * cannot exceed the space allocated to the file, so we punch a hole of that
+             * length past the end of file. Failures (e.g. EOPNOTSUPP) are ignored.
+             */
+            Context->File->Preallocated = FALSE;
+
+            coro_await (FuseProtoSendFgetattr(Context));
+            if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+                0 != Context->FuseResponse->rsp.getattr.attr.blocks)
+            {
+                Context->Fallocate.Offset = Context->FuseResponse->rsp.getattr.attr.size;
+                Context->Fallocate.Length = Context->FuseResponse->rsp.getattr.attr.blocks * 512;
+                Context->Fallocate.Mode = 3/*FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE*/;
+                coro_await (FuseProtoSendFallocate(Context));
+
+                FuseCacheQuickExpireItem(Context->Instance->Cache,
+                    Context->File->CacheItem);
+            }
 
-            Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Cleanup.UserContext2;
+            Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+        }
 
+        if (Context->InternalRequest->Req.Cleanup.Delete)
+        {
             FusePrepareLookupPath(Context);
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
@@ -1307,20 +2013,16 @@ static INT FuseOgCleanup(FUSE_CONTEXT *Context, BOOLEAN Acquire)
 {
     PAGED_CODE();
 
-    if (Acquire)
-    {
-        if (Context->InternalRequest->Req.Cleanup.Delete)
-            return FuseOpGuardAcquireExclusive(Context);
-        else
-            return FuseOpGuardFalse;
-    }
-    else
-    {
-        if (Context->InternalRequest->Req.Cleanup.Delete)
-            return FuseOpGuardReleaseExclusive(Context);
-        else
-            return FuseOpGuardFalse;
-    }
+    if (!Context->InternalRequest->Req.Cleanup.Delete)
+        return FuseOpGuardFalse;
+
+    /* deletes lock the parent directory; directory deletes also lock the directory */
+    FUSE_FILE *File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Cleanup.UserContext2;
+    PWSTR FileName = (PWSTR)Context->InternalRequest->Buffer;
+    ULONG Index1 = FuseOpGuardDirIndex(FileName, TRUE);
+    ULONG Index2 = File->IsDirectory ? FuseOpGuardDirIndex(FileName, FALSE) : Index1;
+
+    return FuseOpGuardDirs(Context, Acquire, Index1, Index2, TRUE);
 }
 
 static BOOLEAN FuseOpClose(FUSE_CONTEXT *Context)
@@ -1339,7 +2041,16 @@ static BOOLEAN FuseOpClose(FUSE_CONTEXT *Context)
         else if (Context->File->IsDirectory)
             coro_await (FuseProtoSendReleasedir(Context));
         else
-            coro_await (FuseProtoSendRelease(Context));
+        {
+            /* dirty data are normally written back by CLEANUP; write back any that remain */
+            if (Context->File == FuseCacheGetItemDirtyFile(
+                Context->Instance->Cache, Context->File->CacheItem))
+                coro_await (FuseWriteback(Context));
+
+            /* an outstanding read-ahead sends the RELEASE when it completes */
+            if (!FuseFileReleaseDefer(Context->Instance, Context->File))
+                coro_await (FuseProtoSendRelease(Context));
+        }
     }
 
     return coro_active();
@@ -1350,7 +2061,109 @@ static VOID FuseOpClose_ContextFini(FUSE_CONTEXT *Context)
     PAGED_CODE();
 
     if (0 != Context->File)
-        FuseFileDelete(Context->Instance, Context->File);
+        FuseFileDereference(Context->Instance, Context->File);
+}
+
+#define FUSE_READ_CHUNK_MAX             64
+#define FUSE_WRITE_CHUNK_MAX            64
+
+static VOID FuseOpRead_ReadChunks(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Split the next part of the read into (up to MaxBackground) chunks of MaxRead bytes
+     * and create a child Context to READ each one of them concurrently. Children copy their
+     * data directly into the user buffer at the chunk offset. The results are consumed in
+     * offset order by FuseOpRead_CompleteChunks after the children complete.
+     */
+
+    FUSE_CONTEXT_READWRITE_RESULT *Result;
+    FUSE_CONTEXT *Child;
+    UINT32 Offset, Remain, Length;
+    ULONG Count, Index;
+
+    Count = Context->Instance->MaxBackground;
+    if (FUSE_READ_CHUNK_MAX < Count)
+        Count = FUSE_READ_CHUNK_MAX;
+
+    if (0 == Context->Read.Results)
+    {
+        Context->Read.Results = FuseAlloc(Count * sizeof(FUSE_CONTEXT_READWRITE_RESULT));
+        if (0 == Context->Read.Results)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+            return;
+        }
+    }
+
+    for (Offset = Context->Read.Offset, Remain = Context->Read.Remain, Index = 0;
+        Count > Index && 0 != Remain;
+        Offset += Length, Remain -= Length, Index++)
+    {
+        Length = Remain;
+        if (Length > Context->Instance->MaxRead)
+            Length = Context->Instance->MaxRead;
+
+        Result = &Context->Read.Results[Index];
+        Result->Length = Length;
+        Result->BytesTransferred = 0;
+
+        FuseContextCreateChild(&Child, Context, FUSE_PROTO_OPCODE_READ);
+        ASSERT(0 != Child);
+        if (FuseContextIsStatus(Child))
+        {
+            Result->Status = FuseContextToStatus(Child);
+            continue;
+        }
+
+        /* if the child never completes its result will be reported as cancelled */
+        Result->Status = STATUS_CANCELLED;
+        Child->ReadChild.StartOffset = Context->Read.StartOffset;
+        Child->ReadChild.Offset = Offset;
+        Child->ReadChild.Length = Length;
+        Child->ReadChild.Address = (PUINT8)(UINT_PTR)Context->InternalRequest->Req.Read.Address;
+        Child->ReadChild.Result = Result;
+    }
+
+    Context->Read.ChunkCount = Index;
+
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+}
+
+static BOOLEAN FuseOpRead_CompleteChunks(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Account for the chunks of the last batch in offset order. The first chunk that failed
+     * or was short ends the read; any data that later chunks placed in the user buffer lies
+     * beyond the reported length and is ignored.
+     */
+
+    FUSE_CONTEXT_READWRITE_RESULT *Result;
+
+    for (ULONG Index = 0; Context->Read.ChunkCount > Index; Index++)
+    {
+        Result = &Context->Read.Results[Index];
+        if (!NT_SUCCESS(Result->Status))
+        {
+            Context->InternalResponse->IoStatus.Status = Result->Status;
+            return FALSE;
+        }
+
+        Context->Read.Remain -= Result->BytesTransferred;
+        Context->Read.Offset += Result->BytesTransferred;
+
+        if (Result->Length > Result->BytesTransferred)
+        {
+            Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+            return FALSE;
+        }
+    }
+
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+    return TRUE;
 }
 
 static BOOLEAN FuseOpRead(FUSE_CONTEXT *Context)
@@ -1359,48 +2172,108 @@ static BOOLEAN FuseOpRead(FUSE_CONTEXT *Context)
 
     coro_block (Context->CoroState)
     {
+        Context->Fini = FuseOpRead_ContextFini;
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Read.UserContext2;
 
         Context->Read.StartOffset = Context->InternalRequest->Req.Read.Offset;
         Context->Read.Remain = Context->InternalRequest->Req.Read.Length;
 
         Context->Read.Offset = 0;
-        while (0 != Context->Read.Remain)
+
+        UINT32 BytesCopied;
+        Context->InternalResponse->IoStatus.Status = FuseFileReadAheadGet(
+            Context->Instance, Context->File,
+            Context->Read.StartOffset,
+            (PVOID)(UINT_PTR)Context->InternalRequest->Req.Read.Address,
+            Context->Read.Remain,
+            &BytesCopied, &Context->Read.Sequential);
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+        Context->Read.Remain -= BytesCopied;
+        Context->Read.Offset += BytesCopied;
+
+        if (0 == Context->Read.Remain)
+            /* read satisfied from the read-ahead data */;
+        else if (Context->Read.Remain > Context->Instance->MaxRead &&
+            1 < Context->Instance->MaxBackground)
+        {
+            /* large read: READ multiple chunks concurrently */
+            while (0 != Context->Read.Remain)
+            {
+                FuseOpRead_ReadChunks(Context);
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+
+                FuseContextWaitChildren(Context);
+
+                if (!FuseOpRead_CompleteChunks(Context))
+                {
+                    /* report a failure only if nothing was read; else report a short read */
+                    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+                        0 == Context->Read.Offset)
+                        coro_break;
+                    break;
+                }
+            }
+        }
+        else
         {
-            Context->Read.Length = Context->Read.Remain;
+            while (0 != Context->Read.Remain)
+            {
+                Context->Read.Length = Context->Read.Remain;
 #if DBG
-            if (DEBUGTEST(10) && Context->Read.Length > 512)
-                Context->Read.Length = 512;
-#endif
-#if 0
-            FUSE_DEVICE_EXTENSION *Instance = FuseDeviceExtension(Context->DeviceObject);
-            if (Context->Read.Length > Instance->VolumeParams.MaxRead)
-                Context->Read.Length = Instance->VolumeParams.MaxRead;
+                if (DEBUGTEST(10) && Context->Read.Length > 512)
+                    Context->Read.Length = 512;
 #endif
+                if (Context->Read.Length > Context->Instance->MaxRead)
+                    Context->Read.Length = Context->Instance->MaxRead;
 
-            coro_await (FuseProtoSendRead(Context));
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                coro_break;
+                Context->ResponseData.Address =
+                    (PUINT8)(UINT_PTR)Context->InternalRequest->Req.Read.Address + Context->Read.Offset;
+                Context->ResponseData.Length = Context->Read.Length;
 
-            UINT32 BytesTransferred = Context->FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE;
-            if (Context->Read.Length < BytesTransferred)
-            {
-                Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
-                coro_break;
+                coro_await (FuseProtoSendRead(Context));
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+
+                UINT32 BytesTransferred = Context->FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE;
+                if (Context->Read.Length < BytesTransferred)
+                {
+                    Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
+                    coro_break;
+                }
+
+                Context->InternalResponse->IoStatus.Status = Context->ResponseData.Status;
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+
+                Context->Read.Remain -= BytesTransferred;
+                Context->Read.Offset += BytesTransferred;
+
+                if (Context->Read.Length > BytesTransferred)
+                    break;
             }
+        }
 
-            Context->InternalResponse->IoStatus.Status = FuseSafeCopyMemory(
-                (PUINT8)(UINT_PTR)Context->InternalRequest->Req.Read.Address + Context->Write.Offset,
-                (PUINT8)Context->FuseResponse + FUSE_PROTO_RSP_HEADER_SIZE,
-                BytesTransferred);
+        /* a sequential read that was not short READs ahead in the background */
+        UINT32 DataVersion;
+        if (FuseFileReadAheadSet(Context->Instance, Context->File,
+            Context->Read.StartOffset + Context->Read.Offset,
+            Context->Read.Sequential && 0 == Context->Read.Remain,
+            &DataVersion))
+            FuseReadAhead(Context, Context->Read.StartOffset + Context->Read.Offset, DataVersion);
+
+        /* dirty data that have not been written back take precedence over the data read */
+        if (FlagOn(Context->Instance->InitFlags, FUSE_PROTO_INIT_WRITEBACK_CACHE))
+        {
+            Context->InternalResponse->IoStatus.Status = FuseFileWritebackRead(
+                Context->Instance, Context->File,
+                Context->Read.StartOffset,
+                (PVOID)(UINT_PTR)Context->InternalRequest->Req.Read.Address,
+                Context->InternalRequest->Req.Read.Length,
+                &Context->Read.Offset);
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
-
-            Context->Read.Remain -= BytesTransferred;
-            Context->Read.Offset += BytesTransferred;
-
-            if (Context->Read.Length > BytesTransferred)
-                break;
         }
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -1412,19 +2285,144 @@ static BOOLEAN FuseOpRead(FUSE_CONTEXT *Context)
     return coro_active();
 }
 
+static VOID FuseOpRead_ContextFini(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    if (0 != Context->Read.Results)
+        FuseFree(Context->Read.Results);
+}
+
+static VOID FuseOpWrite_WriteChunks(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Split the next part of the write into (up to MaxBackground) non-overlapping chunks of
+     * MaxWrite bytes and create a child Context to WRITE each one of them concurrently.
+     * Children copy their data directly from the user buffer at the chunk offset. The results
+     * are consumed in offset order by FuseOpWrite_CompleteChunks after the children complete.
+     */
+
+    FUSE_CONTEXT_READWRITE_RESULT *Result;
+    FUSE_CONTEXT *Child;
+    UINT32 Offset, Remain, Length;
+    ULONG Count, Index;
+
+    Count = Context->Instance->MaxBackground;
+    if (FUSE_WRITE_CHUNK_MAX < Count)
+        Count = FUSE_WRITE_CHUNK_MAX;
+
+    if (0 == Context->Write.Results)
+    {
+        Context->Write.Results = FuseAlloc(Count * sizeof(FUSE_CONTEXT_READWRITE_RESULT));
+        if (0 == Context->Write.Results)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+            return;
+        }
+    }
+
+    for (Offset = Context->Write.Offset, Remain = Context->Write.Remain, Index = 0;
+        Count > Index && 0 != Remain;
+        Offset += Length, Remain -= Length, Index++)
+    {
+        Length = Remain;
+        if (Length > Context->Instance->MaxWrite)
+            Length = Context->Instance->MaxWrite;
+
+        Result = &Context->Write.Results[Index];
+        Result->Length = Length;
+        Result->BytesTransferred = 0;
+
+        FuseContextCreateChild(&Child, Context, FUSE_PROTO_OPCODE_WRITE);
+        ASSERT(0 != Child);
+        if (FuseContextIsStatus(Child))
+        {
+            Result->Status = FuseContextToStatus(Child);
+            continue;
+        }
+
+        /* if the child never completes its result will be reported as cancelled */
+        Result->Status = STATUS_CANCELLED;
+        Child->WriteChild.StartOffset = Context->Write.StartOffset;
+        Child->WriteChild.Offset = Offset;
+        Child->WriteChild.Remain = Length;
+        Child->WriteChild.Address = (PUINT8)(UINT_PTR)Context->InternalRequest->Req.Write.Address;
+        Child->WriteChild.Result = Result;
+    }
+
+    Context->Write.ChunkCount = Index;
+
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+}
+
+static BOOLEAN FuseOpWrite_CompleteChunks(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Account for the chunks of the last batch in offset order. The first chunk that failed
+     * or was short ends the write; only the chunks before it (and the short chunk itself)
+     * are counted, because the data preceding later chunks was not written in full.
+     */
+
+    FUSE_CONTEXT_READWRITE_RESULT *Result;
+
+    for (ULONG Index = 0; Context->Write.ChunkCount > Index; Index++)
+    {
+        Result = &Context->Write.Results[Index];
+
+        /* a failed chunk counts for nothing, even if it wrote some of its data */
+        if (!NT_SUCCESS(Result->Status))
+        {
+            Context->InternalResponse->IoStatus.Status = Result->Status;
+            return FALSE;
+        }
+
+        Context->Write.Remain -= Result->BytesTransferred;
+        Context->Write.Offset += Result->BytesTransferred;
+
+        if (Result->Length > Result->BytesTransferred)
+        {
+            Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+            return FALSE;
+        }
+    }
+
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+    return TRUE;
+}
+
 static BOOLEAN FuseOpWrite(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
     coro_block (Context->CoroState)
     {
+        Context->Fini = FuseOpWrite_ContextFini;
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.Write.UserContext2;
 
-        coro_await (FuseProtoSendFgetattr(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
+        /*
+         * The file size is needed for constrained I/O and append handling. Use the size that
+         * we track on the open File and only ask the user mode file system when it is unknown
+         * or has expired; in this case account for any dirty data that it has not seen yet.
+         */
+        if (!FuseFileGetAttr(Context->Instance, Context->File,
+            &Context->Write.Attr, &Context->Write.AttrExpirationTime))
+        {
+            coro_await (FuseProtoSendFgetattr(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
+
+            Context->Write.Attr = Context->FuseResponse->rsp.getattr.attr;
+            Context->Write.AttrExpirationTime = KeQueryInterruptTime() +
+                Context->FuseResponse->rsp.getattr.attr_valid * 10000000 +
+                Context->FuseResponse->rsp.getattr.attr_valid_nsec / 100;
 
-        Context->Write.Attr = Context->FuseResponse->rsp.getattr.attr;
+            if (FlagOn(Context->Instance->InitFlags, FUSE_PROTO_INIT_WRITEBACK_CACHE))
+                FuseFileWritebackAttr(Context->Instance, Context->File, &Context->Write.Attr);
+        }
 
         UINT64 EndOffset;
         Context->Write.StartOffset = Context->InternalRequest->Req.Write.Offset;
@@ -1451,41 +2449,121 @@ static BOOLEAN FuseOpWrite(FUSE_CONTEXT *Context)
         Context->Write.Remain = (UINT32)(EndOffset - Context->Write.StartOffset);
 
         Context->Write.Offset = 0;
-        while (0 != Context->Write.Remain)
+        if (FlagOn(Context->Instance->InitFlags, FUSE_PROTO_INIT_WRITEBACK_CACHE))
         {
-            FuseContextWaitRequest(Context);
+            /*
+             * With the writeback cache small writes that do not leave a hole in the file are
+             * absorbed into the dirty data of the file, which are written back in a single
+             * WRITE when the next write does not fit or when the file is flushed, cleaned up,
+             * truncated, etc. Other writes go to the user mode file system after any dirty data.
+             */
+            if (!Context->InternalRequest->Req.Write.ConstrainedIo &&
+                Context->Write.Remain < Context->Instance->MaxWrite &&
+                Context->Write.StartOffset <= Context->Write.Attr.size)
+            {
+                BOOLEAN Absorbed;
+                Context->InternalResponse->IoStatus.Status = FuseFileWritebackWrite(
+                    Context->Instance, Context->File,
+                    Context->Write.StartOffset,
+                    (PVOID)(UINT_PTR)Context->InternalRequest->Req.Write.Address,
+                    Context->Write.Remain,
+                    &Absorbed);
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
 
-            Context->Write.Length = Context->Write.Remain;
-#if DBG
-            if (DEBUGTEST(10) && Context->Write.Length > 512)
-                Context->Write.Length = 512;
-#endif
-            if (Context->Write.Length > Context->FuseRequestLength - FUSE_PROTO_REQ_SIZE(write))
-                Context->Write.Length = Context->FuseRequestLength - FUSE_PROTO_REQ_SIZE(write);
+                if (!Absorbed)
+                {
+                    coro_await (FuseWriteback(Context));
+                    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                        coro_break;
+
+                    Context->InternalResponse->IoStatus.Status = FuseFileWritebackWrite(
+                        Context->Instance, Context->File,
+                        Context->Write.StartOffset,
+                        (PVOID)(UINT_PTR)Context->InternalRequest->Req.Write.Address,
+                        Context->Write.Remain,
+                        &Absorbed);
+                    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                        coro_break;
+                }
 
-            Context->InternalResponse->IoStatus.Status = FuseSafeCopyMemory(
-                (PUINT8)Context->FuseRequest + FUSE_PROTO_REQ_SIZE(write),
-                (PUINT8)(UINT_PTR)Context->InternalRequest->Req.Write.Address + Context->Write.Offset,
-                Context->Write.Length);
-            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-                coro_break;
+                if (Absorbed)
+                {
+                    Context->Write.Offset = Context->Write.Remain;
+                    Context->Write.Remain = 0;
+                }
+            }
 
-            coro_await (FuseProtoSendWrite(Context));
+            if (0 != Context->Write.Remain)
+                coro_await (FuseWriteback(Context));
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
+        }
 
-            UINT32 BytesTransferred = Context->FuseResponse->rsp.write.size;
-            if (Context->Write.Length < BytesTransferred)
+        if (0 == Context->Write.Remain)
+            /* write absorbed into the dirty data */;
+        else if (Context->Write.Remain > Context->Instance->MaxWrite &&
+            1 < Context->Instance->MaxBackground)
+        {
+            /* large write: WRITE multiple chunks concurrently */
+            while (0 != Context->Write.Remain)
             {
-                Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
-                coro_break;
+                FuseOpWrite_WriteChunks(Context);
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+
+                FuseContextWaitChildren(Context);
+
+                if (!FuseOpWrite_CompleteChunks(Context))
+                {
+                    /* report a failure only if nothing was written; else report a short write */
+                    if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status) &&
+                        0 == Context->Write.Offset)
+                        coro_break;
+                    break;
+                }
             }
+        }
+        else
+        {
+            while (0 != Context->Write.Remain)
+            {
+                FuseContextWaitRequest(Context);
 
-            Context->Write.Remain -= BytesTransferred;
-            Context->Write.Offset += BytesTransferred;
+                Context->Write.Length = Context->Write.Remain;
+#if DBG
+                if (DEBUGTEST(10) && Context->Write.Length > 512)
+                    Context->Write.Length = 512;
+#endif
+                if (Context->Write.Length > Context->Instance->MaxWrite)
+                    Context->Write.Length = Context->Instance->MaxWrite;
+                if (Context->Write.Length > Context->FuseRequestLength - FUSE_PROTO_REQ_SIZE(write))
+                    Context->Write.Length = Context->FuseRequestLength - FUSE_PROTO_REQ_SIZE(write);
+
+                Context->InternalResponse->IoStatus.Status = FuseSafeCopyMemory(
+                    (PUINT8)Context->FuseRequest + FUSE_PROTO_REQ_SIZE(write),
+                    (PUINT8)(UINT_PTR)Context->InternalRequest->Req.Write.Address + Context->Write.Offset,
+                    Context->Write.Length);
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
 
-            if (Context->Write.Length > BytesTransferred)
-                break;
+                coro_await (FuseProtoSendWrite(Context));
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+
+                UINT32 BytesTransferred = Context->FuseResponse->rsp.write.size;
+                if (Context->Write.Length < BytesTransferred)
+                {
+                    Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INTERNAL_ERROR;
+                    coro_break;
+                }
+
+                Context->Write.Remain -= BytesTransferred;
+                Context->Write.Offset += BytesTransferred;
+
+                if (Context->Write.Length > BytesTransferred)
+                    break;
+            }
         }
 
         if (Context->Write.Attr.size < Context->Write.StartOffset + Context->Write.Offset)
@@ -1493,6 +2571,8 @@ static BOOLEAN FuseOpWrite(FUSE_CONTEXT *Context)
 
         FuseCacheQuickExpireItem(Context->Instance->Cache,
             Context->File->CacheItem);
+        FuseFileSetAttr(Context->Instance, Context->File,
+            &Context->Write.Attr, Context->Write.AttrExpirationTime);
 
         FuseAttrToFileInfo(Context->Instance, &Context->Write.Attr,
             &Context->InternalResponse->Rsp.Write.FileInfo);
@@ -1504,6 +2584,14 @@ static BOOLEAN FuseOpWrite(FUSE_CONTEXT *Context)
     return coro_active();
 }
 
+static VOID FuseOpWrite_ContextFini(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    if (0 != Context->Write.Results)
+        FuseFree(Context->Write.Results);
+}
+
 static BOOLEAN FuseOpQueryInformation(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
@@ -1516,6 +2604,11 @@ static BOOLEAN FuseOpQueryInformation(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
+        if (FlagOn(Context->Instance->InitFlags, FUSE_PROTO_INIT_WRITEBACK_CACHE))
+            FuseFileWritebackAttr(Context->Instance, Context->File,
+                &Context->FuseResponse->rsp.getattr.attr);
+        FuseUpdateFileAttr(Context);
+
         FuseAttrToFileInfo(Context->Instance, &Context->FuseResponse->rsp.getattr.attr,
             &Context->InternalResponse->Rsp.QueryInformation.FileInfo);
 
@@ -1533,6 +2626,11 @@ static BOOLEAN FuseOpSetInformation_SetBasicInfo(FUSE_CONTEXT *Context)
     {
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.SetInformation.UserContext2;
 
+        /* write back dirty data first, else they would update the times we are setting */
+        coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
         if (0 != Context->InternalRequest->Req.SetInformation.Info.Basic.LastAccessTime ||
             0 != Context->InternalRequest->Req.SetInformation.Info.Basic.LastWriteTime)
         {
@@ -1558,6 +2656,7 @@ static BOOLEAN FuseOpSetInformation_SetBasicInfo(FUSE_CONTEXT *Context)
 
         FuseCacheQuickExpireItem(Context->Instance->Cache,
             Context->File->CacheItem);
+        FuseUpdateFileAttr(Context);
 
         FuseAttrToFileInfo(Context->Instance, &Context->FuseResponse->rsp.getattr.attr,
             &Context->InternalResponse->Rsp.SetInformation.FileInfo);
@@ -1576,6 +2675,10 @@ static BOOLEAN FuseOpSetInformation_SetAllocationSize(FUSE_CONTEXT *Context)
     {
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.SetInformation.UserContext2;
 
+        coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
         coro_await (FuseProtoSendFgetattr(Context));
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
@@ -1593,9 +2696,36 @@ static BOOLEAN FuseOpSetInformation_SetAllocationSize(FUSE_CONTEXT *Context)
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
         }
+        else
+        if (Context->FuseResponse->rsp.getattr.attr.size <
+            Context->InternalRequest->Req.SetInformation.Info.Allocation.AllocationSize)
+        {
+            /*
+             * Preallocate the space between the end of file and the allocation size without
+             * changing the file size, so that a sequential writer that announces the final
+             * size of the file does not have the file grown piecemeal. Preallocation is
+             * advisory: failures (including ENOSYS) are ignored, unless the file system
+             * is out of space.
+             */
+            Context->Fallocate.Offset = Context->FuseResponse->rsp.getattr.attr.size;
+            Context->Fallocate.Length =
+                Context->InternalRequest->Req.SetInformation.Info.Allocation.AllocationSize -
+                Context->FuseResponse->rsp.getattr.attr.size;
+            Context->Fallocate.Mode = 1/*FALLOC_FL_KEEP_SIZE*/;
+            coro_await (FuseProtoSendFallocate(Context));
+            if (STATUS_DISK_FULL == Context->InternalResponse->IoStatus.Status)
+                coro_break;
+            if (NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                Context->File->Preallocated = TRUE;
+
+            coro_await (FuseProtoSendFgetattr(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
+        }
 
         FuseCacheQuickExpireItem(Context->Instance->Cache,
             Context->File->CacheItem);
+        FuseUpdateFileAttr(Context);
 
         FuseAttrToFileInfo(Context->Instance, &Context->FuseResponse->rsp.getattr.attr,
             &Context->InternalResponse->Rsp.SetInformation.FileInfo);
@@ -1614,6 +2744,11 @@ static BOOLEAN FuseOpSetInformation_SetFileSize(FUSE_CONTEXT *Context)
     {
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.SetInformation.UserContext2;
 
+        /* write back dirty data first, so that they are truncated or extended with the file */
+        coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
         Context->Setattr.Attr.size =
             Context->InternalRequest->Req.SetInformation.Info.EndOfFile.FileSize;
         coro_await (FuseProtoSendFtruncate(Context));
@@ -1626,6 +2761,7 @@ static BOOLEAN FuseOpSetInformation_SetFileSize(FUSE_CONTEXT *Context)
 
         FuseCacheQuickExpireItem(Context->Instance->Cache,
             Context->File->CacheItem);
+        FuseUpdateFileAttr(Context);
 
         FuseAttrToFileInfo(Context->Instance, &Context->FuseResponse->rsp.getattr.attr,
             &Context->InternalResponse->Rsp.SetInformation.FileInfo);
@@ -1753,12 +2889,9 @@ static BOOLEAN FuseOpSetInformation_Rename(FUSE_CONTEXT *Context)
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
-        FuseCacheRemoveEntry(
-            Context->Instance->Cache,
-            Context->LookupPath.Ino, &Context->LookupPath.Name);
-
-        FuseCacheRemoveEntry(
+        FuseCacheMoveEntry(
             Context->Instance->Cache,
+            Context->LookupPath.Ino, &Context->LookupPath.Name,
             Context->LookupPath.Ino2, &Context->LookupPath.Name2);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -1793,26 +2926,49 @@ static INT FuseOgSetInformation(FUSE_CONTEXT *Context, BOOLEAN Acquire)
 {
     PAGED_CODE();
 
-    if (Acquire)
+    FUSE_FILE *File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.SetInformation.UserContext2;
+
+    if (FileRenameInformation == Context->InternalRequest->Req.SetInformation.FileInformationClass)
     {
-        if (FileRenameInformation == Context->InternalRequest->Req.SetInformation.FileInformationClass)
-            return FuseOpGuardAcquireExclusive(Context);
-        else
-        if (FileDispositionInformation == Context->InternalRequest->Req.SetInformation.FileInformationClass)
-            return FuseOpGuardAcquireShared(Context);
-        else
-            return FuseOpGuardFalse;
+        /*
+         * File renames lock the old and new parent directories. Directory renames change
+         * the paths of a whole subtree and lock the volume.
+         */
+        if (File->IsDirectory)
+            return Acquire ?
+                FuseOpGuardAcquireExclusive(Context) : FuseOpGuardReleaseExclusive(Context);
+
+        ULONG Index1 = FuseOpGuardDirIndex(
+            (PWSTR)Context->InternalRequest->Buffer, TRUE);
+        ULONG Index2 = FuseOpGuardDirIndex(
+            (PWSTR)(Context->InternalRequest->Buffer +
+                Context->InternalRequest->Req.SetInformation.Info.Rename.NewFileName.Offset),
+            TRUE);
+
+        return FuseOpGuardDirs(Context, Acquire, Index1, Index2, TRUE);
     }
     else
+    if (FileDispositionInformation == Context->InternalRequest->Req.SetInformation.FileInformationClass)
     {
-        if (FileRenameInformation == Context->InternalRequest->Req.SetInformation.FileInformationClass)
-            return FuseOpGuardReleaseExclusive(Context);
-        else
-        if (FileDispositionInformation == Context->InternalRequest->Req.SetInformation.FileInformationClass)
-            return FuseOpGuardReleaseShared(Context);
-        else
+        /*
+         * Only directories are checked (for emptiness) and they must exclude creates in
+         * them. Lock the directory if we know its name, else lock the volume.
+         */
+        if (!File->IsDirectory)
             return FuseOpGuardFalse;
+
+        if (0 == Context->InternalRequest->FileName.Size)
+            return Acquire ?
+                FuseOpGuardAcquireExclusive(Context) : FuseOpGuardReleaseExclusive(Context);
+
+        ULONG Index = FuseOpGuardDirIndex(
+            (PWSTR)(Context->InternalRequest->Buffer + Context->InternalRequest->FileName.Offset),
+            FALSE);
+
+        return FuseOpGuardDirs(Context, Acquire, Index, Index, TRUE);
     }
+    else
+        return FuseOpGuardFalse;
 }
 
 static BOOLEAN FuseOpQueryEa(FUSE_CONTEXT *Context)
@@ -1844,6 +3000,10 @@ static BOOLEAN FuseOpFlushBuffers(FUSE_CONTEXT *Context)
             coro_break;
         }
 
+        coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
         if (Context->File->IsDirectory)
             coro_await (FuseProtoSendFsyncdir(Context));
         else
@@ -1852,12 +3012,15 @@ static BOOLEAN FuseOpFlushBuffers(FUSE_CONTEXT *Context)
             STATUS_INVALID_DEVICE_REQUEST != Context->InternalResponse->IoStatus.Status)
             coro_break;
 
+        Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+
         coro_await (FuseProtoSendFgetattr(Context));
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
         FuseCacheQuickExpireItem(Context->Instance->Cache,
             Context->File->CacheItem);
+        FuseUpdateFileAttr(Context);
 
         FuseAttrToFileInfo(Context->Instance, &Context->FuseResponse->rsp.getattr.attr,
             &Context->InternalResponse->Rsp.FlushBuffers.FileInfo);
@@ -1967,8 +3130,8 @@ static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context)
             PWSTR FileName = (PWSTR)(Context->InternalRequest->Buffer +
                 Context->InternalRequest->Req.QueryDirectory.Pattern.Offset);
             PSTR PosixName;
-            Context->InternalResponse->IoStatus.Status = FspPosixMapWindowsToPosixPathEx(
-                FileName, &PosixName, TRUE);
+            Context->InternalResponse->IoStatus.Status = FuseContextMapPosixPath(
+                &Context->QueryDirectory.PathArena, FileName, &PosixName);
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
             RtlInitString(&Context->QueryDirectory.OrigName, PosixName);
@@ -2008,10 +3171,163 @@ static VOID FuseOpQueryDirectory_GetDirInfoByName(FUSE_CONTEXT *Context)
     }
 }
 
+#define FUSE_QUERYDIRECTORY_LOOKUP_MAX  16
+
+static inline BOOLEAN FuseIsDotOrDotDot(PSTRING Name)
+{
+    return
+        (1 == Name->Length && '.' == Name->Buffer[0]) ||
+        (2 == Name->Length && '.' == Name->Buffer[0] && '.' == Name->Buffer[1]);
+}
+
+static inline FUSE_PROTO_DIRENT *FuseOpQueryDirectory_Dirent(FUSE_CONTEXT *Context,
+    PUINT8 BufferP, FUSE_PROTO_ENTRY **PEntry)
+{
+    FUSE_PROTO_ENTRY *Entry = 0;
+    FUSE_PROTO_DIRENT *Dirent;
+
+    if (Context->QueryDirectory.ReaddirPlus)
+    {
+        if (Context->QueryDirectory.BufferEndP < BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENTPLUS, dirent))
+            return 0;
+        Entry = &((FUSE_PROTO_DIRENTPLUS *)BufferP)->entry;
+        Dirent = &((FUSE_PROTO_DIRENTPLUS *)BufferP)->dirent;
+    }
+    else
+        Dirent = (FUSE_PROTO_DIRENT *)BufferP;
+
+    if (Context->QueryDirectory.BufferEndP <
+            (PUINT8)Dirent + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) ||
+        Context->QueryDirectory.BufferEndP <
+            (PUINT8)Dirent + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) + Dirent->namelen)
+        return 0;
+
+    if (0 != PEntry)
+        *PEntry = Entry;
+    return Dirent;
+}
+
+static inline PUINT8 FuseOpQueryDirectory_NextDirent(FUSE_PROTO_DIRENT *Dirent)
+{
+    return (PUINT8)Dirent + FSP_FSCTL_ALIGN_UP(
+        FIELD_OFFSET(FUSE_PROTO_DIRENT, name) + Dirent->namelen,
+        8);
+}
+
+static VOID FuseOpQueryDirectory_CacheEntries(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Every READDIRPLUS entry (except "." and "..") with a nonzero nodeid counts as a LOOKUP
+     * in the user mode file system. Enter all such entries into the cache now, regardless of
+     * whether they will fit in the FSD buffer, so that their lookup counts are accounted for
+     * and a FORGET is eventually sent for them.
+     */
+
+    FUSE_PROTO_ENTRY *Entry;
+    FUSE_PROTO_DIRENT *Dirent;
+    STRING Name;
+    PVOID CacheItem;
+
+    for (PUINT8 BufferP = Context->QueryDirectory.BufferP;
+        0 != (Dirent = FuseOpQueryDirectory_Dirent(Context, BufferP, &Entry));
+        BufferP = FuseOpQueryDirectory_NextDirent(Dirent))
+    {
+        Name.Length = Name.MaximumLength = (USHORT)Dirent->namelen;
+        Name.Buffer = Dirent->name;
+
+        if (0 == Entry->nodeid || FuseIsDotOrDotDot(&Name))
+            continue;
+
+        FuseCacheSetEntry(
+            Context->Instance->Cache,
+            Context->File->Ino, &Name, Entry, &CacheItem);
+    }
+}
+
+static VOID FuseOpQueryDirectory_LookupEntries(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Prepare the results for the next batch of (up to FUSE_QUERYDIRECTORY_LOOKUP_MAX)
+     * READDIR entries. Entries that are found in the cache are resolved immediately. For
+     * the remaining entries we create child Context's that LOOKUP all of them concurrently.
+     * The results are consumed in directory offset order by FuseOpQueryDirectory_ReadDirectory
+     * after the children complete.
+     */
+
+    FUSE_PROTO_ENTRY Entry;
+    FUSE_PROTO_DIRENT *Dirent;
+    FUSE_CONTEXT_LOOKUP_RESULT *Result;
+    FUSE_CONTEXT *Child;
+    STRING Name;
+    PVOID CacheItem;
+    PUINT8 BufferP;
+    ULONG Index;
+
+    if (0 == Context->QueryDirectory.LookupResults)
+    {
+        Context->QueryDirectory.LookupResults = FuseAlloc(
+            FUSE_QUERYDIRECTORY_LOOKUP_MAX * sizeof(FUSE_CONTEXT_LOOKUP_RESULT));
+        if (0 == Context->QueryDirectory.LookupResults)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+            return;
+        }
+    }
+
+    for (BufferP = Context->QueryDirectory.BufferP, Index = 0;
+        FUSE_QUERYDIRECTORY_LOOKUP_MAX > Index &&
+            0 != (Dirent = FuseOpQueryDirectory_Dirent(Context, BufferP, 0));
+        BufferP = FuseOpQueryDirectory_NextDirent(Dirent), Index++)
+    {
+        Result = &Context->QueryDirectory.LookupResults[Index];
+        Result->Status = STATUS_SUCCESS;
+
+        Name.Length = Name.MaximumLength = (USHORT)Dirent->namelen;
+        Name.Buffer = Dirent->name;
+
+        if (FuseIsDotOrDotDot(&Name))
+            continue;
+
+        if (FuseCacheGetEntry(Context->Instance->Cache,
+            Context->File->Ino, &Name, &Entry, 0, &CacheItem))
+        {
+            Result->Attr = Entry.attr;
+            continue;
+        }
+
+        FuseContextCreateChild(&Child, Context, FUSE_PROTO_OPCODE_LOOKUP);
+        ASSERT(0 != Child);
+        if (FuseContextIsStatus(Child))
+        {
+            Result->Status = FuseContextToStatus(Child);
+            continue;
+        }
+
+        /* if the child never completes its result will be reported as cancelled */
+        Result->Status = STATUS_CANCELLED;
+        Child->LookupChild.Ino = Context->File->Ino;
+        Child->LookupChild.Name = Name;
+        Child->LookupChild.Result = Result;
+    }
+
+    Context->QueryDirectory.LookupEndP = BufferP;
+    Context->QueryDirectory.LookupIndex = 0;
+
+    Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
+}
+
 static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    FUSE_PROTO_ENTRY *Entry;
+    FUSE_PROTO_DIRENT *Dirent;
+    UINT32 N;
+
     coro_block (Context->CoroState)
     {
         Context->QueryDirectory.NextOffset =
@@ -2030,12 +3346,37 @@ static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context)
          * We now approximate the FUSE READDIR buffer size required to fit N entries:
          *
          * read.size = FUSE_PROTO_RSP_HEADER_SIZE + N * (sizeof(FUSE_PROTO_DIRENT) + 24)
+         *
+         * If the user mode file system supports READDIRPLUS we use it instead and size the
+         * buffer using FUSE_PROTO_DIRENTPLUS. READDIRPLUS returns the attributes of every entry
+         * so that we do not have to LOOKUP each one of them. If READDIRPLUS turns out to be
+         * unimplemented (ENOSYS) we fall back to READDIR.
          */
-        UINT32 N = Context->InternalRequest->Req.QueryDirectory.Length /
-            (sizeof(FSP_FSCTL_DIR_INFO) + (24 * sizeof(WCHAR)));
-        Context->QueryDirectory.Length = N * (sizeof(FUSE_PROTO_DIRENT) + 24);
+        Context->QueryDirectory.ReaddirPlus =
+            !!(Context->Instance->InitFlags & FUSE_PROTO_INIT_DO_READDIRPLUS) &&
+            !FuseInstanceGetOpcodeENOSYS(Context->Instance, FUSE_PROTO_OPCODE_READDIRPLUS);
+        if (Context->QueryDirectory.ReaddirPlus)
+        {
+            N = Context->InternalRequest->Req.QueryDirectory.Length /
+                (sizeof(FSP_FSCTL_DIR_INFO) + (24 * sizeof(WCHAR)));
+            Context->QueryDirectory.Length = N * (sizeof(FUSE_PROTO_DIRENTPLUS) + 24);
+            if (Context->QueryDirectory.Length > Context->Instance->MaxRead)
+                Context->QueryDirectory.Length = Context->Instance->MaxRead;
+
+            coro_await (FuseProtoSendReaddirplus(Context));
+            if (STATUS_INVALID_DEVICE_REQUEST == Context->InternalResponse->IoStatus.Status)
+                Context->QueryDirectory.ReaddirPlus = 0;
+        }
+        if (!Context->QueryDirectory.ReaddirPlus)
+        {
+            N = Context->InternalRequest->Req.QueryDirectory.Length /
+                (sizeof(FSP_FSCTL_DIR_INFO) + (24 * sizeof(WCHAR)));
+            Context->QueryDirectory.Length = N * (sizeof(FUSE_PROTO_DIRENT) + 24);
+            if (Context->QueryDirectory.Length > Context->Instance->MaxRead)
+                Context->QueryDirectory.Length = Context->Instance->MaxRead;
 
-        coro_await (FuseProtoSendReaddir(Context));
+            coro_await (FuseProtoSendReaddir(Context));
+        }
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
@@ -2060,25 +3401,40 @@ static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context)
         Context->QueryDirectory.BufferEndP = Context->QueryDirectory.Buffer + Context->FuseResponse->len;
         Context->QueryDirectory.BufferP = Context->QueryDirectory.Buffer + FUSE_PROTO_RSP_HEADER_SIZE;
 
+        if (Context->QueryDirectory.ReaddirPlus)
+            FuseOpQueryDirectory_CacheEntries(Context);
+
+        Context->QueryDirectory.LookupEndP = Context->QueryDirectory.BufferP;
         for (;;)
         {
-            if (Context->QueryDirectory.BufferEndP <
-                    Context->QueryDirectory.BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) ||
-                Context->QueryDirectory.BufferEndP <
-                    Context->QueryDirectory.BufferP + FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
-                        ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen)
+            Dirent = FuseOpQueryDirectory_Dirent(Context, Context->QueryDirectory.BufferP, &Entry);
+            if (0 == Dirent)
                 break;
 
+            if (!Context->QueryDirectory.ReaddirPlus &&
+                Context->QueryDirectory.LookupEndP <= Context->QueryDirectory.BufferP)
+            {
+                FuseOpQueryDirectory_LookupEntries(Context);
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+
+                FuseContextWaitChildren(Context);
+
+                Dirent = FuseOpQueryDirectory_Dirent(Context, Context->QueryDirectory.BufferP, &Entry);
+            }
+
             Context->QueryDirectory.Name.Length = Context->QueryDirectory.Name.MaximumLength = (USHORT)
-                ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen;
+                Dirent->namelen;
             Context->QueryDirectory.Name.Buffer =
-                ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->name;
+                Dirent->name;
 
-            if ((1 == Context->QueryDirectory.Name.Length &&
-                '.' == Context->QueryDirectory.Name.Buffer[0]) ||
-                (2 == Context->QueryDirectory.Name.Length &&
-                '.' == Context->QueryDirectory.Name.Buffer[0] &&
-                '.' == Context->QueryDirectory.Name.Buffer[1]))
+            if (0 != Entry && 0 != Entry->nodeid)
+            {
+                /* READDIRPLUS entry; already entered into the cache */
+                Context->QueryDirectory.Ino = Entry->nodeid;
+                Context->QueryDirectory.Attr = Entry->attr;
+            }
+            else if (FuseIsDotOrDotDot(&Context->QueryDirectory.Name))
             {
                 /*
                  * If the file system gave us a real inode number try getattr on it.
@@ -2087,14 +3443,24 @@ static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context)
                  * best we can).
                  */
                 Context->QueryDirectory.Ino =
-                    FUSE_PROTO_UNKNOWN_INO != ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->ino ?
-                        ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->ino :
+                    FUSE_PROTO_UNKNOWN_INO != Dirent->ino ?
+                        Dirent->ino :
                         Context->File->Ino;
                 coro_await (FuseProtoSendGetattr(Context));
                 if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                     coro_break;
                 Context->Lookup.Attr = Context->FuseResponse->rsp.getattr.attr;
             }
+            else if (!Context->QueryDirectory.ReaddirPlus)
+            {
+                /* READDIR entry; looked up by FuseOpQueryDirectory_LookupEntries */
+                FUSE_CONTEXT_LOOKUP_RESULT *Result =
+                    &Context->QueryDirectory.LookupResults[Context->QueryDirectory.LookupIndex];
+                Context->InternalResponse->IoStatus.Status = Result->Status;
+                if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                    coro_break;
+                Context->QueryDirectory.Attr = Result->Attr;
+            }
             else
             {
                 Context->QueryDirectory.Ino = Context->File->Ino;
@@ -2102,11 +3468,15 @@ static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context)
                 if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                     coro_break;
             }
+            Context->QueryDirectory.LookupIndex++;
+
+            /* recompute after possible coro_await */
+            Dirent = FuseOpQueryDirectory_Dirent(Context, Context->QueryDirectory.BufferP, 0);
 
             BOOLEAN Added = FuseAddDirInfo(
                 Context,
                 &Context->QueryDirectory.Name,
-                ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->off,
+                Dirent->off,
                 &Context->QueryDirectory.Attr,
                 (PVOID)(UINT_PTR)Context->InternalRequest->Req.QueryDirectory.Address,
                 Context->InternalRequest->Req.QueryDirectory.Length,
@@ -2116,10 +3486,7 @@ static VOID FuseOpQueryDirectory_ReadDirectory(FUSE_CONTEXT *Context)
             if (!Added)
                 break;
 
-            Context->QueryDirectory.BufferP += FSP_FSCTL_ALIGN_UP(
-                FIELD_OFFSET(FUSE_PROTO_DIRENT, name) +
-                    ((FUSE_PROTO_DIRENT *)Context->QueryDirectory.BufferP)->namelen,
-                8);
+            Context->QueryDirectory.BufferP = FuseOpQueryDirectory_NextDirent(Dirent);
         }
 
         /* empty readdir response signifies end of dir; add WinFsp end-of-dir marker */
@@ -2162,10 +3529,13 @@ static VOID FuseOpQueryDirectory_ContextFini(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    if (0 != Context->QueryDirectory.LookupResults)
+        FuseFree(Context->QueryDirectory.LookupResults);
     if (0 != Context->QueryDirectory.Buffer)
         FuseFree(Context->QueryDirectory.Buffer);
 
-    FspPosixDeletePath(Context->QueryDirectory.OrigName.Buffer);
+    FuseContextDeletePosixPath(&Context->QueryDirectory.PathArena,
+        Context->QueryDirectory.OrigName.Buffer);
         /* handles NULL paths */
     FuseCacheDereferenceGen(Context->Instance->Cache, Context->QueryDirectory.CacheGen);
         /* handles NULL gens */
@@ -2175,10 +3545,16 @@ static INT FuseOgQueryDirectory(FUSE_CONTEXT *Context, BOOLEAN Acquire)
 {
     PAGED_CODE();
 
-    if (Acquire)
-        return FuseOpGuardAcquireShared(Context);
-    else
-        return FuseOpGuardReleaseShared(Context);
+    /* directory listings lock the directory (its name is passed: PassQueryDirectoryFileName) */
+    if (0 == Context->InternalRequest->FileName.Size)
+        return Acquire ?
+            FuseOpGuardAcquireShared(Context) : FuseOpGuardReleaseShared(Context);
+
+    ULONG Index = FuseOpGuardDirIndex(
+        (PWSTR)(Context->InternalRequest->Buffer + Context->InternalRequest->FileName.Offset),
+        FALSE);
+
+    return FuseOpGuardDirs(Context, Acquire, Index, Index, FALSE);
 }
 
 static BOOLEAN FuseOpFileSystemControl(FUSE_CONTEXT *Context)
@@ -2188,37 +3564,420 @@ static BOOLEAN FuseOpFileSystemControl(FUSE_CONTEXT *Context)
     return FALSE;
 }
 
+static NTSTATUS FuseOpDeviceControl_SetOutput(FUSE_CONTEXT *Context,
+    PVOID Buffer, ULONG Length)
+{
+    PAGED_CODE();
+
+    PVOID InternalResponse = FuseAlloc(sizeof *Context->InternalResponse + Length);
+    if (0 == InternalResponse)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(InternalResponse, sizeof *Context->InternalResponse);
+
+    Context->InternalResponse = InternalResponse;
+    Context->InternalResponse->Size = (UINT16)(sizeof *Context->InternalResponse + Length);
+    Context->InternalResponse->Kind = Context->InternalRequest->Kind;
+    Context->InternalResponse->Hint = Context->InternalRequest->Hint;
+    Context->InternalResponse->Rsp.DeviceControl.Buffer.Offset = 0;
+    Context->InternalResponse->Rsp.DeviceControl.Buffer.Size = (UINT16)Length;
+
+    /* RtlCopyMemory is safe here, because all buffers are in-kernel */
+    RtlCopyMemory(Context->InternalResponse->Buffer, Buffer, Length);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FuseOpDeviceControl_ReleaseSource(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * RELEASE and delete the copy source file in Context->DeviceControl.SourceFile.
+     * The copy source file and the Context->File are swapped while the RELEASE is sent.
+     */
+
+    FUSE_FILE *File;
+
+    coro_block (Context->CoroState)
+    {
+        File = Context->File;
+        Context->File = Context->DeviceControl.SourceFile;
+        Context->DeviceControl.SourceFile = File;
+
+        coro_await (FuseProtoSendRelease(Context));
+
+        File = Context->File;
+        Context->File = Context->DeviceControl.SourceFile;
+        Context->DeviceControl.SourceFile = 0;
+
+        FuseFileDereference(Context->Instance, File);
+    }
+}
+
+static VOID FuseOpDeviceControl_CopySource(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Open the file again (read-only) on behalf of a server-side copy and return a token
+     * that designates the new open file. The new open file shares the CacheItem of the
+     * Context->File; it is RELEASE'd by the copy or when it expires unused.
+     */
+
+    FUSE_IOCTL_COPY_SOURCE_OUTPUT Output;
+    FUSE_FILE *File;
+    UINT32 OpenFlags;
+
+    coro_block (Context->CoroState)
+    {
+        if (FuseInstanceGetOpcodeENOSYS(Context->Instance, FUSE_PROTO_OPCODE_COPY_FILE_RANGE))
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_DEVICE_REQUEST;
+            coro_break;
+        }
+
+        if (Context->File->IsDirectory || Context->File->IsReparsePoint)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
+            coro_break;
+        }
+
+        if (sizeof Output > Context->InternalRequest->Req.DeviceControl.OutputLength)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_BUFFER_TOO_SMALL;
+            coro_break;
+        }
+
+        /* release any copy source files that have expired unused */
+        while (0 != (Context->DeviceControl.SourceFile =
+            FuseFileCopySourceTake(Context->Instance, 0)))
+            coro_await (FuseOpDeviceControl_ReleaseSource(Context));
+
+        /* the copy must see the dirty data of this open file (but not of any other one) */
+        if (Context->File == FuseCacheGetItemDirtyFile(
+            Context->Instance->Cache, Context->File->CacheItem))
+            coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        Context->InternalResponse->IoStatus.Status = FuseFileCreate(
+            Context->Instance, &Context->DeviceControl.SourceFile);
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        Context->DeviceControl.SourceFile->Ino = Context->File->Ino;
+        Context->DeviceControl.SourceFile->OpenFlags = 0/*O_RDONLY*/;
+        Context->DeviceControl.SourceFile->CacheItem = Context->File->CacheItem;
+        FuseCacheReferenceItem(Context->Instance->Cache, Context->File->CacheItem);
+
+        Context->DeviceControl.Ino = Context->File->Ino;
+        File = Context->File;
+        Context->File = Context->DeviceControl.SourceFile;
+        Context->DeviceControl.SourceFile = File;
+
+        coro_await (FuseProtoSendOpen(Context));
+
+        File = Context->File;
+        Context->File = Context->DeviceControl.SourceFile;
+        Context->DeviceControl.SourceFile = File;
+
+        if (!FuseOpenResult(Context, Context->DeviceControl.SourceFile, &OpenFlags))
+            coro_break;
+
+        Context->InternalResponse->IoStatus.Status = FuseFileCopySourceSet(
+            Context->Instance, Context->DeviceControl.SourceFile, &Output.Token);
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+        {
+            coro_await (FuseOpDeviceControl_ReleaseSource(Context));
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
+            coro_break;
+        }
+        Context->DeviceControl.SourceFile = 0;
+
+        /* if this fails the copy source file is released when it expires */
+        Context->InternalResponse->IoStatus.Status = FuseOpDeviceControl_SetOutput(Context,
+            &Output, sizeof Output);
+    }
+}
+
+#define FUSE_COPY_FILE_RANGE_CHUNK_MAX  (1024 * 1024 * 1024)
+
+static VOID FuseOpDeviceControl_CopyFileRange(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Copy a range of the copy source file that is designated by the token to the
+     * Context->File with COPY_FILE_RANGE. The range is copied in chunks, because the
+     * COPY_FILE_RANGE response can only report 32-bit sizes. A short copy is not an error;
+     * the caller is expected to copy the remainder (if any) by reading and writing.
+     *
+     * Dirty data must be written back before the user mode file system copies, but we can
+     * only safely write back the dirty data of the Context->File (see FuseWriteback). If any
+     * other open file has dirty data for the source or target, we let the caller copy.
+     */
+
+    FUSE_IOCTL_COPY_FILE_RANGE_INPUT Input;
+    FUSE_IOCTL_COPY_FILE_RANGE_OUTPUT Output;
+    FUSE_FILE *File;
+
+    coro_block (Context->CoroState)
+    {
+        if (Context->File->IsDirectory || Context->File->IsReparsePoint)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
+            coro_break;
+        }
+
+        if (sizeof Input > Context->InternalRequest->Req.DeviceControl.Buffer.Size)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
+            coro_break;
+        }
+
+        if (sizeof Output > Context->InternalRequest->Req.DeviceControl.OutputLength)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_BUFFER_TOO_SMALL;
+            coro_break;
+        }
+
+        /* RtlCopyMemory is safe here, because all buffers are in-kernel */
+        RtlCopyMemory(&Input,
+            Context->InternalRequest->Buffer +
+                Context->InternalRequest->Req.DeviceControl.Buffer.Offset,
+            sizeof Input);
+
+        Context->DeviceControl.SourceFile = FuseFileCopySourceTake(Context->Instance, Input.Token);
+        if (0 == Context->DeviceControl.SourceFile)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
+            coro_break;
+        }
+
+        Context->DeviceControl.SourceOffset = Input.SourceOffset;
+        Context->DeviceControl.TargetOffset = Input.TargetOffset;
+        Context->DeviceControl.Remain = Input.Length;
+        Context->DeviceControl.BytesCopied = 0;
+
+        if (Context->File == FuseCacheGetItemDirtyFile(
+            Context->Instance->Cache, Context->File->CacheItem))
+            coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        Context->DeviceControl.Status = STATUS_SUCCESS;
+        if (0 != FuseCacheGetItemDirtyFile(
+                Context->Instance->Cache, Context->File->CacheItem) ||
+            0 != FuseCacheGetItemDirtyFile(
+                Context->Instance->Cache, Context->DeviceControl.SourceFile->CacheItem))
+            Context->DeviceControl.Status = STATUS_INVALID_DEVICE_REQUEST;
+        else
+            while (0 != Context->DeviceControl.Remain)
+            {
+                Context->DeviceControl.Length = (UINT32)(
+                    FUSE_COPY_FILE_RANGE_CHUNK_MAX < Context->DeviceControl.Remain ?
+                        FUSE_COPY_FILE_RANGE_CHUNK_MAX : Context->DeviceControl.Remain);
+
+                coro_await (FuseProtoSendCopyFileRange(Context));
+                Context->DeviceControl.Status = Context->InternalResponse->IoStatus.Status;
+                if (!NT_SUCCESS(Context->DeviceControl.Status))
+                    break;
+
+                UINT32 Size = Context->FuseResponse->rsp.copy_file_range.size;
+                if (0 == Size)
+                    break;
+                if (Context->DeviceControl.Length < Size)
+                {
+                    Context->DeviceControl.Status = STATUS_INTERNAL_ERROR;
+                    break;
+                }
+
+                Context->DeviceControl.SourceOffset += Size;
+                Context->DeviceControl.TargetOffset += Size;
+                Context->DeviceControl.Remain -= Size;
+                Context->DeviceControl.BytesCopied += Size;
+            }
+
+        if (0 != Context->DeviceControl.BytesCopied)
+        {
+            /* file data have changed: invalidate cached attributes and read-ahead data */
+            FuseCacheQuickExpireItem(Context->Instance->Cache,
+                Context->File->CacheItem);
+
+            /* report a short copy rather than the error that cut it short */
+            Context->DeviceControl.Status = STATUS_SUCCESS;
+        }
+
+        coro_await (FuseOpDeviceControl_ReleaseSource(Context));
+
+        Context->InternalResponse->IoStatus.Status = Context->DeviceControl.Status;
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        /* WinFsp does not learn the new size from a device control: return it to the caller */
+        coro_await (FuseProtoSendFgetattr(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        FuseUpdateFileAttr(Context);
+
+        Output.BytesCopied = Context->DeviceControl.BytesCopied;
+        Output.FileSize = Context->FuseResponse->rsp.getattr.attr.size;
+        Context->InternalResponse->IoStatus.Status = FuseOpDeviceControl_SetOutput(Context,
+            &Output, sizeof Output);
+    }
+}
+
+static VOID FuseOpDeviceControl_Seek(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    /*
+     * Find the next data or hole in the file at or after an offset (LSEEK). Dirty data of
+     * the Context->File are written back first, because they may fill holes. If another
+     * open file has dirty data we let the caller read the file instead.
+     */
+
+    FUSE_IOCTL_SEEK_INPUT Input;
+    FUSE_IOCTL_SEEK_OUTPUT Output;
+
+    coro_block (Context->CoroState)
+    {
+        if (Context->File->IsDirectory || Context->File->IsReparsePoint)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
+            coro_break;
+        }
+
+        if (sizeof Input > Context->InternalRequest->Req.DeviceControl.Buffer.Size)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
+            coro_break;
+        }
+
+        if (sizeof Output > Context->InternalRequest->Req.DeviceControl.OutputLength)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_BUFFER_TOO_SMALL;
+            coro_break;
+        }
+
+        /* RtlCopyMemory is safe here, because all buffers are in-kernel */
+        RtlCopyMemory(&Input,
+            Context->InternalRequest->Buffer +
+                Context->InternalRequest->Req.DeviceControl.Buffer.Offset,
+            sizeof Input);
+
+        if (FUSE_IOCTL_SEEK_DATA != Input.Whence && FUSE_IOCTL_SEEK_HOLE != Input.Whence)
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_PARAMETER;
+            coro_break;
+        }
+
+        Context->Lseek.Offset = Input.Offset;
+        Context->Lseek.Whence = Input.Whence;
+
+        if (Context->File == FuseCacheGetItemDirtyFile(
+            Context->Instance->Cache, Context->File->CacheItem))
+            coro_await (FuseWriteback(Context));
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        if (0 != FuseCacheGetItemDirtyFile(
+            Context->Instance->Cache, Context->File->CacheItem))
+        {
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_DEVICE_REQUEST;
+            coro_break;
+        }
+
+        coro_await (FuseProtoSendLseek(Context));
+        if (STATUS_FILE_INVALID == Context->InternalResponse->IoStatus.Status)
+        {
+            /* ENXIO: offset is at or past the end of file (or no data follows it) */
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_END_OF_FILE;
+            coro_break;
+        }
+        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+            coro_break;
+
+        Output.Offset = Context->FuseResponse->rsp.lseek.offset;
+        Context->InternalResponse->IoStatus.Status = FuseOpDeviceControl_SetOutput(Context,
+            &Output, sizeof Output);
+    }
+}
+
 static BOOLEAN FuseOpDeviceControl(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
-    return FALSE;
+    coro_block (Context->CoroState)
+    {
+        Context->Fini = FuseOpDeviceControl_ContextFini;
+        Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.DeviceControl.UserContext2;
+
+        if (0 == Context->File)
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_DEVICE_REQUEST;
+        else
+        if (FUSE_IOCTL_COPY_SOURCE == Context->InternalRequest->Req.DeviceControl.IoControlCode)
+            coro_await (FuseOpDeviceControl_CopySource(Context));
+        else
+        if (FUSE_IOCTL_COPY_FILE_RANGE == Context->InternalRequest->Req.DeviceControl.IoControlCode)
+            coro_await (FuseOpDeviceControl_CopyFileRange(Context));
+        else
+        if (FUSE_IOCTL_SEEK == Context->InternalRequest->Req.DeviceControl.IoControlCode)
+            coro_await (FuseOpDeviceControl_Seek(Context));
+        else
+            Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    return coro_active();
+}
+
+static VOID FuseOpDeviceControl_ContextFini(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    if (0 != Context->DeviceControl.SourceFile)
+        FuseFileDereference(Context->Instance, Context->DeviceControl.SourceFile);
 }
 
 static BOOLEAN FuseOpQuerySecurity(FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    PVOID SecurityCacheItem;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    ULONG Length;
+
     coro_block (Context->CoroState)
     {
         Context->Fini = FuseSecurity_ContextFini;
         Context->File = (PVOID)(UINT_PTR)Context->InternalRequest->Req.QuerySecurity.UserContext2;
 
-        coro_await (FuseProtoSendFgetattr(Context));
-        if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
-            coro_break;
+        /* skip the FGETATTR if the attributes of the file's cache item are still fresh */
+        if (!FuseCacheGetItemAttr(Context->Instance->Cache,
+            Context->File->CacheItem, &Context->Security.Attr))
+        {
+            coro_await (FuseProtoSendFgetattr(Context));
+            if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
+                coro_break;
 
-        Context->InternalResponse->IoStatus.Status = FspPosixMapPermissionsToSecurityDescriptor(
-            Context->FuseResponse->rsp.getattr.attr.uid,
-            Context->FuseResponse->rsp.getattr.attr.gid,
-            Context->FuseResponse->rsp.getattr.attr.mode,
-            &Context->Security.SecurityDescriptor);
+            Context->Security.Attr = Context->FuseResponse->rsp.getattr.attr;
+        }
+
+        Context->InternalResponse->IoStatus.Status = FuseSecurityCacheReferenceItem(
+            Context->Instance->SecurityCache,
+            Context->Security.Attr.uid,
+            Context->Security.Attr.gid,
+            Context->Security.Attr.mode,
+            &SecurityCacheItem);
         if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
             coro_break;
 
-        ULONG Length = RtlLengthSecurityDescriptor(Context->Security.SecurityDescriptor);
+        SecurityDescriptor = FuseSecurityCacheGetItemSecurityDescriptor(
+            Context->Instance->SecurityCache, SecurityCacheItem, &Length);
         if (FSP_FSCTL_TRANSACT_RSP_BUFFER_SIZEMAX < Length)
         {
+            FuseSecurityCacheDereferenceItem(Context->Instance->SecurityCache, SecurityCacheItem);
             Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INVALID_SECURITY_DESCR;
             coro_break;
         }
@@ -2226,6 +3985,7 @@ static BOOLEAN FuseOpQuerySecurity(FUSE_CONTEXT *Context)
         PVOID InternalResponse = FuseAlloc(sizeof *Context->InternalResponse + Length);
         if (0 == InternalResponse)
         {
+            FuseSecurityCacheDereferenceItem(Context->Instance->SecurityCache, SecurityCacheItem);
             Context->InternalResponse->IoStatus.Status = (UINT32)STATUS_INSUFFICIENT_RESOURCES;
             coro_break;
         }
@@ -2240,7 +4000,9 @@ static BOOLEAN FuseOpQuerySecurity(FUSE_CONTEXT *Context)
 
         /* RtlCopyMemory is safe here, because all buffers are in-kernel */
         RtlCopyMemory(
-            Context->InternalResponse->Buffer, Context->Security.SecurityDescriptor, Length);
+            Context->InternalResponse->Buffer, SecurityDescriptor, Length);
+
+        FuseSecurityCacheDereferenceItem(Context->Instance->SecurityCache, SecurityCacheItem);
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
     }
@@ -2321,6 +4083,10 @@ static BOOLEAN FuseOpSetSecurity(FUSE_CONTEXT *Context)
             coro_await (FuseProtoSendSetattr(Context));
             if (!NT_SUCCESS(Context->InternalResponse->IoStatus.Status))
                 coro_break;
+
+            /* ownership or mode have changed: invalidate cached attributes */
+            FuseCacheQuickExpireItem(Context->Instance->Cache,
+                Context->File->CacheItem);
         }
 
         Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;
@@ -2388,7 +4154,7 @@ FUSE_OPERATION FuseOperations[FspFsctlTransactKindCount] =
     { 0 },
 
     /* FspFsctlTransactDeviceControlKind */
-    { 0 },
+    { FuseOpDeviceControl },
 
     /* FspFsctlTransactShutdownKind */
     { 0 },
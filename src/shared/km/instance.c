@@ -26,9 +26,19 @@ NTSTATUS FuseInstanceInit(FUSE_INSTANCE *Instance,
     FUSE_INSTANCE_TYPE InstanceType);
 VOID FuseInstanceFini(FUSE_INSTANCE *Instance);
 VOID FuseInstanceExpirationRoutine(FUSE_INSTANCE *Instance, UINT64 ExpirationTime);
+NTSTATUS FuseInstanceGetTokenUidGid(FUSE_INSTANCE *Instance,
+    PACCESS_TOKEN Token, PUINT32 PUid, PUINT32 PGid);
+static VOID FuseInstanceTransactResponseData(FUSE_CONTEXT *Context,
+    FUSE_PROTO_RSP *FuseResponse, FUSE_IOVEC *FuseResponseData, ULONG FuseResponseDataCount);
+static FUSE_PROTO_RSP *FuseInstanceTransactStageResponse(
+    FUSE_PROTO_RSP *FuseResponse, FUSE_IOVEC *FuseResponseData, ULONG FuseResponseDataCount);
+static NTSTATUS FuseInstanceTransactWait(FUSE_INSTANCE *Instance,
+    PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject, PIRP CancellableIrp,
+    FUSE_CONTEXT **PContext, FSP_FSCTL_TRANSACT_REQ **PInternalRequest);
 NTSTATUS FuseInstanceTransact(FUSE_INSTANCE *Instance,
     FUSE_PROTO_RSP *FuseResponse, ULONG InputBufferLength,
-    FUSE_PROTO_REQ *FuseRequest, PULONG POutputBufferLength,
+    FUSE_IOVEC *FuseResponseData, ULONG FuseResponseDataCount,
+    FUSE_PROTO_REQ *FuseRequest, PULONG POutputBufferLength, BOOLEAN Wait,
     PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
     PIRP CancellableIrp);
 
@@ -36,6 +46,10 @@ NTSTATUS FuseInstanceTransact(FUSE_INSTANCE *Instance,
 #pragma alloc_text(PAGE, FuseInstanceInit)
 #pragma alloc_text(PAGE, FuseInstanceFini)
 #pragma alloc_text(PAGE, FuseInstanceExpirationRoutine)
+#pragma alloc_text(PAGE, FuseInstanceGetTokenUidGid)
+#pragma alloc_text(PAGE, FuseInstanceTransactResponseData)
+#pragma alloc_text(PAGE, FuseInstanceTransactStageResponse)
+#pragma alloc_text(PAGE, FuseInstanceTransactWait)
 #pragma alloc_text(PAGE, FuseInstanceTransact)
 #endif
 
@@ -52,6 +66,10 @@ NTSTATUS FuseInstanceInit(FUSE_INSTANCE *Instance,
     Instance->InstanceType = InstanceType;
 
     FuseRwlockInitialize(&Instance->OpGuardLock);
+    for (ULONG Index = 0; FUSE_OPGUARD_DIRLOCK_COUNT > Index; Index++)
+        FuseRwlockInitialize(&Instance->OpGuardDirLocks[Index]);
+
+    ExInitializeFastMutex(&Instance->TokenCacheMutex);
 
     Result = FuseIoqCreate(&Instance->Ioq);
     if (!NT_SUCCESS(Result))
@@ -61,6 +79,10 @@ NTSTATUS FuseInstanceInit(FUSE_INSTANCE *Instance,
     if (!NT_SUCCESS(Result))
         goto exit;
 
+    Result = FuseSecurityCacheCreate(0, &Instance->SecurityCache);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
     FuseFileInstanceInit(Instance);
 
     KeInitializeEvent(&Instance->InitEvent, NotificationEvent, FALSE);
@@ -86,12 +108,17 @@ NTSTATUS FuseInstanceInit(FUSE_INSTANCE *Instance,
 exit:
     if (!NT_SUCCESS(Result))
     {
+        if (0 != Instance->SecurityCache)
+            FuseSecurityCacheDelete(Instance->SecurityCache);
+
         if (0 != Instance->Cache)
             FuseCacheDelete(Instance->Cache);
 
         if (0 != Instance->Ioq)
             FuseIoqDelete(Instance->Ioq);
 
+        for (ULONG Index = 0; FUSE_OPGUARD_DIRLOCK_COUNT > Index; Index++)
+            FuseRwlockFinalize(&Instance->OpGuardDirLocks[Index]);
         FuseRwlockFinalize(&Instance->OpGuardLock);
 
         RtlZeroMemory(Instance, sizeof *Instance);
@@ -123,6 +150,10 @@ VOID FuseInstanceFini(FUSE_INSTANCE *Instance)
 
     FuseCacheDelete(Instance->Cache);
 
+    FuseSecurityCacheDelete(Instance->SecurityCache);
+
+    for (ULONG Index = 0; FUSE_OPGUARD_DIRLOCK_COUNT > Index; Index++)
+        FuseRwlockFinalize(&Instance->OpGuardDirLocks[Index]);
     FuseRwlockFinalize(&Instance->OpGuardLock);
 }
 
@@ -130,19 +161,211 @@ VOID FuseInstanceExpirationRoutine(FUSE_INSTANCE *Instance, UINT64 ExpirationTim
 {
     PAGED_CODE();
 
+    FUSE_FILE *File;
+
     FuseCacheExpirationRoutine(Instance->Cache, Instance, ExpirationTime);
+
+    /* write back dirty data that have not been written back by other operations in time */
+    if (FlagOn(Instance->InitFlags, FUSE_PROTO_INIT_WRITEBACK_CACHE))
+        while (0 != (File = FuseFileWritebackExpired(Instance, ExpirationTime)))
+            if (!NT_SUCCESS(FuseProtoPostWriteback(Instance, File)))
+                break;
+}
+
+NTSTATUS FuseInstanceGetTokenUidGid(FUSE_INSTANCE *Instance,
+    PACCESS_TOKEN Token, PUINT32 PUid, PUINT32 PGid)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+    LUID AuthenticationId;
+    FUSE_TOKEN_CACHE_ENTRY *Entry;
+    UINT64 InterruptTime;
+    UINT32 Uid, Gid;
+    BOOLEAN Found;
+
+    Result = SeQueryAuthenticationIdToken(Token, &AuthenticationId);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    Entry = &Instance->TokenCache[FuseHashMix64(
+        ((UINT64)(UINT32)AuthenticationId.HighPart << 32) | AuthenticationId.LowPart) %
+        FUSE_TOKEN_CACHE_COUNT];
+    InterruptTime = KeQueryInterruptTime();
+
+    ExAcquireFastMutex(&Instance->TokenCacheMutex);
+    Found = Entry->Valid &&
+        RtlEqualLuid(&Entry->AuthenticationId, &AuthenticationId) &&
+        InterruptTime < Entry->ExpirationTime;
+    Uid = Entry->Uid;
+    Gid = Entry->Gid;
+    ExReleaseFastMutex(&Instance->TokenCacheMutex);
+
+    if (!Found)
+    {
+        Result = FuseGetTokenUid(Token, TokenUser, &Uid);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        Result = FuseGetTokenUid(Token, TokenPrimaryGroup, &Gid);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        ExAcquireFastMutex(&Instance->TokenCacheMutex);
+        Entry->AuthenticationId = AuthenticationId;
+        Entry->ExpirationTime = InterruptTime + FUSE_TOKEN_CACHE_TIMEOUT;
+        Entry->Uid = Uid;
+        Entry->Gid = Gid;
+        Entry->Valid = TRUE;
+        ExReleaseFastMutex(&Instance->TokenCacheMutex);
+    }
+
+    *PUid = Uid;
+    *PGid = Gid;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FuseInstanceTransactResponseData(FUSE_CONTEXT *Context,
+    FUSE_PROTO_RSP *FuseResponse, FUSE_IOVEC *FuseResponseData, ULONG FuseResponseDataCount)
+{
+    PAGED_CODE();
+
+    /*
+     * Copy the data of a successful response directly to the destination that the Context
+     * has asked for (see FUSE_CONTEXT::ResponseData). The data come either from the
+     * FuseResponse or from the separate FuseResponseData buffers of the caller.
+     */
+
+    UINT32 Length = FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE;
+
+    Context->ResponseData.Status = STATUS_SUCCESS;
+    if (0 == FuseResponse->error && 0 != Length)
+    {
+        if (Context->ResponseData.Length < Length)
+            /* the operation will detect and report this */;
+        else if (0 != FuseResponseDataCount)
+            Context->ResponseData.Status = FuseSafeCopyIoVector(
+                Context->ResponseData.Address,
+                FuseResponseData, FuseResponseDataCount,
+                Length);
+        else
+            Context->ResponseData.Status = FuseSafeCopyMemory(
+                Context->ResponseData.Address,
+                (PUINT8)FuseResponse + FUSE_PROTO_RSP_HEADER_SIZE,
+                Length);
+    }
+
+    Context->ResponseData.Address = 0;
+}
+
+static FUSE_PROTO_RSP *FuseInstanceTransactStageResponse(
+    FUSE_PROTO_RSP *FuseResponse, FUSE_IOVEC *FuseResponseData, ULONG FuseResponseDataCount)
+{
+    PAGED_CODE();
+
+    /*
+     * Assemble the response header and the separate FuseResponseData buffers of the caller
+     * into a single kernel buffer, so that the operation can parse the response. If the
+     * FuseResponseData cannot be read, the response is turned into an EIO error response.
+     */
+
+    FUSE_PROTO_RSP *StagedResponse;
+    NTSTATUS Result;
+
+    StagedResponse = FuseAllocMustSucceed(FuseResponse->len);
+    RtlCopyMemory(StagedResponse, FuseResponse, FUSE_PROTO_RSP_HEADER_SIZE);
+
+    Result = FuseSafeCopyIoVector(
+        (PUINT8)StagedResponse + FUSE_PROTO_RSP_HEADER_SIZE,
+        FuseResponseData, FuseResponseDataCount,
+        FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE);
+    if (!NT_SUCCESS(Result))
+    {
+        StagedResponse->len = FUSE_PROTO_RSP_HEADER_SIZE;
+        StagedResponse->error = -5/*EIO*/;
+    }
+
+    return StagedResponse;
+}
+
+static NTSTATUS FuseInstanceTransactWait(FUSE_INSTANCE *Instance,
+    PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject, PIRP CancellableIrp,
+    FUSE_CONTEXT **PContext, FSP_FSCTL_TRANSACT_REQ **PInternalRequest)
+    /*
+     * Wait for work: either a Context posted to the Ioq (e.g. the children of a Context
+     * or a FORGET) or a new WinFsp request.
+     *
+     * A thread that waits in FspFsextProviderTransact cannot be woken up when a Context
+     * is posted to the Ioq. For this reason only one thread at a time waits for WinFsp
+     * requests; the other threads wait on the Ioq. When the WinFsp waiter returns, it wakes
+     * up one of the Ioq waiters to take its place.
+     *
+     * If no work arrives within the transact timeout, STATUS_SUCCESS is returned with
+     * neither a Context nor an InternalRequest.
+     */
+{
+    PAGED_CODE();
+
+    LARGE_INTEGER Timeout;
+    NTSTATUS Result;
+
+    *PContext = 0;
+    *PInternalRequest = 0;
+
+    Timeout.QuadPart = (0 != Instance->VolumeParams->TransactTimeout ?
+        Instance->VolumeParams->TransactTimeout : 1000) * -10000LL;
+        /* relative timeout in 100ns units */
+
+    for (;;)
+    {
+        *PContext = FuseIoqNextPending(Instance->Ioq);
+        if (0 != *PContext)
+            return STATUS_SUCCESS;
+
+        if (0 == InterlockedCompareExchange(&Instance->ProviderWaiter, 1, 0))
+        {
+            Result = FspFsextProviderTransact(
+                DeviceObject, FileObject, 0, PInternalRequest);
+            InterlockedExchange(&Instance->ProviderWaiter, 0);
+            FuseIoqWakePending(Instance->Ioq);
+            return Result;
+        }
+
+        Result = FuseIoqWaitPending(Instance->Ioq, &Timeout, CancellableIrp);
+        if (STATUS_TIMEOUT == Result)
+            return STATUS_SUCCESS;
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
 }
 
 NTSTATUS FuseInstanceTransact(FUSE_INSTANCE *Instance,
     FUSE_PROTO_RSP *FuseResponse, ULONG InputBufferLength,
-    FUSE_PROTO_REQ *FuseRequest, PULONG POutputBufferLength,
+    FUSE_IOVEC *FuseResponseData, ULONG FuseResponseDataCount,
+    FUSE_PROTO_REQ *FuseRequest, PULONG POutputBufferLength, BOOLEAN Wait,
     PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
     PIRP CancellableIrp)
+    /*
+     * Deliver a FUSE response (if any) and get the next FUSE request (if any).
+     *
+     * FuseResponse contains the whole response of InputBufferLength bytes; or if
+     * FuseResponseDataCount is not 0 it contains only the response header and the
+     * FuseResponseData buffers (scatter-gather list) contain the remainder of the response.
+     * The FuseResponseData buffers may be user mode buffers of the current process; they let
+     * READ data move from the user mode file system to their destination with a single copy.
+     *
+     * If Wait is FALSE and no FUSE request can be produced without waiting for the next
+     * WinFsp request (or for INIT), the response (if any) is still delivered, but no request
+     * is returned and STATUS_PENDING is returned instead. The caller may then repeat the
+     * transact for the request only (e.g. from another thread) with Wait set to TRUE.
+     */
 {
     PAGED_CODE();
 
     ULONG OutputBufferLength = *POutputBufferLength;
     FSP_FSCTL_TRANSACT_REQ *InternalRequest = 0;
+    FUSE_PROTO_RSP *StagedResponse = 0;
     FSP_FSCTL_TRANSACT_RSP InternalResponse;
     FUSE_CONTEXT *Context;
     BOOLEAN Continue;
@@ -155,13 +378,21 @@ NTSTATUS FuseInstanceTransact(FUSE_INSTANCE *Instance,
     {
         if (FUSE_PROTO_RSP_HEADER_SIZE > InputBufferLength ||
             FUSE_PROTO_RSP_HEADER_SIZE > FuseResponse->len ||
-            FuseResponse->len > InputBufferLength)
+            FuseResponse->len > InputBufferLength ||
+            FUSE_PROTO_RSP_SIZEMAX < FuseResponse->len)
             return STATUS_INVALID_PARAMETER;
     }
     if (0 != FuseRequest)
     {
         if (FUSE_PROTO_REQ_SIZEMIN > OutputBufferLength)
             return STATUS_BUFFER_TOO_SMALL;
+
+        /*
+         * The largest request we ever produce is a WRITE carrying MaxWrite bytes of data
+         * (see FuseOpWrite); there is no need to make any space beyond that available.
+         */
+        if (FUSE_PROTO_REQ_SIZEMAX < OutputBufferLength)
+            OutputBufferLength = FUSE_PROTO_REQ_SIZEMAX;
     }
 
     if (0 != FuseResponse)
@@ -170,6 +401,13 @@ NTSTATUS FuseInstanceTransact(FUSE_INSTANCE *Instance,
         if (0 == Context)
             goto request;
 
+        if (0 != Context->ResponseData.Address)
+            FuseInstanceTransactResponseData(Context,
+                FuseResponse, FuseResponseData, FuseResponseDataCount);
+        else if (0 != FuseResponseDataCount && FUSE_PROTO_RSP_HEADER_SIZE < FuseResponse->len)
+            FuseResponse = StagedResponse = FuseInstanceTransactStageResponse(
+                FuseResponse, FuseResponseData, FuseResponseDataCount);
+
 #if DBG
         if (fuse_debug & fuse_debug_dp)
             FuseDebugLogResponse(FuseResponse);
@@ -178,7 +416,10 @@ NTSTATUS FuseInstanceTransact(FUSE_INSTANCE *Instance,
         Continue = FuseContextProcess(Context, FuseResponse, 0, 0);
 
         if (Continue)
-            FuseIoqPostPending(Instance->Ioq, Context);
+        {
+            if (!FuseContextPostChildren(Context))
+                FuseIoqPostPending(Instance->Ioq, Context);
+        }
         else if (0 == Context->InternalRequest)
             FuseContextDelete(Context);
         else
@@ -201,6 +442,12 @@ request:
         Context = FuseIoqNextPending(Instance->Ioq);
         if (0 == Context)
         {
+            if (!Wait)
+            {
+                Result = STATUS_PENDING;
+                goto exit;
+            }
+
             UINT32 VersionMajor = Instance->VersionMajor;
             _ReadWriteBarrier();
                 /*
@@ -229,26 +476,34 @@ request:
                 goto exit;
             }
 
-            Result = FspFsextProviderTransact(
-                DeviceObject, FileObject, 0, &InternalRequest);
+            Result = FuseInstanceTransactWait(Instance,
+                DeviceObject, FileObject, CancellableIrp, &Context, &InternalRequest);
             if (!NT_SUCCESS(Result))
                 goto exit;
-            if (0 == InternalRequest)
+            if (0 != Context)
             {
-                Result = STATUS_SUCCESS;
-                goto exit;
+                ASSERT(!FuseContextIsStatus(Context));
+                Continue = FuseContextProcess(Context, 0, FuseRequest, OutputBufferLength);
             }
+            else
+            {
+                if (0 == InternalRequest)
+                {
+                    Result = STATUS_SUCCESS;
+                    goto exit;
+                }
 
-            ASSERT(FspFsctlTransactReservedKind != InternalRequest->Kind);
+                ASSERT(FspFsctlTransactReservedKind != InternalRequest->Kind);
 
-            FuseContextCreate(&Context, Instance, InternalRequest);
-            ASSERT(0 != Context);
+                FuseContextCreate(&Context, Instance, InternalRequest);
+                ASSERT(0 != Context);
 
-            Continue = FALSE;
-            if (!FuseContextIsStatus(Context))
-            {
-                InternalRequest = 0;
-                Continue = FuseContextProcess(Context, 0, FuseRequest, OutputBufferLength);
+                Continue = FALSE;
+                if (!FuseContextIsStatus(Context))
+                {
+                    InternalRequest = 0;
+                    Continue = FuseContextProcess(Context, 0, FuseRequest, OutputBufferLength);
+                }
             }
         }
         else
@@ -260,6 +515,9 @@ request:
         if (Continue)
         {
             ASSERT(!FuseContextIsStatus(Context));
+            if (FuseContextPostChildren(Context))
+                /* Context is waiting for its children; pick up the next pending Context */
+                goto request;
             FuseIoqStartProcessing(Instance->Ioq, Context);
         }
         else if (FuseContextIsStatus(Context))
@@ -286,6 +544,9 @@ request:
                 else
                     FuseContextDelete(Context);
                 break;
+            default:
+                FuseContextDelete(Context);
+                break;
             }
         }
         else
@@ -308,6 +569,9 @@ request:
     Result = STATUS_SUCCESS;
 
 exit:
+    if (0 != StagedResponse)
+        FuseFree(StagedResponse);
+
     if (0 != InternalRequest)
         FuseFreeExternal(InternalRequest);
 
@@ -28,6 +28,10 @@ FUSE_CONTEXT *FuseIoqEndProcessing(FUSE_IOQ *Ioq, UINT64 Unique);
 VOID FuseIoqPostPending(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 VOID FuseIoqPostPendingAndStop(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq);
+NTSTATUS FuseIoqWaitPending(FUSE_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp);
+VOID FuseIoqWakePending(FUSE_IOQ *Ioq);
+VOID FuseIoqSetPendingRoutine(FUSE_IOQ *Ioq,
+    FUSE_IOQ_PENDING_ROUTINE *PendingRoutine, PVOID PendingRoutineContext);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FuseIoqCreate)
@@ -37,6 +41,9 @@ FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq);
 #pragma alloc_text(PAGE, FuseIoqPostPending)
 #pragma alloc_text(PAGE, FuseIoqPostPendingAndStop)
 #pragma alloc_text(PAGE, FuseIoqNextPending)
+#pragma alloc_text(PAGE, FuseIoqWaitPending)
+#pragma alloc_text(PAGE, FuseIoqWakePending)
+#pragma alloc_text(PAGE, FuseIoqSetPendingRoutine)
 #endif
 
 #define FUSE_IOQ_SIZE                   1024
@@ -44,8 +51,11 @@ FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq);
 struct _FUSE_IOQ
 {
     FAST_MUTEX Mutex;
+    KEVENT PendingEvent;
     LIST_ENTRY PendingList, ProcessList;
     FUSE_CONTEXT *LastContext;
+    FUSE_IOQ_PENDING_ROUTINE *PendingRoutine;
+    PVOID PendingRoutineContext;
     ULONG ProcessBucketCount;
     FUSE_CONTEXT *ProcessBuckets[];
 };
@@ -64,6 +74,7 @@ NTSTATUS FuseIoqCreate(FUSE_IOQ **PIoq)
     RtlZeroMemory(Ioq, FUSE_IOQ_SIZE);
 
     ExInitializeFastMutex(&Ioq->Mutex);
+    KeInitializeEvent(&Ioq->PendingEvent, SynchronizationEvent, FALSE);
     InitializeListHead(&Ioq->PendingList);
     InitializeListHead(&Ioq->ProcessList);
     Ioq->ProcessBucketCount = BucketCount;
@@ -77,18 +88,16 @@ VOID FuseIoqDelete(FUSE_IOQ *Ioq)
 {
     PAGED_CODE();
 
-    for (PLIST_ENTRY Entry = Ioq->PendingList.Flink; &Ioq->PendingList != Entry;)
-    {
-        FUSE_CONTEXT *Context = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
-        Entry = Entry->Flink;
-        FuseContextDelete(Context);
-    }
-    for (PLIST_ENTRY Entry = Ioq->ProcessList.Flink; &Ioq->ProcessList != Entry;)
-    {
-        FUSE_CONTEXT *Context = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
-        Entry = Entry->Flink;
-        FuseContextDelete(Context);
-    }
+    /*
+     * Deleting a child Context may post its parent to the Pending list.
+     * So delete the Process list first and drain the Pending list last.
+     */
+    while (!IsListEmpty(&Ioq->ProcessList))
+        FuseContextDelete(
+            CONTAINING_RECORD(RemoveHeadList(&Ioq->ProcessList), FUSE_CONTEXT, ListEntry));
+    while (!IsListEmpty(&Ioq->PendingList))
+        FuseContextDelete(
+            CONTAINING_RECORD(RemoveHeadList(&Ioq->PendingList), FUSE_CONTEXT, ListEntry));
     FuseFree(Ioq);
 }
 
@@ -160,6 +169,9 @@ VOID FuseIoqPostPending(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    FUSE_IOQ_PENDING_ROUTINE *PendingRoutine;
+    PVOID PendingRoutineContext;
+
     ExAcquireFastMutex(&Ioq->Mutex);
 
     if (0 != Ioq->LastContext)
@@ -170,8 +182,15 @@ VOID FuseIoqPostPending(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
     }
 
     InsertTailList(&Ioq->PendingList, &Context->ListEntry);
+    PendingRoutine = Ioq->PendingRoutine;
+    PendingRoutineContext = Ioq->PendingRoutineContext;
 
     ExReleaseFastMutex(&Ioq->Mutex);
+
+    KeSetEvent(&Ioq->PendingEvent, 1, FALSE);
+
+    if (0 != PendingRoutine)
+        PendingRoutine(PendingRoutineContext);
 }
 
 VOID FuseIoqPostPendingAndStop(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
@@ -185,6 +204,8 @@ VOID FuseIoqPostPendingAndStop(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
 {
     PAGED_CODE();
 
+    LIST_ENTRY PendingList;
+
     ExAcquireFastMutex(&Ioq->Mutex);
 
     if (0 != Ioq->LastContext)
@@ -194,11 +215,13 @@ VOID FuseIoqPostPendingAndStop(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
         return;
     }
 
-    for (PLIST_ENTRY Entry = Ioq->PendingList.Flink; &Ioq->PendingList != Entry;)
+    InitializeListHead(&PendingList);
+    if (!IsListEmpty(&Ioq->PendingList))
     {
-        FUSE_CONTEXT *Temp = CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry);
-        Entry = Entry->Flink;
-        FuseContextDelete(Temp);
+        PendingList = Ioq->PendingList;
+        /* fixup first/last list entry */
+        PendingList.Flink->Blink = &PendingList;
+        PendingList.Blink->Flink = &PendingList;
     }
     InitializeListHead(&Ioq->PendingList);
 
@@ -206,6 +229,16 @@ VOID FuseIoqPostPendingAndStop(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context)
     Ioq->LastContext = Context;
 
     ExReleaseFastMutex(&Ioq->Mutex);
+
+    KeSetEvent(&Ioq->PendingEvent, 1, FALSE);
+
+    /*
+     * Delete the old Pending list outside the mutex. Deleting a child Context may post
+     * its parent, which will be deleted immediately as the last Context has been posted.
+     */
+    while (!IsListEmpty(&PendingList))
+        FuseContextDelete(
+            CONTAINING_RECORD(RemoveHeadList(&PendingList), FUSE_CONTEXT, ListEntry));
 }
 
 FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq)
@@ -224,10 +257,60 @@ FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq)
     FUSE_CONTEXT *Context = &Ioq->PendingList != Entry ?
         CONTAINING_RECORD(Entry, FUSE_CONTEXT, ListEntry) : 0;
 
+    BOOLEAN MorePending = FALSE;
     if (0 != Context)
+    {
         RemoveEntryList(&Context->ListEntry);
+        MorePending = !IsListEmpty(&Ioq->PendingList);
+    }
 
     ExReleaseFastMutex(&Ioq->Mutex);
 
+    /* PendingEvent is an auto-reset event; pass the wake up on to the next waiter */
+    if (MorePending)
+        KeSetEvent(&Ioq->PendingEvent, 1, FALSE);
+
     return Context;
 }
+
+NTSTATUS FuseIoqWaitPending(FUSE_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp)
+    /*
+     * Wait until a Context is posted to the Pending list (or until the wait is woken up
+     * through FuseIoqWakePending). Returns STATUS_SUCCESS, STATUS_TIMEOUT or STATUS_CANCELLED.
+     * A successful wait does not guarantee that FuseIoqNextPending will return a Context,
+     * because another thread may have picked it up in the meantime.
+     */
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+
+    Result = FsRtlCancellableWaitForSingleObject(&Ioq->PendingEvent, Timeout, CancellableIrp);
+    if (STATUS_THREAD_IS_TERMINATING == Result)
+        Result = STATUS_CANCELLED;
+
+    return Result;
+}
+
+VOID FuseIoqWakePending(FUSE_IOQ *Ioq)
+{
+    PAGED_CODE();
+
+    KeSetEvent(&Ioq->PendingEvent, 1, FALSE);
+}
+
+VOID FuseIoqSetPendingRoutine(FUSE_IOQ *Ioq,
+    FUSE_IOQ_PENDING_ROUTINE *PendingRoutine, PVOID PendingRoutineContext)
+    /*
+     * Set a routine that is called (outside the Ioq mutex) whenever a Context is posted
+     * to the Pending list. This allows a transact implementation that does not wait on
+     * the Ioq (e.g. one that pends IRPs) to learn that there is work to hand out.
+     */
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Ioq->Mutex);
+    Ioq->PendingRoutine = PendingRoutine;
+    Ioq->PendingRoutineContext = PendingRoutineContext;
+    ExReleaseFastMutex(&Ioq->Mutex);
+}
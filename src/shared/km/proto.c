@@ -28,6 +28,8 @@ VOID FuseProtoSendDestroy(FUSE_CONTEXT *Context);
 VOID FuseProtoSendLookup(FUSE_CONTEXT *Context);
 NTSTATUS FuseProtoPostForget(FUSE_INSTANCE *Instance, PLIST_ENTRY ForgetList);
 static VOID FuseProtoPostForget_ContextFini(FUSE_CONTEXT *Context);
+NTSTATUS FuseProtoPostWriteback(FUSE_INSTANCE *Instance, FUSE_FILE *File);
+static VOID FuseProtoPostWriteback_ContextFini(FUSE_CONTEXT *Context);
 VOID FuseProtoFillForget(FUSE_CONTEXT *Context);
 VOID FuseProtoFillBatchForget(FUSE_CONTEXT *Context);
 VOID FuseProtoSendStatfs(FUSE_CONTEXT *Context);
@@ -48,10 +50,14 @@ VOID FuseProtoSendOpen(FUSE_CONTEXT *Context);
 VOID FuseProtoSendReleasedir(FUSE_CONTEXT *Context);
 VOID FuseProtoSendRelease(FUSE_CONTEXT *Context);
 VOID FuseProtoSendReaddir(FUSE_CONTEXT *Context);
+VOID FuseProtoSendReaddirplus(FUSE_CONTEXT *Context);
 VOID FuseProtoSendRead(FUSE_CONTEXT *Context);
 VOID FuseProtoSendWrite(FUSE_CONTEXT *Context);
 VOID FuseProtoSendFsyncdir(FUSE_CONTEXT *Context);
 VOID FuseProtoSendFsync(FUSE_CONTEXT *Context);
+VOID FuseProtoSendFallocate(FUSE_CONTEXT *Context);
+VOID FuseProtoSendLseek(FUSE_CONTEXT *Context);
+VOID FuseProtoSendCopyFileRange(FUSE_CONTEXT *Context);
 VOID FuseAttrToFileInfo(FUSE_INSTANCE *Instance,
     FUSE_PROTO_ATTR *Attr, FSP_FSCTL_FILE_INFO *FileInfo);
 NTSTATUS FuseNtStatusFromErrno(FUSE_INSTANCE_TYPE InstanceType, INT32 Errno);
@@ -64,6 +70,8 @@ NTSTATUS FuseNtStatusFromErrno(FUSE_INSTANCE_TYPE InstanceType, INT32 Errno);
 #pragma alloc_text(PAGE, FuseProtoSendLookup)
 #pragma alloc_text(PAGE, FuseProtoPostForget)
 #pragma alloc_text(PAGE, FuseProtoPostForget_ContextFini)
+#pragma alloc_text(PAGE, FuseProtoPostWriteback)
+#pragma alloc_text(PAGE, FuseProtoPostWriteback_ContextFini)
 #pragma alloc_text(PAGE, FuseProtoFillForget)
 #pragma alloc_text(PAGE, FuseProtoFillBatchForget)
 #pragma alloc_text(PAGE, FuseProtoSendStatfs)
@@ -84,10 +92,14 @@ NTSTATUS FuseNtStatusFromErrno(FUSE_INSTANCE_TYPE InstanceType, INT32 Errno);
 #pragma alloc_text(PAGE, FuseProtoSendReleasedir)
 #pragma alloc_text(PAGE, FuseProtoSendRelease)
 #pragma alloc_text(PAGE, FuseProtoSendReaddir)
+#pragma alloc_text(PAGE, FuseProtoSendReaddirplus)
 #pragma alloc_text(PAGE, FuseProtoSendRead)
 #pragma alloc_text(PAGE, FuseProtoSendWrite)
 #pragma alloc_text(PAGE, FuseProtoSendFsyncdir)
 #pragma alloc_text(PAGE, FuseProtoSendFsync)
+#pragma alloc_text(PAGE, FuseProtoSendFallocate)
+#pragma alloc_text(PAGE, FuseProtoSendLseek)
+#pragma alloc_text(PAGE, FuseProtoSendCopyFileRange)
 #pragma alloc_text(PAGE, FuseAttrToFileInfo)
 #pragma alloc_text(PAGE, FuseNtStatusFromErrno)
 #endif
@@ -119,6 +131,15 @@ NTSTATUS FuseNtStatusFromErrno(FUSE_INSTANCE_TYPE InstanceType, INT32 Errno);
         if (STATUS_INVALID_DEVICE_REQUEST == Context->InternalResponse->IoStatus.Status)\
             FuseInstanceSetOpcodeENOSYS(Context->Instance, FUSE_PROTO_OPCODE_ ## OPCODE);\
     }
+#define FUSE_PROTO_SEND_BEGIN_RELEASE \
+    coro_block(Context->CoroState)      \
+    {                                   \
+        if (Context->File->NoOpen)      \
+        {                               \
+            Context->InternalResponse->IoStatus.Status = STATUS_SUCCESS;\
+            coro_break;                 \
+        }                               \
+        FuseContextWaitRequest(Context);
 
 static inline VOID FuseProtoInitRequest(FUSE_CONTEXT *Context,
     UINT32 len, UINT32 opcode, UINT64 nodeid)
@@ -153,6 +174,8 @@ NTSTATUS FuseProtoPostInit(FUSE_INSTANCE *Instance)
 VOID FuseProtoSendInit(FUSE_CONTEXT *Context)
     /*
      * Send INIT message.
+     *
+     * The INIT message offers the FUSE_PROTO_INIT_FLAGS capabilities.
      */
 {
     PAGED_CODE();
@@ -163,8 +186,8 @@ VOID FuseProtoSendInit(FUSE_CONTEXT *Context)
             FUSE_PROTO_REQ_SIZE(init), FUSE_PROTO_OPCODE_INIT, 0);
         Context->FuseRequest->req.init.major = FUSE_PROTO_VERSION;
         Context->FuseRequest->req.init.minor = FUSE_PROTO_MINOR_VERSION;
-        Context->FuseRequest->req.init.max_readahead = 0;   /* !!!: REVISIT */
-        Context->FuseRequest->req.init.flags = 0;           /* !!!: REVISIT */
+        Context->FuseRequest->req.init.max_readahead = FUSE_PROTO_INIT_MAX_READAHEAD;
+        Context->FuseRequest->req.init.flags = FUSE_PROTO_INIT_FLAGS;
 
     FUSE_PROTO_SEND_END
 }
@@ -262,6 +285,40 @@ static VOID FuseProtoPostForget_ContextFini(FUSE_CONTEXT *Context)
     FuseCacheDeleteForgotten(&Context->Forget.ForgetList);
 }
 
+NTSTATUS FuseProtoPostWriteback(FUSE_INSTANCE *Instance, FUSE_FILE *File)
+    /*
+     * Post a timed writeback of the dirty data of a File that was queued with
+     * FuseFileWritebackExpired. The File is dequeued when the writeback is done.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_CONTEXT *Context;
+
+    FuseContextCreate(&Context, Instance, 0);
+    ASSERT(0 != Context);
+    if (FuseContextIsStatus(Context))
+    {
+        FuseFileWritebackDequeue(Instance, File);
+        return FuseContextToStatus(Context);
+    }
+
+    Context->Fini = FuseProtoPostWriteback_ContextFini;
+    Context->InternalResponse->Hint = FUSE_PROTO_OPCODE_WRITE;
+    Context->File = File;
+
+    FuseIoqPostPending(Instance->Ioq, Context);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FuseProtoPostWriteback_ContextFini(FUSE_CONTEXT *Context)
+{
+    PAGED_CODE();
+
+    FuseFileWritebackDequeue(Context->Instance, Context->File);
+}
+
 VOID FuseProtoFillForget(FUSE_CONTEXT *Context)
     /*
      * Fill FORGET message. This message is used to forget a single inode number.
@@ -729,17 +786,20 @@ VOID FuseProtoSendOpendir(FUSE_CONTEXT *Context)
      *
      * Context->Lookup.Ino
      *     inode number of directory to open
+     *
+     * If the file system answers ENOSYS (NO_OPENDIR_SUPPORT), OPENDIR is not sent again and
+     * the caller proceeds with a zero file handle.
      */
 {
     PAGED_CODE();
 
-    FUSE_PROTO_SEND_BEGIN
+    FUSE_PROTO_SEND_BEGIN_(OPENDIR)
 
         FuseProtoInitRequest(Context,
             FUSE_PROTO_REQ_SIZE(open), FUSE_PROTO_OPCODE_OPENDIR, Context->Lookup.Ino);
         Context->FuseRequest->req.open.flags = Context->File->OpenFlags;
 
-    FUSE_PROTO_SEND_END
+    FUSE_PROTO_SEND_END_(OPENDIR)
 }
 
 VOID FuseProtoSendOpen(FUSE_CONTEXT *Context)
@@ -748,17 +808,20 @@ VOID FuseProtoSendOpen(FUSE_CONTEXT *Context)
      *
      * Context->Lookup.Ino
      *     inode number of file to open
+     *
+     * If the file system answers ENOSYS (NO_OPEN_SUPPORT), OPEN is not sent again and
+     * the caller proceeds with a zero file handle.
      */
 {
     PAGED_CODE();
 
-    FUSE_PROTO_SEND_BEGIN
+    FUSE_PROTO_SEND_BEGIN_(OPEN)
 
         FuseProtoInitRequest(Context,
             FUSE_PROTO_REQ_SIZE(open), FUSE_PROTO_OPCODE_OPEN, Context->Lookup.Ino);
         Context->FuseRequest->req.open.flags = Context->File->OpenFlags;
 
-    FUSE_PROTO_SEND_END
+    FUSE_PROTO_SEND_END_(OPEN)
 }
 
 VOID FuseProtoSendReleasedir(FUSE_CONTEXT *Context)
@@ -771,11 +834,13 @@ VOID FuseProtoSendReleasedir(FUSE_CONTEXT *Context)
      *     handle of related directory
      * Context->File->OpenFlags
      *     open (O_*) flags
+     *
+     * Not sent if the directory was opened without OPENDIR (Context->File->NoOpen).
      */
 {
     PAGED_CODE();
 
-    FUSE_PROTO_SEND_BEGIN
+    FUSE_PROTO_SEND_BEGIN_RELEASE
 
         FuseProtoInitRequest(Context,
             FUSE_PROTO_REQ_SIZE(release), FUSE_PROTO_OPCODE_RELEASEDIR, Context->File->Ino);
@@ -795,11 +860,13 @@ VOID FuseProtoSendRelease(FUSE_CONTEXT *Context)
      *     handle of related file
      * Context->File->OpenFlags
      *     open (O_*) flags
+     *
+     * Not sent if the file was opened without OPEN (Context->File->NoOpen).
      */
 {
     PAGED_CODE();
 
-    FUSE_PROTO_SEND_BEGIN
+    FUSE_PROTO_SEND_BEGIN_RELEASE
 
         FuseProtoInitRequest(Context,
             FUSE_PROTO_REQ_SIZE(release), FUSE_PROTO_OPCODE_RELEASE, Context->File->Ino);
@@ -841,6 +908,36 @@ VOID FuseProtoSendReaddir(FUSE_CONTEXT *Context)
     FUSE_PROTO_SEND_END
 }
 
+VOID FuseProtoSendReaddirplus(FUSE_CONTEXT *Context)
+    /*
+     * Send READDIRPLUS message.
+     *
+     * Context->File->Ino
+     *     inode number of related directory
+     * Context->File->Fh
+     *     handle of related directory
+     * Context->QueryDirectory.NextOffset
+     *     offset of next directory entry or 0
+     * Context->QueryDirectory.Length
+     *     readdirplus buffer length
+     */
+{
+    PAGED_CODE();
+
+    FUSE_PROTO_SEND_BEGIN_(READDIRPLUS)
+
+        FuseProtoInitRequest(Context,
+            FUSE_PROTO_REQ_SIZE(read), FUSE_PROTO_OPCODE_READDIRPLUS, Context->File->Ino);
+        Context->FuseRequest->req.read.fh = Context->File->Fh;
+        Context->FuseRequest->req.read.offset = Context->QueryDirectory.NextOffset;
+        Context->FuseRequest->req.read.size = Context->QueryDirectory.Length;
+        Context->FuseRequest->req.read.read_flags = 0;   /* !!!: REVISIT */
+        Context->FuseRequest->req.read.lock_owner = 0;   /* !!!: REVISIT */
+        Context->FuseRequest->req.read.flags = Context->File->OpenFlags;
+
+    FUSE_PROTO_SEND_END_(READDIRPLUS)
+}
+
 VOID FuseProtoSendRead(FUSE_CONTEXT *Context)
     /*
      * Send READ message.
@@ -853,6 +950,8 @@ VOID FuseProtoSendRead(FUSE_CONTEXT *Context)
      *     offset to read
      * Context->Read.Length
      *     read buffer length
+     * Context->ResponseData.Address, Context->ResponseData.Length
+     *     if not NULL, buffer that receives the read data directly
      */
 {
     PAGED_CODE();
@@ -944,6 +1043,101 @@ VOID FuseProtoSendFsync(FUSE_CONTEXT *Context)
     FUSE_PROTO_SEND_END_(FSYNC)
 }
 
+VOID FuseProtoSendFallocate(FUSE_CONTEXT *Context)
+    /*
+     * Send FALLOCATE message.
+     *
+     * Context->File->Ino
+     *     inode number of related file
+     * Context->File->Fh
+     *     handle of related file
+     * Context->Fallocate.Offset
+     *     offset of range to allocate
+     * Context->Fallocate.Length
+     *     length of range to allocate
+     * Context->Fallocate.Mode
+     *     fallocate (FALLOC_FL_*) mode
+     */
+{
+    PAGED_CODE();
+
+    FUSE_PROTO_SEND_BEGIN_(FALLOCATE)
+
+        FuseProtoInitRequest(Context,
+            FUSE_PROTO_REQ_SIZE(fallocate), FUSE_PROTO_OPCODE_FALLOCATE, Context->File->Ino);
+        Context->FuseRequest->req.fallocate.fh = Context->File->Fh;
+        Context->FuseRequest->req.fallocate.offset = Context->Fallocate.Offset;
+        Context->FuseRequest->req.fallocate.length = Context->Fallocate.Length;
+        Context->FuseRequest->req.fallocate.mode = Context->Fallocate.Mode;
+
+    FUSE_PROTO_SEND_END_(FALLOCATE)
+}
+
+VOID FuseProtoSendLseek(FUSE_CONTEXT *Context)
+    /*
+     * Send LSEEK message.
+     *
+     * Context->File->Ino
+     *     inode number of related file
+     * Context->File->Fh
+     *     handle of related file
+     * Context->Lseek.Offset
+     *     offset to seek from
+     * Context->Lseek.Whence
+     *     SEEK_DATA or SEEK_HOLE
+     */
+{
+    PAGED_CODE();
+
+    FUSE_PROTO_SEND_BEGIN_(LSEEK)
+
+        FuseProtoInitRequest(Context,
+            FUSE_PROTO_REQ_SIZE(lseek), FUSE_PROTO_OPCODE_LSEEK, Context->File->Ino);
+        Context->FuseRequest->req.lseek.fh = Context->File->Fh;
+        Context->FuseRequest->req.lseek.offset = Context->Lseek.Offset;
+        Context->FuseRequest->req.lseek.whence = Context->Lseek.Whence;
+
+    FUSE_PROTO_SEND_END_(LSEEK)
+}
+
+VOID FuseProtoSendCopyFileRange(FUSE_CONTEXT *Context)
+    /*
+     * Send COPY_FILE_RANGE message.
+     *
+     * Context->DeviceControl.SourceFile->Ino
+     *     inode number of source file
+     * Context->DeviceControl.SourceFile->Fh
+     *     handle of source file
+     * Context->DeviceControl.SourceOffset
+     *     source file offset
+     * Context->File->Ino
+     *     inode number of target file
+     * Context->File->Fh
+     *     handle of target file
+     * Context->DeviceControl.TargetOffset
+     *     target file offset
+     * Context->DeviceControl.Length
+     *     copy length
+     */
+{
+    PAGED_CODE();
+
+    FUSE_PROTO_SEND_BEGIN_(COPY_FILE_RANGE)
+
+        FuseProtoInitRequest(Context,
+            FUSE_PROTO_REQ_SIZE(copy_file_range), FUSE_PROTO_OPCODE_COPY_FILE_RANGE,
+            Context->DeviceControl.SourceFile->Ino);
+        Context->FuseRequest->req.copy_file_range.fh_in = Context->DeviceControl.SourceFile->Fh;
+        Context->FuseRequest->req.copy_file_range.off_in = Context->DeviceControl.SourceOffset;
+        Context->FuseRequest->req.copy_file_range.nodeid_out = Context->File->Ino;
+        Context->FuseRequest->req.copy_file_range.fh_out = Context->File->Fh;
+        Context->FuseRequest->req.copy_file_range.off_out = Context->DeviceControl.TargetOffset;
+        Context->FuseRequest->req.copy_file_range.len = Context->DeviceControl.Length;
+        Context->FuseRequest->req.copy_file_range.flags = 0;
+
+    FUSE_PROTO_SEND_END_(COPY_FILE_RANGE)
+}
+
 VOID FuseAttrToFileInfo(FUSE_INSTANCE *Instance,
     FUSE_PROTO_ATTR *Attr, FSP_FSCTL_FILE_INFO *FileInfo)
 {
@@ -978,9 +1172,16 @@ VOID FuseAttrToFileInfo(FUSE_INSTANCE *Instance,
         break;
     }
 
+    /*
+     * The allocation size reflects the space allocated to the file (e.g. space preallocated
+     * past the end of file), but it is never less than the file size (e.g. of a sparse file).
+     */
     FileInfo->FileSize = Attr->size;
+    FileInfo->AllocationSize = Attr->blocks * 512;
+    if (FileInfo->AllocationSize < FileInfo->FileSize)
+        FileInfo->AllocationSize = FileInfo->FileSize;
     FileInfo->AllocationSize =
-        (FileInfo->FileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
+        (FileInfo->AllocationSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
     FuseUnixTimeToFileTime(Attr->atime, Attr->atimensec, &FileInfo->LastAccessTime);
     FuseUnixTimeToFileTime(Attr->mtime, Attr->mtimensec, &FileInfo->LastWriteTime);
     FuseUnixTimeToFileTime(Attr->ctime, Attr->ctimensec, &FileInfo->ChangeTime);
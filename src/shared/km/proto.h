@@ -531,7 +531,13 @@ typedef struct
 } FUSE_PROTO_REQ;
 #define FUSE_PROTO_REQ_HEADER_SIZE      ((ULONG)FIELD_OFFSET(FUSE_PROTO_REQ, req))
 #define FUSE_PROTO_REQ_SIZEMIN          8192 // FUSE_MIN_READ_BUFFER
+#define FUSE_PROTO_DEFAULT_MAX_PAGES     32 // FUSE_DEFAULT_MAX_PAGES_PER_REQ
+#define FUSE_PROTO_MAX_MAX_PAGES        256 // FUSE_MAX_MAX_PAGES
+#define FUSE_PROTO_DEFAULT_MAX_BACKGROUND 12 // FUSE_DEFAULT_MAX_BACKGROUND
+#define FUSE_PROTO_PAGE_SIZE            4096
 #define FUSE_PROTO_REQ_SIZE(F)          RTL_SIZEOF_THROUGH_FIELD(FUSE_PROTO_REQ, req.F)
+#define FUSE_PROTO_REQ_SIZEMAX          \
+    (FUSE_PROTO_REQ_SIZE(write) + FUSE_PROTO_MAX_MAX_PAGES * FUSE_PROTO_PAGE_SIZE)
 
 typedef struct
 {
@@ -718,5 +724,7 @@ typedef struct
 } FUSE_PROTO_RSP;
 #define FUSE_PROTO_RSP_HEADER_SIZE      ((ULONG)FIELD_OFFSET(FUSE_PROTO_RSP, rsp))
 #define FUSE_PROTO_RSP_SIZE(F)          RTL_SIZEOF_THROUGH_FIELD(FUSE_PROTO_RSP, rsp.F)
+#define FUSE_PROTO_RSP_SIZEMAX          \
+    (FUSE_PROTO_RSP_HEADER_SIZE + FUSE_PROTO_MAX_MAX_PAGES * FUSE_PROTO_PAGE_SIZE)
 
 #endif
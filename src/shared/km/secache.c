@@ -0,0 +1,203 @@
+/**
+ * @file shared/km/secache.c
+ *
+ * @copyright 2019-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <shared/km/shared.h>
+
+/*
+ * FUSE security descriptor cache
+ *
+ * The cache maps <uid, gid, mode> triples to self-relative security descriptors as computed
+ * by FspPosixMapPermissionsToSecurityDescriptor. Most files on a volume share a handful of
+ * such triples, so a small direct-mapped table suffices; a colliding triple simply replaces
+ * the previous item.
+ *
+ * Items are reference counted so that a user can copy the security descriptor out of an
+ * item without holding the cache mutex, even if the item is concurrently replaced.
+ */
+
+NTSTATUS FuseSecurityCacheCreate(ULONG Capacity, FUSE_SECURITY_CACHE **PCache);
+VOID FuseSecurityCacheDelete(FUSE_SECURITY_CACHE *Cache);
+NTSTATUS FuseSecurityCacheReferenceItem(FUSE_SECURITY_CACHE *Cache,
+    UINT32 Uid, UINT32 Gid, UINT32 Mode, PVOID *PItem);
+VOID FuseSecurityCacheDereferenceItem(FUSE_SECURITY_CACHE *Cache, PVOID Item);
+PSECURITY_DESCRIPTOR FuseSecurityCacheGetItemSecurityDescriptor(FUSE_SECURITY_CACHE *Cache,
+    PVOID Item, PULONG PLength);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FuseSecurityCacheCreate)
+#pragma alloc_text(PAGE, FuseSecurityCacheDelete)
+#pragma alloc_text(PAGE, FuseSecurityCacheReferenceItem)
+#pragma alloc_text(PAGE, FuseSecurityCacheDereferenceItem)
+#pragma alloc_text(PAGE, FuseSecurityCacheGetItemSecurityDescriptor)
+#endif
+
+typedef struct _FUSE_SECURITY_CACHE_ITEM FUSE_SECURITY_CACHE_ITEM;
+
+struct _FUSE_SECURITY_CACHE
+{
+    FAST_MUTEX Mutex;
+    ULONG ItemBucketCount;
+    FUSE_SECURITY_CACHE_ITEM *ItemBuckets[];
+};
+
+struct _FUSE_SECURITY_CACHE_ITEM
+{
+    LONG RefCount;
+    UINT32 Uid, Gid, Mode;
+    ULONG Length;
+    UINT8 SecurityDescriptor[];
+};
+
+static inline ULONG FuseSecurityCacheHash(UINT32 Uid, UINT32 Gid, UINT32 Mode)
+{
+    return (ULONG)FuseHashMix64(((UINT64)Uid << 32) | Gid) ^ FuseHashMix32(Mode);
+}
+
+static inline VOID FuseSecurityCacheDereferenceItemInternal(FUSE_SECURITY_CACHE_ITEM *Item)
+{
+    if (0 == InterlockedDecrement(&Item->RefCount))
+        FuseFree(Item);
+}
+
+NTSTATUS FuseSecurityCacheCreate(ULONG Capacity, FUSE_SECURITY_CACHE **PCache)
+{
+    PAGED_CODE();
+
+    FUSE_SECURITY_CACHE *Cache;
+    ULONG CacheSize;
+
+    *PCache = 0;
+
+    if (0 == Capacity)
+        Capacity = 64;
+
+    CacheSize = sizeof *Cache + Capacity * sizeof Cache->ItemBuckets[0];
+
+    Cache = FuseAllocNonPaged(CacheSize);
+        /* FAST_MUTEX's must be in non-paged memory */
+    if (0 == Cache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(Cache, CacheSize);
+    ExInitializeFastMutex(&Cache->Mutex);
+    Cache->ItemBucketCount = Capacity;
+
+    *PCache = Cache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FuseSecurityCacheDelete(FUSE_SECURITY_CACHE *Cache)
+{
+    PAGED_CODE();
+
+    for (ULONG Index = 0; Cache->ItemBucketCount > Index; Index++)
+        if (0 != Cache->ItemBuckets[Index])
+            FuseSecurityCacheDereferenceItemInternal(Cache->ItemBuckets[Index]);
+
+    FuseFree(Cache);
+}
+
+NTSTATUS FuseSecurityCacheReferenceItem(FUSE_SECURITY_CACHE *Cache,
+    UINT32 Uid, UINT32 Gid, UINT32 Mode, PVOID *PItem)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+    ULONG HashIndex = FuseSecurityCacheHash(Uid, Gid, Mode) % Cache->ItemBucketCount;
+    FUSE_SECURITY_CACHE_ITEM *Item, *OldItem;
+    PSECURITY_DESCRIPTOR SecurityDescriptor = 0;
+    ULONG Length;
+
+    *PItem = 0;
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    Item = Cache->ItemBuckets[HashIndex];
+    if (0 != Item && Item->Uid == Uid && Item->Gid == Gid && Item->Mode == Mode)
+        InterlockedIncrement(&Item->RefCount);
+    else
+        Item = 0;
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    if (0 != Item)
+    {
+        *PItem = Item;
+        return STATUS_SUCCESS;
+    }
+
+    Result = FspPosixMapPermissionsToSecurityDescriptor(Uid, Gid, Mode, &SecurityDescriptor);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Length = RtlLengthSecurityDescriptor(SecurityDescriptor);
+    Item = FuseAlloc(FIELD_OFFSET(FUSE_SECURITY_CACHE_ITEM, SecurityDescriptor) + Length);
+    if (0 == Item)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    Item->RefCount = 2; /* one for the cache and one for the caller */
+    Item->Uid = Uid;
+    Item->Gid = Gid;
+    Item->Mode = Mode;
+    Item->Length = Length;
+    RtlCopyMemory(Item->SecurityDescriptor, SecurityDescriptor, Length);
+
+    ExAcquireFastMutex(&Cache->Mutex);
+    OldItem = Cache->ItemBuckets[HashIndex];
+    Cache->ItemBuckets[HashIndex] = Item;
+    ExReleaseFastMutex(&Cache->Mutex);
+
+    if (0 != OldItem)
+        FuseSecurityCacheDereferenceItemInternal(OldItem);
+
+    *PItem = Item;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != SecurityDescriptor)
+        FuseFreeExternal(SecurityDescriptor);
+
+    return Result;
+}
+
+VOID FuseSecurityCacheDereferenceItem(FUSE_SECURITY_CACHE *Cache, PVOID Item)
+{
+    PAGED_CODE();
+
+    if (0 == Item)
+        return;
+
+    FuseSecurityCacheDereferenceItemInternal(Item);
+}
+
+PSECURITY_DESCRIPTOR FuseSecurityCacheGetItemSecurityDescriptor(FUSE_SECURITY_CACHE *Cache,
+    PVOID Item0, PULONG PLength)
+{
+    PAGED_CODE();
+
+    FUSE_SECURITY_CACHE_ITEM *Item = Item0;
+
+    *PLength = Item->Length;
+    return Item->SecurityDescriptor;
+}
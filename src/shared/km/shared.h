@@ -30,9 +30,11 @@
 #pragma warning(disable:4127)           /* conditional expression is constant */
 #pragma warning(disable:4200)           /* zero-sized array in struct/union */
 #pragma warning(disable:4201)           /* nameless struct/union */
+#pragma warning(disable:4324)           /* structure padded due to alignment specifier */
 
 #include <shared/km/coro.h>
 #include <shared/km/proto.h>
+#include <shared/ku/winfuse.h>
 
 /* debug */
 #if DBG
@@ -114,31 +116,94 @@ ULONG FuseHashMixPointer(PVOID Pointer)
 /* POSIX paths */
 VOID FusePosixPathPrefix(PSTRING Path, PSTRING Prefix, PSTRING Remain);
 VOID FusePosixPathSuffix(PSTRING Path, PSTRING Remain, PSTRING Suffix);
+typedef struct _FUSE_POSIX_PATH_COMPONENT
+{
+    USHORT Offset, Length;              /* relative to the Buffer of the split path */
+} FUSE_POSIX_PATH_COMPONENT;
+ULONG FusePosixPathComponents(PSTRING Path, FUSE_POSIX_PATH_COMPONENT *Components, ULONG Count);
 
 /* utility */
+typedef struct _FUSE_IOVEC
+{
+    PVOID Buffer;
+    SIZE_T Length;
+} FUSE_IOVEC;
 PVOID FuseAllocatePoolMustSucceed(POOL_TYPE PoolType, SIZE_T Size, ULONG Tag);
 NTSTATUS FuseSafeCopyMemory(PVOID Dst, PVOID Src, ULONG Len);
+NTSTATUS FuseSafeCopyIoVector(PVOID Dst, FUSE_IOVEC *IoVector, ULONG Count, ULONG Len);
 NTSTATUS FuseGetTokenUid(PACCESS_TOKEN Token, TOKEN_INFORMATION_CLASS InfoClass, PUINT32 PUid);
 
 /* read/write locks */
-#define FUSE_RWLOCK_USE_SEMAPHORE
+/*
+ * FUSE_RWLOCK_USE_PERCPU:
+ *     Readers increment a per-CPU counter and proceed, unless a writer is pending; only then
+ *     do they wait on the OrderSem. Writers acquire the OrderSem (which blocks new readers),
+ *     mark themselves pending and wait for the sum of the reader counters to drop to 0.
+ *     A reader may leave on a different CPU than the one it entered on, so individual
+ *     counters may become negative; only their sum is meaningful.
+ * FUSE_RWLOCK_USE_SEMAPHORE:
+ *     Readers and writers are ordered by the OrderSem; the first reader in acquires the
+ *     WriteSem on behalf of all readers and the last reader out releases it.
+ * FUSE_RWLOCK_USE_ERESOURCE:
+ *     Kernel ERESOURCE. Waits are not alertable (see tst/lockdly).
+ *
+ * Compare the variants with tst/rwlock-bench.
+ */
+#define FUSE_RWLOCK_USE_PERCPU
+//#define FUSE_RWLOCK_USE_SEMAPHORE
 //#define FUSE_RWLOCK_USE_ERESOURCE
+#define FUSE_RWLOCK_PERCPU_COUNT        8
 typedef struct _FUSE_RWLOCK
 {
-#if defined(FUSE_RWLOCK_USE_SEMAPHORE)
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+    /*
+     * Each reader count occupies a cache line of its own. (Even if the lock is not cache
+     * aligned in memory, because its pool block is not, no two counts share a cache line.)
+     */
+    struct DECLSPEC_CACHEALIGN
+    {
+        LONG Count;
+    } Readers[FUSE_RWLOCK_PERCPU_COUNT];
+    LONG WriterPending;
+    KSEMAPHORE OrderSem;
+    KEVENT WriterEvent;
+#elif defined(FUSE_RWLOCK_USE_SEMAPHORE)
     KSEMAPHORE OrderSem;
     KSEMAPHORE WriteSem;
     LONG Readers;
 #elif defined(FUSE_RWLOCK_USE_ERESOURCE)
     ERESOURCE Resource;
 #else
-#error One of FUSE_RWLOCK_USE_SEMAPHORE or FUSE_RWLOCK_USE_ERESOURCE must be defined.
+#error One of FUSE_RWLOCK_USE_PERCPU, FUSE_RWLOCK_USE_SEMAPHORE or FUSE_RWLOCK_USE_ERESOURCE must be defined.
 #endif
 } FUSE_RWLOCK;
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+static inline
+LONG FuseRwlockPercpuReaders_(FUSE_RWLOCK *Lock)
+{
+    ULONG Readers = 0;
+    for (ULONG Index = 0; FUSE_RWLOCK_PERCPU_COUNT > Index; Index++)
+        Readers += (ULONG)*(volatile LONG *)&Lock->Readers[Index].Count;
+    return (LONG)Readers;
+}
+static inline
+VOID FuseRwlockPercpuLeaveReader_(FUSE_RWLOCK *Lock, ULONG Index)
+{
+    InterlockedDecrement(&Lock->Readers[Index].Count);
+    if (0 != *(volatile LONG *)&Lock->WriterPending)
+        KeSetEvent(&Lock->WriterEvent, 1, FALSE);
+}
+#endif
 static inline
 VOID FuseRwlockInitialize(FUSE_RWLOCK *Lock)
 {
-#if defined(FUSE_RWLOCK_USE_SEMAPHORE)
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+    for (ULONG Index = 0; FUSE_RWLOCK_PERCPU_COUNT > Index; Index++)
+        Lock->Readers[Index].Count = 0;
+    Lock->WriterPending = 0;
+    KeInitializeSemaphore(&Lock->OrderSem, 1, 1);
+    KeInitializeEvent(&Lock->WriterEvent, SynchronizationEvent, FALSE);
+#elif defined(FUSE_RWLOCK_USE_SEMAPHORE)
     KeInitializeSemaphore(&Lock->OrderSem, 1, 1);
     KeInitializeSemaphore(&Lock->WriteSem, 1, 1);
     Lock->Readers = 0;
@@ -149,7 +214,8 @@ VOID FuseRwlockInitialize(FUSE_RWLOCK *Lock)
 static inline
 VOID FuseRwlockFinalize(FUSE_RWLOCK *Lock)
 {
-#if defined(FUSE_RWLOCK_USE_SEMAPHORE)
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+#elif defined(FUSE_RWLOCK_USE_SEMAPHORE)
 #elif defined(FUSE_RWLOCK_USE_ERESOURCE)
     ExDeleteResourceLite(&Lock->Resource);
 #endif
@@ -157,7 +223,25 @@ VOID FuseRwlockFinalize(FUSE_RWLOCK *Lock)
 static inline
 BOOLEAN FuseRwlockEnterWriter(FUSE_RWLOCK *Lock, PVOID Owner)
 {
-#if defined(FUSE_RWLOCK_USE_SEMAPHORE)
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+    NTSTATUS Result;
+    Result = FsRtlCancellableWaitForSingleObject(&Lock->OrderSem, 0, 0);
+    if (STATUS_SUCCESS == Result)
+    {
+        InterlockedExchange(&Lock->WriterPending, 1);
+        while (0 != FuseRwlockPercpuReaders_(Lock))
+        {
+            Result = FsRtlCancellableWaitForSingleObject(&Lock->WriterEvent, 0, 0);
+            if (STATUS_SUCCESS != Result)
+            {
+                InterlockedExchange(&Lock->WriterPending, 0);
+                KeReleaseSemaphore(&Lock->OrderSem, 1, 1, FALSE);
+                break;
+            }
+        }
+    }
+    return STATUS_SUCCESS == Result;
+#elif defined(FUSE_RWLOCK_USE_SEMAPHORE)
     NTSTATUS Result;
     Result = FsRtlCancellableWaitForSingleObject(&Lock->OrderSem, 0, 0);
     if (STATUS_SUCCESS == Result)
@@ -175,7 +259,22 @@ BOOLEAN FuseRwlockEnterWriter(FUSE_RWLOCK *Lock, PVOID Owner)
 static inline
 BOOLEAN FuseRwlockEnterReader(FUSE_RWLOCK *Lock, PVOID Owner)
 {
-#if defined(FUSE_RWLOCK_USE_SEMAPHORE)
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+    NTSTATUS Result;
+    ULONG Index = KeGetCurrentProcessorNumberEx(0) % FUSE_RWLOCK_PERCPU_COUNT;
+    InterlockedIncrement(&Lock->Readers[Index].Count);
+    if (0 == *(volatile LONG *)&Lock->WriterPending)
+        return TRUE;
+    FuseRwlockPercpuLeaveReader_(Lock, Index);
+    Result = FsRtlCancellableWaitForSingleObject(&Lock->OrderSem, 0, 0);
+    if (STATUS_SUCCESS == Result)
+    {
+        /* no writer can be pending while we hold the OrderSem */
+        InterlockedIncrement(&Lock->Readers[Index].Count);
+        KeReleaseSemaphore(&Lock->OrderSem, 1, 1, FALSE);
+    }
+    return STATUS_SUCCESS == Result;
+#elif defined(FUSE_RWLOCK_USE_SEMAPHORE)
     NTSTATUS Result;
     Result = FsRtlCancellableWaitForSingleObject(&Lock->OrderSem, 0, 0);
     if (STATUS_SUCCESS == Result)
@@ -198,7 +297,10 @@ BOOLEAN FuseRwlockEnterReader(FUSE_RWLOCK *Lock, PVOID Owner)
 static inline
 VOID FuseRwlockLeaveWriter(FUSE_RWLOCK *Lock, PVOID Owner)
 {
-#if defined(FUSE_RWLOCK_USE_SEMAPHORE)
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+    InterlockedExchange(&Lock->WriterPending, 0);
+    KeReleaseSemaphore(&Lock->OrderSem, 1, 1, FALSE);
+#elif defined(FUSE_RWLOCK_USE_SEMAPHORE)
     KeReleaseSemaphore(&Lock->WriteSem, 1, 1, FALSE);
 #elif defined(FUSE_RWLOCK_USE_ERESOURCE)
     ExReleaseResourceForThreadLite(&Lock->Resource, (ERESOURCE_THREAD)((UINT_PTR)Owner | 3));
@@ -207,7 +309,10 @@ VOID FuseRwlockLeaveWriter(FUSE_RWLOCK *Lock, PVOID Owner)
 static inline
 VOID FuseRwlockLeaveReader(FUSE_RWLOCK *Lock, PVOID Owner)
 {
-#if defined(FUSE_RWLOCK_USE_SEMAPHORE)
+#if defined(FUSE_RWLOCK_USE_PERCPU)
+    FuseRwlockPercpuLeaveReader_(Lock,
+        KeGetCurrentProcessorNumberEx(0) % FUSE_RWLOCK_PERCPU_COUNT);
+#elif defined(FUSE_RWLOCK_USE_SEMAPHORE)
     if (0 == InterlockedDecrement(&Lock->Readers))
         KeReleaseSemaphore(&Lock->WriteSem, 1, 1, FALSE);
 #elif defined(FUSE_RWLOCK_USE_ERESOURCE)
@@ -216,25 +321,76 @@ VOID FuseRwlockLeaveReader(FUSE_RWLOCK *Lock, PVOID Owner)
 }
 
 /* FUSE instances */
+typedef struct _FUSE_CONTEXT FUSE_CONTEXT;
 typedef struct _FUSE_IOQ FUSE_IOQ;
 typedef struct _FUSE_CACHE FUSE_CACHE;
+typedef struct _FUSE_SECURITY_CACHE FUSE_SECURITY_CACHE;
 typedef enum _FUSE_INSTANCE_TYPE
 {
     FuseInstanceWindows = 'W',
     FuseInstanceCygwin = 'C',
     FuseInstanceLinux = 'L',
 } FUSE_INSTANCE_TYPE;
+#define FUSE_OPGUARD_DIRLOCK_COUNT      61
+#define FUSE_TOKEN_CACHE_COUNT          32
+#define FUSE_TOKEN_CACHE_TIMEOUT        (1000 * 10000)  /* 1s in 100ns units */
+typedef struct _FUSE_TOKEN_CACHE_ENTRY
+{
+    LUID AuthenticationId;
+    UINT64 ExpirationTime;
+    UINT32 Uid, Gid;
+    BOOLEAN Valid;
+} FUSE_TOKEN_CACHE_ENTRY;
 typedef struct _FUSE_INSTANCE
 {
     FSP_FSCTL_VOLUME_PARAMS *VolumeParams;
     FUSE_INSTANCE_TYPE InstanceType;
+    /*
+     * Operations that change (or depend on) the namespace are serialized by op guards.
+     * Most of them lock the directories they affect: they acquire the OpGuardLock shared
+     * and then the OpGuardDirLocks that the directory paths hash to (in index order).
+     * Operations that affect whole subtrees (e.g. directory renames) acquire the
+     * OpGuardLock exclusive instead.
+     */
     FUSE_RWLOCK OpGuardLock;
+    FUSE_RWLOCK OpGuardDirLocks[FUSE_OPGUARD_DIRLOCK_COUNT];
     FUSE_IOQ *Ioq;
+    /*
+     * At most one transact thread at a time waits for WinFsp requests; the other idle
+     * transact threads wait for Context's to be posted to the Ioq (see FuseInstanceTransact).
+     */
+    LONG ProviderWaiter;
     FUSE_CACHE *Cache;
+    FUSE_SECURITY_CACHE *SecurityCache;
     KSPIN_LOCK FileListLock;
     LIST_ENTRY FileList;
+    /*
+     * The WritebackMutex protects the dirty file slots of the cache items (see FuseFile*).
+     */
+    FAST_MUTEX WritebackMutex;
+    /*
+     * Uid/gid of recently seen access tokens. Tokens are identified by their authentication
+     * id (logon session), which can be queried without allocating memory. The user of a
+     * logon session never changes, but the primary group of a token can; entries therefore
+     * expire after FUSE_TOKEN_CACHE_TIMEOUT. The cache is direct-mapped and a colliding
+     * token simply replaces the previous entry.
+     */
+    FAST_MUTEX TokenCacheMutex;
+    FUSE_TOKEN_CACHE_ENTRY TokenCache[FUSE_TOKEN_CACHE_COUNT];
     KEVENT InitEvent;
     UINT32 VersionMajor, VersionMinor;
+    /*
+     * Capabilities negotiated during INIT. InitFlags contains the FUSE_PROTO_INIT_* flags
+     * that were both offered by us and accepted by the user mode file system. MaxRead and
+     * MaxWrite are the maximum data sizes of a single READ or WRITE request. MaxBackground
+     * is the maximum number of requests that a single operation may have outstanding (for
+     * example when a large READ is split into chunks).
+     */
+    UINT32 InitFlags;
+    UINT32 MaxReadahead;
+    UINT32 MaxPages;
+    UINT32 MaxRead, MaxWrite;
+    UINT32 MaxBackground;
     VOID (*ProtoSendDestroyHandler)(PVOID); PVOID ProtoSendDestroyData;
     /*
      * The following bitmap is used to remember which opcodes have returned ENOSYS.
@@ -254,9 +410,12 @@ NTSTATUS FuseInstanceInit(FUSE_INSTANCE *Instance,
     FUSE_INSTANCE_TYPE InstanceType);
 VOID FuseInstanceFini(FUSE_INSTANCE *Instance);
 VOID FuseInstanceExpirationRoutine(FUSE_INSTANCE *Instance, UINT64 ExpirationTime);
+NTSTATUS FuseInstanceGetTokenUidGid(FUSE_INSTANCE *Instance,
+    PACCESS_TOKEN Token, PUINT32 PUid, PUINT32 PGid);
 NTSTATUS FuseInstanceTransact(FUSE_INSTANCE *Instance,
     FUSE_PROTO_RSP *FuseResponse, ULONG InputBufferLength,
-    FUSE_PROTO_REQ *FuseRequest, PULONG POutputBufferLength,
+    FUSE_IOVEC *FuseResponseData, ULONG FuseResponseDataCount,
+    FUSE_PROTO_REQ *FuseRequest, PULONG POutputBufferLength, BOOLEAN Wait,
     PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
     PIRP CancellableIrp);
 static inline
@@ -278,20 +437,97 @@ VOID FuseInstanceSetOpcodeENOSYS(FUSE_INSTANCE *Instance, UINT32 Opcode)
 typedef struct _FUSE_FILE
 {
     LIST_ENTRY ListEntry;
+    LONG RefCount;
     UINT64 Ino;
     UINT64 Fh;
     UINT32 OpenFlags;
     UINT32 IsDirectory:1;
     UINT32 IsReparsePoint:1;
+    UINT32 NoOpen:1;                    /* opened without OPEN/OPENDIR: no RELEASE */
+    BOOLEAN Preallocated;               /* space preallocated past end of file: trim on CLEANUP */
     PVOID CacheItem;
+    /*
+     * The Mutex protects the cached attributes, the read-ahead state and the dirty data
+     * below. The first two are valid only while the data version of the CacheItem is
+     * unchanged.
+     *
+     * Attr are the last known attributes of the file (and therefore its authoritative size);
+     * they are valid until AttrExpirationTime (0 if unknown).
+     *
+     * ReadAheadNextOffset is the offset where a sequential read is expected to start
+     * ((UINT64)-1 if none). ReadAheadBuffer contains ReadAheadLength bytes of file data at
+     * ReadAheadOffset. ReadAheadPending is set while a read-ahead READ is outstanding;
+     * ReleaseDeferred is set if the file was closed meanwhile.
+     *
+     * DirtyBuffer contains DirtyLength bytes of data written at DirtyOffset that have not
+     * been written back to the user mode file system yet (FUSE_PROTO_INIT_WRITEBACK_CACHE);
+     * they were first dirtied at DirtyTime (0 if none). WritebackPending is set while they
+     * are being written back; Context's that must wait for this are on WritebackWaitList.
+     * WritebackQueued is set (under the Instance FileListLock) while a timed writeback of
+     * the dirty data is queued.
+     */
+    FAST_MUTEX Mutex;
+    FUSE_PROTO_ATTR Attr;
+    UINT64 AttrExpirationTime;
+    UINT32 AttrDataVersion;
+    UINT64 ReadAheadNextOffset;
+    UINT64 ReadAheadOffset;
+    PUINT8 ReadAheadBuffer;
+    UINT32 ReadAheadLength;
+    UINT32 ReadAheadDataVersion;
+    BOOLEAN ReadAheadPending;
+    BOOLEAN ReleaseDeferred;
+    UINT64 DirtyOffset;
+    PUINT8 DirtyBuffer;
+    UINT32 DirtyLength;
+    UINT64 DirtyTime;
+    BOOLEAN WritebackPending;
+    BOOLEAN WritebackQueued;
+    LIST_ENTRY WritebackWaitList;
+    /*
+     * A file that was opened as the source of a server-side copy (FUSE_IOCTL_COPY_SOURCE)
+     * has a non-0 CopyToken until it is taken by the copy or until CopyExpirationTime.
+     */
+    UINT64 CopyToken;
+    UINT64 CopyExpirationTime;
 } FUSE_FILE;
+#define FUSE_FILE_WRITEBACK_TIMEOUT     (1000 * 10000)  /* 1s in 100ns units */
+#define FUSE_FILE_COPY_SOURCE_TIMEOUT   (60 * 1000 * 10000)  /* 60s in 100ns units */
 VOID FuseFileInstanceInit(FUSE_INSTANCE *Instance);
 VOID FuseFileInstanceFini(FUSE_INSTANCE *Instance);
 NTSTATUS FuseFileCreate(FUSE_INSTANCE *Instance, FUSE_FILE **PFile);
-VOID FuseFileDelete(FUSE_INSTANCE *Instance, FUSE_FILE *File);
+VOID FuseFileReference(FUSE_FILE *File);
+VOID FuseFileDereference(FUSE_INSTANCE *Instance, FUSE_FILE *File);
+BOOLEAN FuseFileGetAttr(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_PROTO_ATTR *Attr, PUINT64 PExpirationTime);
+VOID FuseFileSetAttr(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_PROTO_ATTR *Attr, UINT64 ExpirationTime);
+NTSTATUS FuseFileReadAheadGet(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PVOID Buffer, UINT32 Length,
+    PUINT32 PBytesTransferred, PBOOLEAN PSequential);
+BOOLEAN FuseFileReadAheadSet(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 NextOffset, BOOLEAN Sequential, PUINT32 PDataVersion);
+BOOLEAN FuseFileReadAheadComplete(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PUINT8 Buffer, UINT32 Length, UINT32 DataVersion);
+BOOLEAN FuseFileReleaseDefer(FUSE_INSTANCE *Instance, FUSE_FILE *File);
+NTSTATUS FuseFileWritebackWrite(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PVOID Buffer, UINT32 Length, PBOOLEAN PAbsorbed);
+NTSTATUS FuseFileWritebackRead(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    UINT64 Offset, PVOID Buffer, UINT32 Length, PUINT32 PBytesTransferred);
+VOID FuseFileWritebackAttr(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_PROTO_ATTR *Attr);
+BOOLEAN FuseFileWritebackTake(FUSE_INSTANCE *Instance, FUSE_FILE *File,
+    FUSE_FILE **PDirtyFile, PUINT8 *PBuffer, PUINT64 POffset, PUINT32 PLength);
+VOID FuseFileWritebackComplete(FUSE_INSTANCE *Instance, FUSE_FILE *DirtyFile,
+    NTSTATUS Status);
+BOOLEAN FuseFileWritebackWait(FUSE_INSTANCE *Instance, FUSE_FILE *DirtyFile,
+    FUSE_CONTEXT *Context);
+FUSE_FILE *FuseFileWritebackExpired(FUSE_INSTANCE *Instance, UINT64 ExpirationTime);
+VOID FuseFileWritebackDequeue(FUSE_INSTANCE *Instance, FUSE_FILE *File);
+NTSTATUS FuseFileCopySourceSet(FUSE_INSTANCE *Instance, FUSE_FILE *File, PUINT64 PCopyToken);
+FUSE_FILE *FuseFileCopySourceTake(FUSE_INSTANCE *Instance, UINT64 CopyToken);
 
 /* FUSE processing context */
-typedef struct _FUSE_CONTEXT FUSE_CONTEXT;
 typedef VOID FUSE_CONTEXT_FINI(FUSE_CONTEXT *Context);
 typedef BOOLEAN FUSE_OPERATION_PROC(FUSE_CONTEXT *Context);
 typedef INT FUSE_OPERATION_GUARD(FUSE_CONTEXT *Context, BOOLEAN Acquire);
@@ -306,6 +542,11 @@ typedef struct _FUSE_OPERATION
     FUSE_OPERATION_PROC *Proc;
     FUSE_OPERATION_GUARD *Guard;
 } FUSE_OPERATION;
+typedef struct _FUSE_CACHE_ACCESS
+{
+    UINT32 Uid, Gid;                    /* caller that the access Mask was computed for */
+    UINT32 Mask;                        /* 0 if none */
+} FUSE_CACHE_ACCESS;
 typedef struct _FUSE_CONTEXT_LOOKUP
 {
     PVOID CacheGen;
@@ -313,16 +554,49 @@ typedef struct _FUSE_CONTEXT_LOOKUP
     UINT64 Ino;
     STRING Name;
     FUSE_PROTO_ATTR Attr;
+    FUSE_CACHE_ACCESS Access;           /* access mask memoized with the entry */
+    BOOLEAN Cached;                     /* entry was found in the cache (see FuseLookup) */
 } FUSE_CONTEXT_LOOKUP;
 typedef struct _FUSE_CONTEXT_FORGET
 {
     LIST_ENTRY ForgetList;
 } FUSE_CONTEXT_FORGET;
+typedef struct _FUSE_CONTEXT_LOOKUP_RESULT
+{
+    NTSTATUS Status;
+    FUSE_PROTO_ATTR Attr;
+} FUSE_CONTEXT_LOOKUP_RESULT;
+typedef struct _FUSE_CONTEXT_READWRITE
+{
+    FUSE_PROTO_ATTR Attr;
+    UINT64 StartOffset;
+    UINT32 Remain;
+    UINT32 Offset;
+    UINT32 Length;
+} FUSE_CONTEXT_READWRITE;
+typedef struct _FUSE_CONTEXT_READWRITE_RESULT
+{
+    NTSTATUS Status;
+    UINT32 Length;
+    UINT32 BytesTransferred;
+} FUSE_CONTEXT_READWRITE_RESULT;
 typedef struct _FUSE_CONTEXT_SETATTR
 {
     FUSE_PROTO_ATTR Attr;
     UINT32 AttrValid;
 } FUSE_CONTEXT_SETATTR;
+/*
+ * POSIX paths of a Context are converted into a PathArena when they fit (see
+ * FuseContextMapPosixPath). Only the Context's that map paths (LookupPath, QueryDirectory)
+ * carry a PathArena, so it overlays the fields of other Context's.
+ */
+#define FUSE_CONTEXT_PATH_ARENA_SIZE    256
+typedef struct _FUSE_CONTEXT_PATH_ARENA
+{
+    ULONG Length;
+    CHAR Buffer[FUSE_CONTEXT_PATH_ARENA_SIZE];
+} FUSE_CONTEXT_PATH_ARENA;
+#define FUSE_CONTEXT_LOOKUPPATH_COMPONENT_COUNT 32
 struct _FUSE_CONTEXT
 {
     FUSE_CONTEXT *DictNext;
@@ -342,9 +616,47 @@ struct _FUSE_CONTEXT
     SHORT CoroState[16];
     UINT32 OrigUid, OrigGid, OrigPid;
     FUSE_FILE *File;
+    /*
+     * A Context may spawn child Context's in order to have multiple FUSE requests outstanding
+     * on its behalf. Children are accumulated in the ChildList and are posted for processing
+     * when the parent Context waits for them (FuseContextWaitChildren). The last child to
+     * complete posts the parent for processing again.
+     */
+    FUSE_CONTEXT *Parent;
+    LIST_ENTRY ChildList;
+    LONG ChildCount;
+    /*
+     * A Context that expects a response with data (READ) may set ResponseData.Address to
+     * have FuseInstanceTransact copy the data of the response directly to their destination
+     * (usually a user mode buffer), rather than copying them out of the FuseResponse itself.
+     * The Address is reset when the response arrives and the Status reports the copy.
+     */
+    struct
+    {
+        PUINT8 Address;
+        UINT32 Length;
+        NTSTATUS Status;
+    } ResponseData;
+    /*
+     * Dirty data that are being written back on behalf of the Context (see FuseWriteback).
+     * Wait is set when the Context yields to wait for the writeback of the dirty data of
+     * File by another Context.
+     */
+    struct
+    {
+        FUSE_FILE *File;
+        PUINT8 Buffer;
+        FUSE_CONTEXT_READWRITE_RESULT Result;
+        BOOLEAN Wait;
+    } Writeback;
     union
     {
         FUSE_CONTEXT_LOOKUP Lookup;
+        struct
+        {
+            FUSE_CONTEXT_LOOKUP;
+            FUSE_CONTEXT_LOOKUP_RESULT *Result;
+        } LookupChild;
         FUSE_CONTEXT_FORGET Forget;
         struct
         {
@@ -358,40 +670,94 @@ struct _FUSE_CONTEXT
             UINT32 Chown:1;
             UINT32 RenameIsNonExistent:1;
             UINT32 RenameIsDirectory:1;
+            /* path components split up front by FuseLookupPath (relative to ComponentBase) */
+            PSTR ComponentBase;
+            FUSE_POSIX_PATH_COMPONENT Components[FUSE_CONTEXT_LOOKUPPATH_COMPONENT_COUNT];
+            ULONG ComponentCount, ComponentIndex;
             /* 2 path operations (rename) */
             STRING OrigPath2;
             STRING Name2;
             UINT64 Ino2;
+            FUSE_CONTEXT_PATH_ARENA PathArena;
         } LookupPath;
         FUSE_CONTEXT_SETATTR Setattr;
         struct
         {
-            FUSE_PROTO_ATTR Attr;
-            UINT64 StartOffset;
-            UINT32 Remain;
-            UINT32 Offset;
-            UINT32 Length;
-        } Read, Write;
+            FUSE_CONTEXT_READWRITE;
+            ULONG ChunkCount;
+            FUSE_CONTEXT_READWRITE_RESULT *Results;
+            BOOLEAN Sequential;
+        } Read;
+        struct
+        {
+            FUSE_CONTEXT_READWRITE;
+            ULONG ChunkCount;
+            FUSE_CONTEXT_READWRITE_RESULT *Results;
+            UINT64 AttrExpirationTime;
+        } Write;
+        struct
+        {
+            FUSE_CONTEXT_READWRITE;
+            PUINT8 Address;
+            FUSE_CONTEXT_READWRITE_RESULT *Result;
+        } ReadChild, WriteChild;
+        struct
+        {
+            FUSE_CONTEXT_READWRITE;
+            PUINT8 Buffer;
+            UINT32 DataVersion;
+        } ReadAhead;
         struct
         {
             FUSE_CONTEXT_LOOKUP;
             STRING OrigName;
             UINT64 NextOffset;
             UINT32 Length;
+            UINT32 ReaddirPlus:1;
             ULONG BytesTransferred;
             PUINT8 Buffer, BufferEndP, BufferP;
+            PUINT8 LookupEndP;
+            ULONG LookupIndex;
+            FUSE_CONTEXT_LOOKUP_RESULT *LookupResults;
+            FUSE_CONTEXT_PATH_ARENA PathArena;
         } QueryDirectory;
         struct
         {
             FUSE_CONTEXT_SETATTR;
             PSECURITY_DESCRIPTOR SecurityDescriptor;
         } Security;
+        struct
+        {
+            FUSE_CONTEXT_LOOKUP;
+            FUSE_FILE *SourceFile;
+            UINT64 SourceOffset, TargetOffset, Remain;
+            UINT32 Length;
+            UINT64 BytesCopied;
+            NTSTATUS Status;
+        } DeviceControl;
+        struct
+        {
+            UINT64 Offset;
+            UINT64 Length;
+            UINT32 Mode;
+        } Fallocate;
+        struct
+        {
+            UINT64 Offset;
+            UINT32 Whence;
+        } Lseek;
     };
 };
 extern FUSE_OPERATION FuseOperations[];
 VOID FuseContextCreate(FUSE_CONTEXT **PContext,
     FUSE_INSTANCE *Instance, FSP_FSCTL_TRANSACT_REQ *InternalRequest);
 VOID FuseContextDelete(FUSE_CONTEXT *Context);
+NTSTATUS FuseContextMapPosixPath(FUSE_CONTEXT_PATH_ARENA *PathArena,
+    PWSTR WindowsPath, PSTR *PPosixPath);
+VOID FuseContextDeletePosixPath(FUSE_CONTEXT_PATH_ARENA *PathArena, PSTR PosixPath);
+VOID FuseContextCreateChild(FUSE_CONTEXT **PContext,
+    FUSE_CONTEXT *Parent, UINT32 Hint);
+BOOLEAN FuseContextPostChildren(FUSE_CONTEXT *Context);
 static inline BOOLEAN FuseContextProcess(FUSE_CONTEXT *Context,
     FUSE_PROTO_RSP *FuseResponse, FUSE_PROTO_REQ *FuseRequest, ULONG FuseRequestLength)
 {
@@ -466,8 +832,10 @@ INT FuseOpGuardReleaseShared(FUSE_CONTEXT *Context)
 #define FuseContextToStatus(C)          ((NTSTATUS)(0xC0000000 | (UINT32)(UINT_PTR)(C)))
 #define FuseContextWaitRequest(C)       do { while (0 == (C)->FuseRequest) coro_yield; } while (0,0)
 #define FuseContextWaitResponse(C)      do { coro_yield; } while (0 == (C)->FuseResponse)
+#define FuseContextWaitChildren(C)      do { if (!IsListEmpty(&(C)->ChildList)) coro_yield; } while (0,0)
 
 /* FUSE I/O queue */
+typedef VOID FUSE_IOQ_PENDING_ROUTINE(PVOID PendingRoutineContext);
 NTSTATUS FuseIoqCreate(FUSE_IOQ **PIoq);
 VOID FuseIoqDelete(FUSE_IOQ *Ioq);
 VOID FuseIoqStartProcessing(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
@@ -475,6 +843,10 @@ FUSE_CONTEXT *FuseIoqEndProcessing(FUSE_IOQ *Ioq, UINT64 Unique);
 VOID FuseIoqPostPending(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 VOID FuseIoqPostPendingAndStop(FUSE_IOQ *Ioq, FUSE_CONTEXT *Context);
 FUSE_CONTEXT *FuseIoqNextPending(FUSE_IOQ *Ioq); /* does not block! */
+NTSTATUS FuseIoqWaitPending(FUSE_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp);
+VOID FuseIoqWakePending(FUSE_IOQ *Ioq);
+VOID FuseIoqSetPendingRoutine(FUSE_IOQ *Ioq,
+    FUSE_IOQ_PENDING_ROUTINE *PendingRoutine, PVOID PendingRoutineContext);
 
 /* FUSE "entry" cache */
 typedef struct _FUSE_CACHE_GEN FUSE_CACHE_GEN;
@@ -485,23 +857,55 @@ VOID FuseCacheExpirationRoutine(FUSE_CACHE *Cache,
 NTSTATUS FuseCacheReferenceGen(FUSE_CACHE *Cache, PVOID *PGen);
 VOID FuseCacheDereferenceGen(FUSE_CACHE *Cache, PVOID Gen);
 BOOLEAN FuseCacheGetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
-    FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
+    FUSE_PROTO_ENTRY *Entry, FUSE_CACHE_ACCESS *Access, PVOID *PItem);
 VOID FuseCacheSetEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
     FUSE_PROTO_ENTRY *Entry, PVOID *PItem);
 VOID FuseCacheRemoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name);
+VOID FuseCacheMoveEntry(FUSE_CACHE *Cache, UINT64 ParentIno, PSTRING Name,
+    UINT64 NewParentIno, PSTRING NewName);
 VOID FuseCacheReferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheDereferenceItem(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheQuickExpireItem(FUSE_CACHE *Cache, PVOID Item);
+UINT32 FuseCacheGetItemDataVersion(FUSE_CACHE *Cache, PVOID Item);
+BOOLEAN FuseCacheGetItemAttr(FUSE_CACHE *Cache, PVOID Item, FUSE_PROTO_ATTR *Attr);
+VOID FuseCacheSetItemAccess(FUSE_CACHE *Cache, PVOID Item,
+    FUSE_PROTO_ATTR *Attr, FUSE_CACHE_ACCESS *Access);
+PVOID FuseCacheGetItemDirtyFile(FUSE_CACHE *Cache, PVOID Item);
+PVOID FuseCacheCompareExchangeItemDirtyFile(FUSE_CACHE *Cache, PVOID Item,
+    PVOID Exchange, PVOID Comparand);
+VOID FuseCacheSetItemWritebackStatus(FUSE_CACHE *Cache, PVOID Item, NTSTATUS Status);
+NTSTATUS FuseCacheTakeItemWritebackStatus(FUSE_CACHE *Cache, PVOID Item);
 VOID FuseCacheDeleteForgotten(PLIST_ENTRY ForgetList);
 BOOLEAN FuseCacheForgetOne(PLIST_ENTRY ForgetList, FUSE_PROTO_FORGET_ONE *PForgetOne);
 
+/* FUSE security descriptor cache */
+NTSTATUS FuseSecurityCacheCreate(ULONG Capacity, FUSE_SECURITY_CACHE **PCache);
+VOID FuseSecurityCacheDelete(FUSE_SECURITY_CACHE *Cache);
+NTSTATUS FuseSecurityCacheReferenceItem(FUSE_SECURITY_CACHE *Cache,
+    UINT32 Uid, UINT32 Gid, UINT32 Mode, PVOID *PItem);
+VOID FuseSecurityCacheDereferenceItem(FUSE_SECURITY_CACHE *Cache, PVOID Item);
+PSECURITY_DESCRIPTOR FuseSecurityCacheGetItemSecurityDescriptor(FUSE_SECURITY_CACHE *Cache,
+    PVOID Item, PULONG PLength);
+
 /* protocol implementation */
+#define FUSE_PROTO_INIT_FLAGS           (\
+    FUSE_PROTO_INIT_ASYNC_READ |\
+    FUSE_PROTO_INIT_BIG_WRITES |\
+    FUSE_PROTO_INIT_DO_READDIRPLUS |\
+    FUSE_PROTO_INIT_READDIRPLUS_AUTO |\
+    FUSE_PROTO_INIT_WRITEBACK_CACHE |\
+    FUSE_PROTO_INIT_PARALLEL_DIROPS |\
+    FUSE_PROTO_INIT_MAX_PAGES |\
+    FUSE_PROTO_INIT_NO_OPEN_SUPPORT |\
+    FUSE_PROTO_INIT_NO_OPENDIR_SUPPORT)
+#define FUSE_PROTO_INIT_MAX_READAHEAD   (FUSE_PROTO_MAX_MAX_PAGES * FUSE_PROTO_PAGE_SIZE)
 NTSTATUS FuseProtoPostInit(FUSE_INSTANCE *Instance);
 VOID FuseProtoSendInit(FUSE_CONTEXT *Context);
 NTSTATUS FuseProtoPostDestroy(FUSE_INSTANCE *Instance);
 VOID FuseProtoSendDestroy(FUSE_CONTEXT *Context);
 VOID FuseProtoSendLookup(FUSE_CONTEXT *Context);
 NTSTATUS FuseProtoPostForget(FUSE_INSTANCE *Instance, PLIST_ENTRY ForgetList);
+NTSTATUS FuseProtoPostWriteback(FUSE_INSTANCE *Instance, FUSE_FILE *File);
 VOID FuseProtoFillForget(FUSE_CONTEXT *Context);
 VOID FuseProtoFillBatchForget(FUSE_CONTEXT *Context);
 VOID FuseProtoSendStatfs(FUSE_CONTEXT *Context);
@@ -522,10 +926,14 @@ VOID FuseProtoSendOpen(FUSE_CONTEXT *Context);
 VOID FuseProtoSendReleasedir(FUSE_CONTEXT *Context);
 VOID FuseProtoSendRelease(FUSE_CONTEXT *Context);
 VOID FuseProtoSendReaddir(FUSE_CONTEXT *Context);
+VOID FuseProtoSendReaddirplus(FUSE_CONTEXT *Context);
 VOID FuseProtoSendRead(FUSE_CONTEXT *Context);
 VOID FuseProtoSendWrite(FUSE_CONTEXT *Context);
 VOID FuseProtoSendFsyncdir(FUSE_CONTEXT *Context);
 VOID FuseProtoSendFsync(FUSE_CONTEXT *Context);
+VOID FuseProtoSendFallocate(FUSE_CONTEXT *Context);
+VOID FuseProtoSendLseek(FUSE_CONTEXT *Context);
+VOID FuseProtoSendCopyFileRange(FUSE_CONTEXT *Context);
 VOID FuseAttrToFileInfo(FUSE_INSTANCE *Instance,
     FUSE_PROTO_ATTR *Attr, FSP_FSCTL_FILE_INFO *FileInfo);
 static inline
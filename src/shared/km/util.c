@@ -23,11 +23,13 @@
 
 PVOID FuseAllocatePoolMustSucceed(POOL_TYPE PoolType, SIZE_T Size, ULONG Tag);
 NTSTATUS FuseSafeCopyMemory(PVOID Dst, PVOID Src, ULONG Len);
+NTSTATUS FuseSafeCopyIoVector(PVOID Dst, FUSE_IOVEC *IoVector, ULONG Count, ULONG Len);
 NTSTATUS FuseGetTokenUid(PACCESS_TOKEN Token, TOKEN_INFORMATION_CLASS InfoClass, PUINT32 PUid);
 
 #ifdef ALLOC_PRAGMA
 // !#pragma alloc_text(PAGE, FuseAllocatePoolMustSucceed)
 #pragma alloc_text(PAGE, FuseSafeCopyMemory)
+#pragma alloc_text(PAGE, FuseSafeCopyIoVector)
 #pragma alloc_text(PAGE, FuseGetTokenUid)
 #endif
 
@@ -76,6 +78,36 @@ NTSTATUS FuseSafeCopyMemory(PVOID Dst, PVOID Src, ULONG Len)
     }
 }
 
+NTSTATUS FuseSafeCopyIoVector(PVOID Dst, FUSE_IOVEC *IoVector, ULONG Count, ULONG Len)
+    /*
+     * Gather Len bytes from the concatenation of the IoVector buffers (which may be user mode
+     * buffers) into Dst.
+     */
+{
+    PAGED_CODE();
+
+    PUINT8 P = Dst, EndP = P + Len;
+    ULONG L;
+
+    try
+    {
+        for (ULONG I = 0; Count > I && EndP > P; I++)
+        {
+            L = (ULONG)(EndP - P);
+            if (L > IoVector[I].Length)
+                L = (ULONG)IoVector[I].Length;
+            RtlCopyMemory(P, IoVector[I].Buffer, L);
+            P += L;
+        }
+        return EndP == P ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        NTSTATUS Result = GetExceptionCode();
+        return FsRtlIsNtstatusExpected(Result) ? STATUS_INVALID_USER_BUFFER : Result;
+    }
+}
+
 NTSTATUS FuseGetTokenUid(PACCESS_TOKEN Token, TOKEN_INFORMATION_CLASS InfoClass, PUINT32 PUid)
 {
     PAGED_CODE();
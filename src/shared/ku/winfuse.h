@@ -0,0 +1,74 @@
+/**
+ * @file shared/ku/winfuse.h
+ *
+ * @copyright 2019-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFuse.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * Affero General Public License version 3 as published by the Free
+ * Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the AGPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef SHARED_KU_WINFUSE_H_INCLUDED
+#define SHARED_KU_WINFUSE_H_INCLUDED
+
+/*
+ * Device controls that are sent on files of a WinFuse volume (DeviceIoControl).
+ *
+ * Server-side copy (FUSE COPY_FILE_RANGE) is requested by a pair of device controls
+ * (WinFsp forwards IRP_MJ_DEVICE_CONTROL but not arbitrary FSCTL's to the file system).
+ * FUSE_IOCTL_COPY_SOURCE is sent on the source file and returns a single-use token that
+ * designates it. FUSE_IOCTL_COPY_FILE_RANGE is sent on the target file with the token and
+ * returns the number of bytes copied and the new size of the target file. The token is
+ * random and expires if it is not used within a minute.
+ * STATUS_INVALID_DEVICE_REQUEST means that the copy cannot be offloaded and should be
+ * done by reading and writing instead.
+ *
+ * FUSE_IOCTL_SEEK finds the next data or hole of a sparse file (FUSE LSEEK with SEEK_DATA
+ * or SEEK_HOLE), so that readers can skip holes rather than read zeroes.
+ */
+#define FUSE_IOCTL_COPY_SOURCE          \
+    CTL_CODE(0x8000 + 'F', 'c', METHOD_BUFFERED, FILE_READ_ACCESS)
+#define FUSE_IOCTL_COPY_FILE_RANGE      \
+    CTL_CODE(0x8000 + 'F', 'C', METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define FUSE_IOCTL_SEEK                 \
+    CTL_CODE(0x8000 + 'F', 's', METHOD_BUFFERED, FILE_READ_ACCESS)
+#define FUSE_IOCTL_SEEK_DATA            3   /* SEEK_DATA */
+#define FUSE_IOCTL_SEEK_HOLE            4   /* SEEK_HOLE */
+typedef struct _FUSE_IOCTL_COPY_SOURCE_OUTPUT
+{
+    UINT64 Token;
+} FUSE_IOCTL_COPY_SOURCE_OUTPUT;
+typedef struct _FUSE_IOCTL_COPY_FILE_RANGE_INPUT
+{
+    UINT64 Token;
+    UINT64 SourceOffset;
+    UINT64 TargetOffset;
+    UINT64 Length;
+} FUSE_IOCTL_COPY_FILE_RANGE_INPUT;
+typedef struct _FUSE_IOCTL_COPY_FILE_RANGE_OUTPUT
+{
+    UINT64 BytesCopied;
+    UINT64 FileSize;                    /* target file size after the copy */
+} FUSE_IOCTL_COPY_FILE_RANGE_OUTPUT;
+typedef struct _FUSE_IOCTL_SEEK_INPUT
+{
+    UINT64 Offset;
+    UINT32 Whence;
+} FUSE_IOCTL_SEEK_INPUT;
+typedef struct _FUSE_IOCTL_SEEK_OUTPUT
+{
+    UINT64 Offset;
+} FUSE_IOCTL_SEEK_OUTPUT;
+
+#endif
@@ -25,14 +25,75 @@ static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PAR
 static VOID FuseDeviceFini(PDEVICE_OBJECT DeviceObject);
 static VOID FuseDeviceExpirationRoutine(PDEVICE_OBJECT DeviceObject, UINT64 ExpirationTime);
 static NTSTATUS FuseDeviceTransact(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+static NTSTATUS FuseDeviceTransactOutDirect(PDEVICE_OBJECT DeviceObject, PIRP Irp,
+    BOOLEAN Wait);
+static NTSTATUS FuseDeviceTransactDirect(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+static NTSTATUS FuseDeviceInitAsync(PDEVICE_OBJECT DeviceObject,
+    FSP_FSCTL_VOLUME_PARAMS *VolumeParams);
+static VOID FuseDeviceFiniAsync(PDEVICE_OBJECT DeviceObject);
+static NTSTATUS FuseDeviceTransactAsync(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+static NTSTATUS FuseDeviceAsyncTransact(FUSE_DEVICE_ASYNC *Async, PIRP Irp, BOOLEAN Wait);
+static VOID FuseDeviceAsyncDrain(FUSE_DEVICE_ASYNC *Async);
+static VOID FuseDeviceAsyncNotify(PVOID Async0);
+static VOID FuseDeviceAsyncDrainWorkItem(PDEVICE_OBJECT DeviceObject, PVOID Async0);
+static VOID FuseDeviceAsyncPump(PVOID Async0);
+static VOID FuseDeviceAsyncServe(FUSE_DEVICE_ASYNC *Async, PIRP Irp);
+static VOID FuseDeviceAsyncDereference(FUSE_DEVICE_ASYNC *Async);
+static VOID FuseDeviceAsyncInsertIrp(PIO_CSQ IoCsq, PIRP Irp);
+static VOID FuseDeviceAsyncRemoveIrp(PIO_CSQ IoCsq, PIRP Irp);
+static PIRP FuseDeviceAsyncPeekNextIrp(PIO_CSQ IoCsq, PIRP Irp, PVOID PeekContext);
+static VOID FuseDeviceAsyncAcquireLock(PIO_CSQ IoCsq, PKIRQL PIrql);
+static VOID FuseDeviceAsyncReleaseLock(PIO_CSQ IoCsq, KIRQL Irql);
+static VOID FuseDeviceAsyncCompleteCanceledIrp(PIO_CSQ IoCsq, PIRP Irp);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FuseDeviceInit)
 #pragma alloc_text(PAGE, FuseDeviceFini)
 #pragma alloc_text(PAGE, FuseDeviceExpirationRoutine)
 #pragma alloc_text(PAGE, FuseDeviceTransact)
+#pragma alloc_text(PAGE, FuseDeviceTransactOutDirect)
+#pragma alloc_text(PAGE, FuseDeviceTransactDirect)
+#pragma alloc_text(PAGE, FuseDeviceInitAsync)
+#pragma alloc_text(PAGE, FuseDeviceFiniAsync)
+#pragma alloc_text(PAGE, FuseDeviceTransactAsync)
+#pragma alloc_text(PAGE, FuseDeviceAsyncTransact)
+#pragma alloc_text(PAGE, FuseDeviceAsyncDrain)
+#pragma alloc_text(PAGE, FuseDeviceAsyncNotify)
+#pragma alloc_text(PAGE, FuseDeviceAsyncDrainWorkItem)
+#pragma alloc_text(PAGE, FuseDeviceAsyncPump)
+#pragma alloc_text(PAGE, FuseDeviceAsyncServe)
+#pragma alloc_text(PAGE, FuseDeviceAsyncDereference)
+// !#pragma alloc_text(PAGE, FuseDeviceAsyncInsertIrp)
+// !#pragma alloc_text(PAGE, FuseDeviceAsyncRemoveIrp)
+// !#pragma alloc_text(PAGE, FuseDeviceAsyncPeekNextIrp)
+// !#pragma alloc_text(PAGE, FuseDeviceAsyncAcquireLock)
+// !#pragma alloc_text(PAGE, FuseDeviceAsyncReleaseLock)
+// !#pragma alloc_text(PAGE, FuseDeviceAsyncCompleteCanceledIrp)
 #endif
 
+/*
+ * Number of pump threads per asynchronous transact volume. Pump threads only wait for WinFsp
+ * requests on behalf of pending transact IRPs; requests that are already pending in the FUSE
+ * I/O queue are handed out by the threads that deliver the FUSE responses and by a work item
+ * that is queued when a request is posted to the FUSE I/O queue.
+ */
+#define FUSE_DEVICE_ASYNC_PUMP_COUNT    2
+
+struct _FUSE_DEVICE_ASYNC
+{
+    LONG RefCount;
+    BOOLEAN Stopping;
+    FUSE_INSTANCE *Instance;
+    EX_RUNDOWN_REF Rundown;             /* protects Instance from pump threads and work item */
+    PIO_WORKITEM DrainWorkItem;
+    LONG DrainQueued;
+    KEVENT IrpEvent;
+    KSPIN_LOCK IrpListLock;
+    LIST_ENTRY IrpList;
+    LONG IrpCount;                      /* pended IRPs; readable without IrpListLock */
+    IO_CSQ IrpQueue;
+};
+
 static NTSTATUS FuseDeviceInit(PDEVICE_OBJECT DeviceObject, FSP_FSCTL_VOLUME_PARAMS *VolumeParams)
 {
     PAGED_CODE();
@@ -96,8 +157,74 @@ static NTSTATUS FuseDeviceTransact(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     NTSTATUS Result;
 
     Result = FuseInstanceTransact(Instance,
-        FuseResponse, InputBufferLength,
-        FuseRequest, &OutputBufferLength,
+        FuseResponse, InputBufferLength, 0, 0,
+        FuseRequest, &OutputBufferLength, TRUE,
+        IrpSp->DeviceObject, IrpSp->FileObject,
+        Irp);
+
+    Irp->IoStatus.Information = OutputBufferLength;
+
+    return Result;
+}
+
+static NTSTATUS FuseDeviceTransactOutDirect(PDEVICE_OBJECT DeviceObject, PIRP Irp,
+    BOOLEAN Wait)
+    /*
+     * Same as FuseDeviceTransact, but the output buffer is described by an MDL and is
+     * accessed directly. The input buffer contains a FUSE response (which is small, except
+     * for READ); the output buffer receives the next FUSE request (which is large for WRITE).
+     *
+     * If the response is larger than the input buffer, the input buffer must contain exactly
+     * the response header and the remainder of the response (i.e. the READ data) must be
+     * placed at the start of the output buffer. The response is fully consumed before the
+     * next request is placed in the output buffer.
+     */
+{
+    PAGED_CODE();
+
+    ASSERT(KeAreApcsDisabled());
+
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    ASSERT(IRP_MJ_FILE_SYSTEM_CONTROL == IrpSp->MajorFunction);
+    ASSERT(IRP_MN_USER_FS_REQUEST == IrpSp->MinorFunction);
+    ASSERT(
+        FUSE_FSCTL_TRANSACT_DIRECT == IrpSp->Parameters.FileSystemControl.FsControlCode ||
+        FUSE_FSCTL_TRANSACT_ASYNC == IrpSp->Parameters.FileSystemControl.FsControlCode);
+    ASSERT(METHOD_OUT_DIRECT == (IrpSp->Parameters.FileSystemControl.FsControlCode & 3));
+    ASSERT(IrpSp->FileObject->FsContext2 == DeviceObject);
+
+    FUSE_INSTANCE *Instance = FuseInstanceFromDeviceObject(DeviceObject);
+    ULONG InputBufferLength = IrpSp->Parameters.FileSystemControl.InputBufferLength;
+    ULONG OutputBufferLength = IrpSp->Parameters.FileSystemControl.OutputBufferLength;
+    FUSE_PROTO_RSP *FuseResponse = 0 != InputBufferLength ? Irp->AssociatedIrp.SystemBuffer : 0;
+    PVOID OutputBuffer = 0;
+    FUSE_IOVEC FuseResponseData;
+    ULONG FuseResponseDataCount = 0;
+    NTSTATUS Result;
+
+    if (0 != OutputBufferLength)
+    {
+        OutputBuffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+            NormalPagePriority | MdlMappingNoExecute);
+        if (0 == OutputBuffer)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (FUSE_PROTO_RSP_HEADER_SIZE == InputBufferLength &&
+        FUSE_PROTO_RSP_HEADER_SIZE < FuseResponse->len)
+    {
+        if (FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE > OutputBufferLength)
+            return STATUS_INVALID_PARAMETER;
+
+        FuseResponseData.Buffer = OutputBuffer;
+        FuseResponseData.Length = FuseResponse->len - FUSE_PROTO_RSP_HEADER_SIZE;
+        FuseResponseDataCount = 1;
+        InputBufferLength = FuseResponse->len;
+    }
+
+    Result = FuseInstanceTransact(Instance,
+        FuseResponse, InputBufferLength, &FuseResponseData, FuseResponseDataCount,
+        OutputBuffer, &OutputBufferLength, Wait,
         IrpSp->DeviceObject, IrpSp->FileObject,
         Irp);
 
@@ -106,6 +233,398 @@ static NTSTATUS FuseDeviceTransact(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     return Result;
 }
 
+static NTSTATUS FuseDeviceTransactDirect(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+    PAGED_CODE();
+
+    return FuseDeviceTransactOutDirect(DeviceObject, Irp, TRUE);
+}
+
+static NTSTATUS FuseDeviceInitAsync(PDEVICE_OBJECT DeviceObject,
+    FSP_FSCTL_VOLUME_PARAMS *VolumeParams)
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    FUSE_DEVICE_ASYNC *Async;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    HANDLE ThreadHandle;
+    NTSTATUS Result;
+
+    Async = FuseAllocNonPaged(sizeof *Async);
+    if (0 == Async)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(Async, sizeof *Async);
+    Async->DrainWorkItem = IoAllocateWorkItem(DeviceObject);
+    if (0 == Async->DrainWorkItem)
+    {
+        FuseFree(Async);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    Async->RefCount = 1;
+    Async->Instance = &DeviceExtension->Instance;
+    ExInitializeRundownProtection(&Async->Rundown);
+    KeInitializeEvent(&Async->IrpEvent, SynchronizationEvent, FALSE);
+    KeInitializeSpinLock(&Async->IrpListLock);
+    InitializeListHead(&Async->IrpList);
+    IoCsqInitialize(&Async->IrpQueue,
+        FuseDeviceAsyncInsertIrp,
+        FuseDeviceAsyncRemoveIrp,
+        FuseDeviceAsyncPeekNextIrp,
+        FuseDeviceAsyncAcquireLock,
+        FuseDeviceAsyncReleaseLock,
+        FuseDeviceAsyncCompleteCanceledIrp);
+
+    Result = FuseDeviceInit(DeviceObject, VolumeParams);
+    if (!NT_SUCCESS(Result))
+    {
+        FuseDeviceAsyncDereference(Async);
+        return Result;
+    }
+
+    FuseIoqSetPendingRoutine(Async->Instance->Ioq, FuseDeviceAsyncNotify, Async);
+
+    /*
+     * Pump threads are system threads and are not waited for during FuseDeviceFiniAsync: the
+     * last transact IRP may be completed by a pump thread, which may cause the volume to be
+     * deleted on that same thread. Each pump thread holds a reference on Async instead.
+     */
+    InitializeObjectAttributes(&ObjectAttributes, 0, OBJ_KERNEL_HANDLE, 0, 0);
+    for (ULONG I = 0; FUSE_DEVICE_ASYNC_PUMP_COUNT > I; I++)
+    {
+        InterlockedIncrement(&Async->RefCount);
+        Result = PsCreateSystemThread(&ThreadHandle, THREAD_ALL_ACCESS, &ObjectAttributes,
+            0, 0, FuseDeviceAsyncPump, Async);
+        if (!NT_SUCCESS(Result))
+        {
+            FuseDeviceAsyncDereference(Async);
+            if (0 == I)
+            {
+                /* the Ioq calls FuseDeviceAsyncNotify until it is deleted by FuseDeviceFini */
+                FuseDeviceFini(DeviceObject);
+                FuseDeviceAsyncDereference(Async);
+                return Result;
+            }
+            break;
+        }
+        ZwClose(ThreadHandle);
+    }
+
+    DeviceExtension->Async = Async;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FuseDeviceFiniAsync(PDEVICE_OBJECT DeviceObject)
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    FUSE_DEVICE_ASYNC *Async = DeviceExtension->Async;
+    PIRP Irp;
+
+    Async->Stopping = TRUE;
+    KeSetEvent(&Async->IrpEvent, 1, FALSE);
+
+    /*
+     * Wait until the pump threads and the drain work item are no longer transacting with the
+     * instance. A pump thread that waits for work returns once the volume's transact timeout
+     * expires at the latest.
+     */
+    ExWaitForRundownProtectionRelease(&Async->Rundown);
+
+    while (0 != (Irp = IoCsqRemoveNextIrp(&Async->IrpQueue, 0)))
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    /* Async must remain valid while the Ioq may still call FuseDeviceAsyncNotify */
+    FuseDeviceFini(DeviceObject);
+
+    DeviceExtension->Async = 0;
+    FuseDeviceAsyncDereference(Async);
+}
+
+static NTSTATUS FuseDeviceTransactAsync(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+    /*
+     * Same as FuseDeviceTransactDirect, but never waits for work. The FUSE response (if any)
+     * is delivered immediately. If a FUSE request is asked for, but none is available, the
+     * IRP is pended; it is later completed either by a thread that delivers a FUSE response
+     * that makes a request available (FuseDeviceAsyncDrain) or by a pump thread that waits
+     * for the next WinFsp request (FuseDeviceAsyncPump). This allows a user mode file system
+     * to issue overlapped transacts and process them with a small I/O completion port pool.
+     */
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_EXTENSION *DeviceExtension = FuseDeviceExtension(DeviceObject);
+    FUSE_DEVICE_ASYNC *Async = DeviceExtension->Async;
+    NTSTATUS Result;
+
+    Result = FuseDeviceTransactOutDirect(DeviceObject, Irp, FALSE);
+    if (STATUS_PENDING == Result)
+    {
+        /* the response (if any) has been delivered; only the request remains */
+        IoMarkIrpPending(Irp);
+        IoCsqInsertIrp(&Async->IrpQueue, Irp, 0);
+        KeSetEvent(&Async->IrpEvent, 1, FALSE);
+    }
+
+    FuseDeviceAsyncDrain(Async);
+
+    return Result;
+}
+
+static NTSTATUS FuseDeviceAsyncTransact(FUSE_DEVICE_ASYNC *Async, PIRP Irp, BOOLEAN Wait)
+{
+    PAGED_CODE();
+
+    /*
+     * Transact on behalf of a pended IRP. The transact is performed in the context of the
+     * process that issued the IRP, because WinFsp requests may reference buffers that are
+     * mapped into the address space of the user mode file system. The process cannot go
+     * away, because its IRP is still outstanding.
+     *
+     * The caller must hold the Async rundown protection.
+     */
+
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    ULONG OutputBufferLength = IrpSp->Parameters.FileSystemControl.OutputBufferLength;
+    PVOID OutputBuffer;
+    PEPROCESS Process = IoGetRequestorProcess(Irp);
+    BOOLEAN Attach = 0 != Process && PsGetCurrentProcess() != Process;
+    KAPC_STATE ApcState;
+    NTSTATUS Result;
+
+    OutputBuffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+        NormalPagePriority | MdlMappingNoExecute);
+    ASSERT(0 != OutputBuffer);
+
+    if (Attach)
+        KeStackAttachProcess(Process, &ApcState);
+    KeEnterCriticalRegion();
+
+    Result = FuseInstanceTransact(Async->Instance,
+        0, 0, 0, 0,
+        OutputBuffer, &OutputBufferLength, Wait,
+        IrpSp->DeviceObject, IrpSp->FileObject,
+        Irp);
+
+    KeLeaveCriticalRegion();
+    if (Attach)
+        KeUnstackDetachProcess(&ApcState);
+
+    if (STATUS_PENDING != Result)
+    {
+        Irp->IoStatus.Status = Result;
+        Irp->IoStatus.Information = NT_SUCCESS(Result) ? OutputBufferLength : 0;
+    }
+
+    return Result;
+}
+
+static VOID FuseDeviceAsyncDrain(FUSE_DEVICE_ASYNC *Async)
+{
+    PAGED_CODE();
+
+    /*
+     * Hand out the FUSE requests that are already pending in the FUSE I/O queue to pended
+     * IRPs. This is done without waiting, so it is safe to do from the dispatch routine.
+     *
+     * Rundown protection is not held while an IRP is completed, because completing the last
+     * IRP may cause the volume to be deleted on this same thread.
+     */
+
+    PIRP Irp;
+
+    while (ExAcquireRundownProtection(&Async->Rundown))
+    {
+        Irp = IoCsqRemoveNextIrp(&Async->IrpQueue, 0);
+        if (0 == Irp)
+        {
+            ExReleaseRundownProtection(&Async->Rundown);
+            break;
+        }
+
+        if (STATUS_PENDING == FuseDeviceAsyncTransact(Async, Irp, FALSE))
+        {
+            /* no more FUSE requests; leave the IRP for the pump threads */
+            IoCsqInsertIrp(&Async->IrpQueue, Irp, 0);
+            KeSetEvent(&Async->IrpEvent, 1, FALSE);
+            ExReleaseRundownProtection(&Async->Rundown);
+            break;
+        }
+
+        ExReleaseRundownProtection(&Async->Rundown);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+static VOID FuseDeviceAsyncNotify(PVOID Async0)
+{
+    PAGED_CODE();
+
+    /*
+     * Called when a Context is posted to the FUSE I/O queue (e.g. the children of a Context
+     * or a FORGET). The pended IRPs are drained from a work item, because the posting thread
+     * may hold locks and may be running in an arbitrary process. A drain that is already
+     * queued will pick up the new Context.
+     */
+
+    FUSE_DEVICE_ASYNC *Async = Async0;
+
+    if (Async->Stopping || 0 == InterlockedCompareExchange(&Async->IrpCount, 0, 0))
+        return;
+
+    if (0 != InterlockedCompareExchange(&Async->DrainQueued, 1, 0))
+        return;
+
+    InterlockedIncrement(&Async->RefCount);
+    IoQueueWorkItem(Async->DrainWorkItem, FuseDeviceAsyncDrainWorkItem, DelayedWorkQueue, Async);
+}
+
+static VOID FuseDeviceAsyncDrainWorkItem(PDEVICE_OBJECT DeviceObject, PVOID Async0)
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_ASYNC *Async = Async0;
+
+    /* allow a Context posted from now on to queue another drain */
+    InterlockedExchange(&Async->DrainQueued, 0);
+
+    FuseDeviceAsyncDrain(Async);
+
+    FuseDeviceAsyncDereference(Async);
+}
+
+static VOID FuseDeviceAsyncPump(PVOID Async0)
+{
+    PAGED_CODE();
+
+    FUSE_DEVICE_ASYNC *Async = Async0;
+    PIRP Irp;
+
+    while (!Async->Stopping)
+    {
+        Irp = IoCsqRemoveNextIrp(&Async->IrpQueue, 0);
+        if (0 == Irp)
+        {
+            KeWaitForSingleObject(&Async->IrpEvent, Executive, KernelMode, FALSE, 0);
+            continue;
+        }
+
+        /* more IRPs may be pending; let another pump thread pick them up */
+        KeSetEvent(&Async->IrpEvent, 1, FALSE);
+
+        FuseDeviceAsyncServe(Async, Irp);
+    }
+
+    /* wake up the next pump thread so that it also notices Stopping */
+    KeSetEvent(&Async->IrpEvent, 1, FALSE);
+
+    FuseDeviceAsyncDereference(Async);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static VOID FuseDeviceAsyncServe(FUSE_DEVICE_ASYNC *Async, PIRP Irp)
+{
+    PAGED_CODE();
+
+    /* wait for the next FUSE request on behalf of a pended IRP */
+
+    NTSTATUS Result;
+
+    if (!ExAcquireRundownProtection(&Async->Rundown))
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return;
+    }
+
+    Result = FuseDeviceAsyncTransact(Async, Irp, TRUE);
+    ASSERT(STATUS_PENDING != Result);
+
+    /* release before completing: completing the last IRP may cause the volume to be deleted */
+    ExReleaseRundownProtection(&Async->Rundown);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+static VOID FuseDeviceAsyncDereference(FUSE_DEVICE_ASYNC *Async)
+{
+    PAGED_CODE();
+
+    if (0 == InterlockedDecrement(&Async->RefCount))
+    {
+        IoFreeWorkItem(Async->DrainWorkItem);
+        FuseFree(Async);
+    }
+}
+
+static VOID FuseDeviceAsyncInsertIrp(PIO_CSQ IoCsq, PIRP Irp)
+{
+    // !PAGED_CODE();
+
+    FUSE_DEVICE_ASYNC *Async = CONTAINING_RECORD(IoCsq, FUSE_DEVICE_ASYNC, IrpQueue);
+    InsertTailList(&Async->IrpList, &Irp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&Async->IrpCount);
+}
+
+static VOID FuseDeviceAsyncRemoveIrp(PIO_CSQ IoCsq, PIRP Irp)
+{
+    // !PAGED_CODE();
+
+    FUSE_DEVICE_ASYNC *Async = CONTAINING_RECORD(IoCsq, FUSE_DEVICE_ASYNC, IrpQueue);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    InterlockedDecrement(&Async->IrpCount);
+}
+
+static PIRP FuseDeviceAsyncPeekNextIrp(PIO_CSQ IoCsq, PIRP Irp, PVOID PeekContext)
+{
+    // !PAGED_CODE();
+
+    /* PeekContext (if not NULL) is the process that must have issued the IRP */
+    FUSE_DEVICE_ASYNC *Async = CONTAINING_RECORD(IoCsq, FUSE_DEVICE_ASYNC, IrpQueue);
+    PLIST_ENTRY Entry = 0 != Irp ? Irp->Tail.Overlay.ListEntry.Flink : Async->IrpList.Flink;
+    for (; &Async->IrpList != Entry; Entry = Entry->Flink)
+    {
+        Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+        if (0 == PeekContext || IoGetRequestorProcess(Irp) == PeekContext)
+            return Irp;
+    }
+    return 0;
+}
+
+static VOID FuseDeviceAsyncAcquireLock(PIO_CSQ IoCsq, PKIRQL PIrql)
+{
+    // !PAGED_CODE();
+
+    FUSE_DEVICE_ASYNC *Async = CONTAINING_RECORD(IoCsq, FUSE_DEVICE_ASYNC, IrpQueue);
+    KeAcquireSpinLock(&Async->IrpListLock, PIrql);
+}
+
+static VOID FuseDeviceAsyncReleaseLock(PIO_CSQ IoCsq, KIRQL Irql)
+{
+    // !PAGED_CODE();
+
+    FUSE_DEVICE_ASYNC *Async = CONTAINING_RECORD(IoCsq, FUSE_DEVICE_ASYNC, IrpQueue);
+    KeReleaseSpinLock(&Async->IrpListLock, Irql);
+}
+
+static VOID FuseDeviceAsyncCompleteCanceledIrp(PIO_CSQ IoCsq, PIRP Irp)
+{
+    // !PAGED_CODE();
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
 FSP_FSEXT_PROVIDER FuseProvider =
 {
     /* Version */
@@ -115,7 +634,7 @@ FSP_FSEXT_PROVIDER FuseProvider =
     FUSE_FSCTL_TRANSACT,
 
     /* DeviceExtensionSize */
-    sizeof(FUSE_INSTANCE),
+    sizeof(FUSE_DEVICE_EXTENSION),
 
     /* DeviceInit */
     FuseDeviceInit,
@@ -129,3 +648,51 @@ FSP_FSEXT_PROVIDER FuseProvider =
     /* DeviceTransact */
     FuseDeviceTransact,
 };
+
+FSP_FSEXT_PROVIDER FuseDirectProvider =
+{
+    /* Version */
+    sizeof FuseDirectProvider,
+
+    /* DeviceTransactCode */
+    FUSE_FSCTL_TRANSACT_DIRECT,
+
+    /* DeviceExtensionSize */
+    sizeof(FUSE_DEVICE_EXTENSION),
+
+    /* DeviceInit */
+    FuseDeviceInit,
+
+    /* DeviceFini */
+    FuseDeviceFini,
+
+    /* DeviceExpirationRoutine */
+    FuseDeviceExpirationRoutine,
+
+    /* DeviceTransact */
+    FuseDeviceTransactDirect,
+};
+
+FSP_FSEXT_PROVIDER FuseAsyncProvider =
+{
+    /* Version */
+    sizeof FuseAsyncProvider,
+
+    /* DeviceTransactCode */
+    FUSE_FSCTL_TRANSACT_ASYNC,
+
+    /* DeviceExtensionSize */
+    sizeof(FUSE_DEVICE_EXTENSION),
+
+    /* DeviceInit */
+    FuseDeviceInitAsync,
+
+    /* DeviceFini */
+    FuseDeviceFiniAsync,
+
+    /* DeviceExpirationRoutine */
+    FuseDeviceExpirationRoutine,
+
+    /* DeviceTransact */
+    FuseDeviceTransactAsync,
+};
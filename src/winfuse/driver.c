@@ -22,9 +22,11 @@
 #include <winfuse/driver.h>
 
 DRIVER_INITIALIZE DriverEntry;
+static VOID FuseDriverRegisterOptionalProvider(FSP_FSEXT_PROVIDER *Provider);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(INIT, DriverEntry)
+#pragma alloc_text(INIT, FuseDriverRegisterOptionalProvider)
 #endif
 
 NTSTATUS DriverEntry(
@@ -35,5 +37,37 @@ NTSTATUS DriverEntry(
         DbgBreakPoint();
 #endif
 
-    return FspFsextProviderRegister(&FuseProvider);
+    NTSTATUS Result;
+
+    Result = FspFsextProviderRegister(&FuseProvider);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    /*
+     * The direct I/O and async transacts are optional. WinFsp cannot unregister a provider,
+     * so once FuseProvider is registered the driver must stay loaded; failure to register
+     * an optional provider is therefore only logged. The Fsext registry values belong to the
+     * installer and are left alone, so a transient failure does not outlive this boot.
+     */
+    FuseDriverRegisterOptionalProvider(&FuseDirectProvider);
+    FuseDriverRegisterOptionalProvider(&FuseAsyncProvider);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FuseDriverRegisterOptionalProvider(FSP_FSEXT_PROVIDER *Provider)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+
+    Result = FspFsextProviderRegister(Provider);
+    if (!NT_SUCCESS(Result))
+    {
+        DEBUGLOG("cannot register transact provider 0x%08lx (Status=%lx)",
+            (ULONG)Provider->DeviceTransactCode, Result);
+        return;
+    }
+
+    ASSERT(FuseProvider.DeviceExtensionOffset == Provider->DeviceExtensionOffset);
 }
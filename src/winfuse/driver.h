@@ -26,12 +26,30 @@
 
 #define FUSE_FSCTL_TRANSACT             \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xC00 + 'F', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FUSE_FSCTL_TRANSACT_DIRECT      \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xC00 + 'D', METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FUSE_FSCTL_TRANSACT_ASYNC       \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xC00 + 'A', METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+typedef struct _FUSE_DEVICE_ASYNC FUSE_DEVICE_ASYNC;
+typedef struct _FUSE_DEVICE_EXTENSION
+{
+    FUSE_INSTANCE Instance;
+    FUSE_DEVICE_ASYNC *Async;
+} FUSE_DEVICE_EXTENSION;
 
 extern FSP_FSEXT_PROVIDER FuseProvider;
+extern FSP_FSEXT_PROVIDER FuseDirectProvider;
+extern FSP_FSEXT_PROVIDER FuseAsyncProvider;
 static inline
-FUSE_INSTANCE *FuseInstanceFromDeviceObject(PDEVICE_OBJECT DeviceObject)
+FUSE_DEVICE_EXTENSION *FuseDeviceExtension(PDEVICE_OBJECT DeviceObject)
 {
     return (PVOID)((PUINT8)DeviceObject->DeviceExtension + FuseProvider.DeviceExtensionOffset);
 }
+static inline
+FUSE_INSTANCE *FuseInstanceFromDeviceObject(PDEVICE_OBJECT DeviceObject)
+{
+    return &FuseDeviceExtension(DeviceObject)->Instance;
+}
 
 #endif
@@ -552,10 +552,11 @@ static INT FileRead(
 
     for (;;)
     {
-        OutputBufferLength = (ULONG)Length;
+        OutputBufferLength = FUSE_PROTO_REQ_SIZEMAX < Length ?
+            FUSE_PROTO_REQ_SIZEMAX : (ULONG)Length;
         Result = FuseInstanceTransact(File->FuseInstance,
-            0, 0,
-            Buffer, &OutputBufferLength,
+            0, 0, 0, 0,
+            Buffer, &OutputBufferLength, TRUE,
             0, VolumeFileObject,
             0);
         if (!NT_SUCCESS(Result))
@@ -583,7 +584,9 @@ static INT FileWriteVector(
     PSIZE_T PBytesTransferred)
 {
     FILE *File = (FILE *)File0;
-    FUSE_PROTO_RSP FuseResponseBuf, *FuseResponse = &FuseResponseBuf;
+    FUSE_PROTO_RSP FuseResponseBuf;
+    FUSE_IOVEC FuseResponseDataBuf[16], *FuseResponseData = FuseResponseDataBuf;
+    ULONG FuseResponseDataCount = 0;
     ULONG InputBufferLength;
     ULONG OutputBufferLength = 0;
     PFILE_OBJECT VolumeFileObject;
@@ -596,43 +599,46 @@ static INT FileWriteVector(
 
     InputBufferLength = 0;
     for (ULONG I = 0; (ULONG)IoVector->Count > I; I++)
+    {
+        if (FUSE_PROTO_RSP_SIZEMAX - InputBufferLength < IoVector->Vector[I].Length)
+            return -EINVAL;
         InputBufferLength += (ULONG)IoVector->Vector[I].Length;
+    }
     if (FUSE_PROTO_RSP_HEADER_SIZE > InputBufferLength)
         return -EINVAL;
 
+    if (sizeof FuseResponseDataBuf / sizeof FuseResponseDataBuf[0] < (ULONG)IoVector->Count)
+    {
+        FuseResponseData = FuseAlloc(IoVector->Count * sizeof(FUSE_IOVEC));
+        if (0 == FuseResponseData)
+            return -ENOMEM;
+    }
+
+    /*
+     * Copy small responses into FuseResponseBuf. For larger responses copy only the header
+     * and describe the remainder of the response in place (FuseResponseData), so that the
+     * transact can copy the payload directly to its destination.
+     */
     try
     {
         ULONG L = sizeof(FUSE_PROTO_RSP) < InputBufferLength ?
-            FUSE_PROTO_RSP_HEADER_SIZE : sizeof(FUSE_PROTO_RSP);
+            FUSE_PROTO_RSP_HEADER_SIZE : InputBufferLength;
         PUINT8 P = (PUINT8)&FuseResponseBuf, EndP = P + L;
-        for (ULONG I = 0; (ULONG)IoVector->Count > I && EndP > P; I++)
+        for (ULONG I = 0; (ULONG)IoVector->Count > I; I++)
         {
             L = (ULONG)(EndP - P);
             if (L > (ULONG)IoVector->Vector[I].Length)
                 L = (ULONG)IoVector->Vector[I].Length;
             RtlCopyMemory(P, IoVector->Vector[I].Buffer, L);
             P += L;
-        }
-
-        if (sizeof(FUSE_PROTO_RSP) < InputBufferLength)
-        {
-            P = FuseAlloc(InputBufferLength);
-            if (0 == P)
-            {
-                Error = -ENOMEM;
-                goto exit;
-            }
-            FuseResponse = (PVOID)P;
 
-            L = InputBufferLength;
-            EndP = P + L;
-            for (ULONG I = 0; (ULONG)IoVector->Count > I && EndP > P; I++)
+            if ((ULONG)IoVector->Vector[I].Length > L)
             {
-                L = (ULONG)(EndP - P);
-                if (L > (ULONG)IoVector->Vector[I].Length)
-                    L = (ULONG)IoVector->Vector[I].Length;
-                RtlCopyMemory(P, IoVector->Vector[I].Buffer, L);
-                P += L;
+                FuseResponseData[FuseResponseDataCount].Buffer =
+                    (PUINT8)IoVector->Vector[I].Buffer + L;
+                FuseResponseData[FuseResponseDataCount].Length =
+                    IoVector->Vector[I].Length - L;
+                FuseResponseDataCount++;
             }
         }
     }
@@ -643,8 +649,9 @@ static INT FileWriteVector(
     }
 
     Result = FuseInstanceTransact(File->FuseInstance,
-        FuseResponse, InputBufferLength,
-        0, &OutputBufferLength,
+        &FuseResponseBuf, InputBufferLength,
+        FuseResponseData, FuseResponseDataCount,
+        0, &OutputBufferLength, TRUE,
         0, VolumeFileObject,
         0);
     if (!NT_SUCCESS(Result))
@@ -658,8 +665,8 @@ static INT FileWriteVector(
     Error = 0;
 
 exit:
-    if (&FuseResponseBuf != FuseResponse)
-        FuseFree(FuseResponse);
+    if (FuseResponseDataBuf != FuseResponseData)
+        FuseFree(FuseResponseData);
 
     return Error;
 }
@@ -0,0 +1,98 @@
+/*
+ * Description:
+ *     Measures the throughput of POSIX path splitting for long paths. It compares walking a
+ *     path one component at a time with FusePosixPathPrefix (as FuseLookupPath used to do)
+ *     against splitting it in a single pass with FusePosixPathComponents.
+ *
+ * Compile:
+ *     - cl /I..\..\src path-bench.c
+ *
+ * Run:
+ *     - path-bench.exe [ITERATIONS [COMPONENTS [COMPONENT-LENGTH]]]
+ *       (defaults: 1000000 iterations, 16 components, 32 characters per component)
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SHARED_KM_SHARED_H_INCLUDED
+#define PAGED_CODE()
+typedef struct _FUSE_POSIX_PATH_COMPONENT
+{
+    USHORT Offset, Length;
+} FUSE_POSIX_PATH_COMPONENT;            /* see shared/km/shared.h */
+#include <shared/km/path.c>
+
+static ULONGLONG Now(VOID)
+{
+    LARGE_INTEGER Counter, Frequency;
+    QueryPerformanceCounter(&Counter);
+    QueryPerformanceFrequency(&Frequency);
+    return Counter.QuadPart * 1000000 / Frequency.QuadPart;
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+    ULONG Iterations, ComponentCount, ComponentLength;
+    STRING Path, Name, Remain;
+    FUSE_POSIX_PATH_COMPONENT Components[64];
+    PSTR Buffer, P;
+    ULONGLONG Start, PrefixTime, ComponentsTime;
+    volatile ULONG Sink = 0;
+
+    Iterations = 1 < argc ? wcstoul(argv[1], 0, 10) : 1000000;
+    ComponentCount = 2 < argc ? wcstoul(argv[2], 0, 10) : 16;
+    ComponentLength = 3 < argc ? wcstoul(argv[3], 0, 10) : 32;
+    if (0 == Iterations || 0 == ComponentCount || 0 == ComponentLength ||
+        64 < ComponentCount + 1 ||
+        65535 < ComponentCount * (ComponentLength + 1))
+    {
+        fprintf(stderr, "usage: path-bench [ITERATIONS [COMPONENTS [COMPONENT-LENGTH]]]\n");
+        return 2;
+    }
+
+    Buffer = malloc(ComponentCount * (ComponentLength + 1));
+    if (0 == Buffer)
+        return 1;
+    P = Buffer;
+    for (ULONG I = 0; ComponentCount > I; I++)
+    {
+        *P++ = '/';
+        for (ULONG J = 0; ComponentLength > J; J++)
+            *P++ = 'a' + (I + J) % 26;
+    }
+    Path.Length = Path.MaximumLength = (USHORT)(P - Buffer);
+    Path.Buffer = Buffer;
+
+    Start = Now();
+    for (ULONG I = 0; Iterations > I; I++)
+    {
+        Remain = Path;
+        do
+        {
+            FusePosixPathPrefix(&Remain, &Name, &Remain);
+            Sink += Name.Length;
+        } while (0 != Remain.Length);
+    }
+    PrefixTime = Now() - Start;
+
+    Start = Now();
+    for (ULONG I = 0; Iterations > I; I++)
+    {
+        ULONG Count = FusePosixPathComponents(&Path, Components, 64);
+        for (ULONG J = 0; Count > J; J++)
+            Sink += Components[J].Length;
+    }
+    ComponentsTime = Now() - Start;
+
+    printf("path length %u, %u components\n", (unsigned)Path.Length, (unsigned)ComponentCount + 1);
+    printf("FusePosixPathPrefix walk: %.1f MB/s\n",
+        (double)Path.Length * Iterations / (PrefixTime ? PrefixTime : 1));
+    printf("FusePosixPathComponents:  %.1f MB/s\n",
+        (double)Path.Length * Iterations / (ComponentsTime ? ComponentsTime : 1));
+
+    free(Buffer);
+
+    return 0;
+}
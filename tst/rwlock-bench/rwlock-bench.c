@@ -0,0 +1,116 @@
+/*
+ * Description:
+ *     Measures the throughput of namespace operations that are serialized by the op guard
+ *     read-write locks (FUSE_RWLOCK). A number of threads repeatedly open existing files
+ *     (shared acquisitions) and, optionally, create and delete files (exclusive acquisitions)
+ *     in the current directory, which must be on a WinFuse file system (e.g. memfs-fuse3).
+ *
+ * Compile:
+ *     - cl rwlock-bench.c
+ *
+ * Run:
+ *     - Build the WinFuse driver with one of FUSE_RWLOCK_USE_PERCPU, FUSE_RWLOCK_USE_SEMAPHORE
+ *       or FUSE_RWLOCK_USE_ERESOURCE (see shared/km/shared.h) and mount the file system.
+ *     - rwlock-bench.exe [THREADS [SECONDS [WRITE-PERCENT]]]
+ *       (defaults: number of processors, 10 seconds, 0 percent)
+ *     - Repeat for each variant and compare the reported operations per second.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static volatile LONG Stop;
+static ULONG WritePercent;
+
+static DWORD WINAPI ThreadProc(PVOID Param)
+{
+    ULONG ThreadIndex = (ULONG)(UINT_PTR)Param;
+    ULONG Seed = ThreadIndex + 1;
+    WCHAR FileName[64], TempName[64];
+    ULONG Count = 0;
+    HANDLE Handle;
+
+    wsprintfW(FileName, L"rwlock-bench-%u", ThreadIndex);
+    wsprintfW(TempName, L"rwlock-bench-%u.tmp", ThreadIndex);
+
+    Handle = CreateFileW(FileName,
+        GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return 0;
+    CloseHandle(Handle);
+
+    while (!Stop)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        if ((Seed >> 16) % 100 < WritePercent)
+        {
+            Handle = CreateFileW(TempName,
+                GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+        }
+        else
+        {
+            Handle = CreateFileW(FileName,
+                GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        }
+        if (INVALID_HANDLE_VALUE == Handle)
+            return 0;
+        CloseHandle(Handle);
+        Count++;
+    }
+
+    DeleteFileW(FileName);
+
+    return Count;
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+    SYSTEM_INFO SystemInfo;
+    ULONG ThreadCount, Seconds;
+    HANDLE *Threads;
+    ULONGLONG Total = 0;
+    DWORD ExitCode;
+
+    GetSystemInfo(&SystemInfo);
+    ThreadCount = 1 < argc ? wcstoul(argv[1], 0, 10) : SystemInfo.dwNumberOfProcessors;
+    Seconds = 2 < argc ? wcstoul(argv[2], 0, 10) : 10;
+    WritePercent = 3 < argc ? wcstoul(argv[3], 0, 10) : 0;
+    if (0 == ThreadCount || 0 == Seconds || 100 < WritePercent)
+    {
+        fprintf(stderr, "usage: rwlock-bench [THREADS [SECONDS [WRITE-PERCENT]]]\n");
+        return 2;
+    }
+
+    Threads = calloc(ThreadCount, sizeof *Threads);
+    if (0 == Threads)
+        return 1;
+
+    for (ULONG Index = 0; ThreadCount > Index; Index++)
+    {
+        Threads[Index] = CreateThread(0, 0, ThreadProc, (PVOID)(UINT_PTR)Index, 0, 0);
+        if (0 == Threads[Index])
+            return 1;
+    }
+
+    Sleep(Seconds * 1000);
+    Stop = 1;
+
+    for (ULONG Index = 0; ThreadCount > Index; Index++)
+    {
+        WaitForSingleObject(Threads[Index], INFINITE);
+        GetExitCodeThread(Threads[Index], &ExitCode);
+        CloseHandle(Threads[Index]);
+        Total += ExitCode;
+    }
+
+    printf("threads=%lu seconds=%lu write-percent=%lu ops=%llu ops/s=%llu\n",
+        ThreadCount, Seconds, WritePercent, Total, Total / Seconds);
+
+    free(Threads);
+
+    return 0;
+}
@@ -24,6 +24,10 @@
 
 #define SHARED_KM_SHARED_H_INCLUDED
 #define PAGED_CODE()
+typedef struct _FUSE_POSIX_PATH_COMPONENT
+{
+    USHORT Offset, Length;
+} FUSE_POSIX_PATH_COMPONENT;            /* see shared/km/shared.h */
 #include <shared/km/path.c>
 
 void path_prefix_test(void)
@@ -146,8 +150,91 @@ void path_suffix_test(void)
     }
 }
 
+void path_components_test(void)
+{
+    PSTR ipaths[] =
+    {
+        "",
+        "/",
+        "//",
+        "/a",
+        "//a",
+        "//a/",
+        "//a//",
+        "a/",
+        "a//",
+        "a/b",
+        "a//b",
+        "foo///bar//baz",
+        "foo///bar//baz/",
+        "foo///bar//baz//",
+        "foo",
+        "/foo/bar/baz",
+        "/0123456789abcdef/0123456789abcdef0/0123456789abcde/x",
+    };
+    PSTR opaths[] =
+    {
+        "", 0,
+        "/", 0,
+        "/", 0,
+        "/", "a", 0,
+        "/", "a", 0,
+        "/", "a", 0,
+        "/", "a", 0,
+        "a", 0,
+        "a", 0,
+        "a", "b", 0,
+        "a", "b", 0,
+        "foo", "bar", "baz", 0,
+        "foo", "bar", "baz", 0,
+        "foo", "bar", "baz", 0,
+        "foo", 0,
+        "/", "foo", "bar", "baz", 0,
+        "/", "0123456789abcdef", "0123456789abcdef0", "0123456789abcde", "x", 0,
+    };
+
+    for (size_t i = 0, j = 0; sizeof ipaths / sizeof ipaths[0] > i; i++)
+    {
+        STRING Path;
+        FUSE_POSIX_PATH_COMPONENT Components[8];
+        ULONG Count;
+
+        Path.Length = Path.MaximumLength = (USHORT)strlen(ipaths[i]);
+        Path.Buffer = ipaths[i];
+
+        Count = FusePosixPathComponents(&Path, Components, 8);
+
+        for (ULONG k = 0; Count > k; k++, j++)
+        {
+            ASSERT(0 != opaths[j]);
+            ASSERT(Components[k].Length == strlen(opaths[j]));
+            ASSERT(Components[k].Offset + Components[k].Length <= Path.Length);
+            ASSERT(0 == memcmp(opaths[j], Path.Buffer + Components[k].Offset,
+                Components[k].Length));
+        }
+        ASSERT(0 == opaths[j]);
+        j++;
+    }
+
+    /* more components than fit: the count is still reported and the stored ones are correct */
+    {
+        STRING Path;
+        FUSE_POSIX_PATH_COMPONENT Components[2];
+        ULONG Count;
+
+        Path.Length = Path.MaximumLength = (USHORT)strlen("/a/b/c");
+        Path.Buffer = "/a/b/c";
+
+        Count = FusePosixPathComponents(&Path, Components, 2);
+        ASSERT(4 == Count);
+        ASSERT(0 == Components[0].Offset && 1 == Components[0].Length);
+        ASSERT(1 == Components[1].Offset && 1 == Components[1].Length);
+    }
+}
+
 void path_tests(void)
 {
     TEST(path_prefix_test);
     TEST(path_suffix_test);
+    TEST(path_components_test);
 }
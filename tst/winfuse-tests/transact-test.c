@@ -24,11 +24,16 @@
 #include <process.h>
 #include <strsafe.h>
 #include <shared/km/proto.h>
+#include <shared/ku/winfuse.h>
 
 #define FUSE_FSCTL_TRANSACT             \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xC00 + 'F', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FUSE_FSCTL_TRANSACT_DIRECT      \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xC00 + 'D', METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FUSE_FSCTL_TRANSACT_ASYNC       \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xC00 + 'A', METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 
-static void transact_init_dotest(PWSTR DeviceName, PWSTR Prefix)
+static void transact_init_dotest(PWSTR DeviceName, PWSTR Prefix, ULONG ControlCode)
 {
     FSP_FSCTL_VOLUME_PARAMS VolumeParams = { .Version = sizeof VolumeParams };
     HANDLE VolumeHandle;
@@ -39,7 +44,7 @@ static void transact_init_dotest(PWSTR DeviceName, PWSTR Prefix)
     if (0 != Prefix && L'\\' == Prefix[0] && L'\\' == Prefix[1])
         wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR),
             Prefix + 1);
-    VolumeParams.FsextControlCode = FUSE_FSCTL_TRANSACT;
+    VolumeParams.FsextControlCode = ControlCode;
     Result = FspFsctlCreateVolume(DeviceName, &VolumeParams,
         VolumeName, sizeof VolumeName, &VolumeHandle);
     ASSERT(STATUS_SUCCESS == Result);
@@ -52,7 +57,7 @@ static void transact_init_dotest(PWSTR DeviceName, PWSTR Prefix)
     FUSE_PROTO_RSP *Response = &ResponseBuf;
     DWORD BytesTransferred;
 
-    Success = DeviceIoControl(VolumeHandle, FUSE_FSCTL_TRANSACT,
+    Success = DeviceIoControl(VolumeHandle, ControlCode,
         0, 0, RequestBuf, sizeof RequestBuf, &BytesTransferred, 0);
     ASSERT(Success);
 
@@ -85,7 +90,7 @@ static void transact_init_dotest(PWSTR DeviceName, PWSTR Prefix)
     // padding
     // unused
 
-    Success = DeviceIoControl(VolumeHandle, FUSE_FSCTL_TRANSACT,
+    Success = DeviceIoControl(VolumeHandle, ControlCode,
         Response, Response->len, 0, 0, &BytesTransferred, 0);
     ASSERT(Success);
 
@@ -95,8 +100,20 @@ static void transact_init_dotest(PWSTR DeviceName, PWSTR Prefix)
 
 static void transact_init_test(void)
 {
-    transact_init_dotest(L"WinFsp.Disk", 0);
-    transact_init_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+    transact_init_dotest(L"WinFsp.Disk", 0, FUSE_FSCTL_TRANSACT);
+    transact_init_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share", FUSE_FSCTL_TRANSACT);
+}
+
+static void transact_init_direct_test(void)
+{
+    transact_init_dotest(L"WinFsp.Disk", 0, FUSE_FSCTL_TRANSACT_DIRECT);
+    transact_init_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share", FUSE_FSCTL_TRANSACT_DIRECT);
+}
+
+static void transact_init_async_test(void)
+{
+    transact_init_dotest(L"WinFsp.Disk", 0, FUSE_FSCTL_TRANSACT_ASYNC);
+    transact_init_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share", FUSE_FSCTL_TRANSACT_ASYNC);
 }
 
 static HANDLE transact_open_close_dotest_VolumeHandle;
@@ -386,11 +403,1157 @@ static void transact_open_bogus_test(void)
     transact_open_close_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share", 'BOGU');
 }
 
+/*
+ * A minimal in-memory file system that is served through a transact FSCTL, while a worker
+ * thread exercises the volume through the Win32 API. The file system consists of the root
+ * directory and the files in Nodes; a test may override the reply to any request through
+ * Handler and may inspect the served requests in OpcodeCount once the volume is idle.
+ */
+#define TRANSACT_FS_NODE_COUNT          8
+#define TRANSACT_FS_DATA_SIZE           (4 * 4096)
+
+typedef struct
+{
+    CHAR Name[32];
+    UINT64 Ino;
+    UINT32 Mode;
+    UINT64 Size;
+    UINT64 AllocationSize;              /* space preallocated with FALLOCATE */
+    UINT8 Data[TRANSACT_FS_DATA_SIZE];
+} TRANSACT_FS_NODE;
+
+typedef struct _TRANSACT_FS TRANSACT_FS;
+struct _TRANSACT_FS
+{
+    ULONG ControlCode;
+    UINT32 InitFlags;
+    BOOLEAN (*Handler)(TRANSACT_FS *Fs, FUSE_PROTO_REQ *Request, FUSE_PROTO_RSP *Response);
+    unsigned (*Worker)(TRANSACT_FS *Fs);
+    WCHAR Root[MAX_PATH];
+    LONG OpcodeCount[64];
+    TRANSACT_FS_NODE Nodes[TRANSACT_FS_NODE_COUNT];
+};
+
+static TRANSACT_FS *transact_fs_create(ULONG ControlCode)
+{
+    TRANSACT_FS *Fs;
+
+    Fs = calloc(1, sizeof *Fs);
+    ASSERT(0 != Fs);
+
+    Fs->ControlCode = ControlCode;
+    Fs->Nodes[0].Ino = FUSE_PROTO_ROOT_INO;
+    Fs->Nodes[0].Mode = 0040777;
+
+    return Fs;
+}
+
+static void transact_fs_delete(TRANSACT_FS *Fs)
+{
+    free(Fs);
+}
+
+static TRANSACT_FS_NODE *transact_fs_add(TRANSACT_FS *Fs, PSTR Name, UINT32 Mode, UINT64 Size)
+{
+    for (ULONG I = 1; TRANSACT_FS_NODE_COUNT > I; I++)
+        if (0 == Fs->Nodes[I].Ino)
+        {
+            TRANSACT_FS_NODE *Node = &Fs->Nodes[I];
+            strcpy_s(Node->Name, sizeof Node->Name, Name);
+            Node->Ino = FUSE_PROTO_ROOT_INO + I;
+            Node->Mode = Mode;
+            Node->Size = Size;
+            return Node;
+        }
+
+    ASSERT(0);
+    return 0;
+}
+
+static TRANSACT_FS_NODE *transact_fs_node(TRANSACT_FS *Fs, UINT64 Ino)
+{
+    for (ULONG I = 0; TRANSACT_FS_NODE_COUNT > I; I++)
+        if (0 != Fs->Nodes[I].Ino && Ino == Fs->Nodes[I].Ino)
+            return &Fs->Nodes[I];
+    return 0;
+}
+
+static TRANSACT_FS_NODE *transact_fs_lookup(TRANSACT_FS *Fs, PSTR Name)
+{
+    /* the root node has an empty name and is never looked up; unlinked nodes have no name */
+    for (ULONG I = 1; TRANSACT_FS_NODE_COUNT > I; I++)
+        if (0 != Fs->Nodes[I].Ino && 0 == strcmp(Name, Fs->Nodes[I].Name))
+            return &Fs->Nodes[I];
+    return 0;
+}
+
+static void transact_fs_attr(TRANSACT_FS_NODE *Node, FUSE_PROTO_REQ *Request,
+    FUSE_PROTO_ATTR *Attr)
+{
+    memset(Attr, 0, sizeof *Attr);
+    Attr->ino = Node->Ino;
+    Attr->size = Node->Size;
+    Attr->blocks = ((Node->Size > Node->AllocationSize ? Node->Size : Node->AllocationSize) +
+        511) / 512;
+    Attr->mode = Node->Mode;
+    Attr->nlink = 1;
+    Attr->uid = Request->uid;
+    Attr->gid = Request->gid;
+}
+
+static void transact_fs_entry(TRANSACT_FS_NODE *Node, FUSE_PROTO_REQ *Request,
+    FUSE_PROTO_ENTRY *Entry)
+{
+    memset(Entry, 0, sizeof *Entry);
+    Entry->nodeid = Node->Ino;
+    transact_fs_attr(Node, Request, &Entry->attr);
+}
+
+static void transact_fs_rename(TRANSACT_FS *Fs, FUSE_PROTO_REQ *Request, FUSE_PROTO_RSP *Response,
+    UINT64 NewDir, PSTR Name)
+{
+    PSTR NewName = Name + strlen(Name) + 1;
+    TRANSACT_FS_NODE *Node, *Target;
+
+    ASSERT(FUSE_PROTO_ROOT_INO == Request->nodeid);
+    ASSERT(FUSE_PROTO_ROOT_INO == NewDir);
+
+    Node = transact_fs_lookup(Fs, Name);
+    if (0 == Node)
+    {
+        Response->error = -2/*ENOENT*/;
+        return;
+    }
+
+    Target = transact_fs_lookup(Fs, NewName);
+    if (0 != Target && Node != Target)
+        Target->Name[0] = '\0';
+    strcpy_s(Node->Name, sizeof Node->Name, NewName);
+}
+
+static void transact_fs_dispatch(TRANSACT_FS *Fs, FUSE_PROTO_REQ *Request, FUSE_PROTO_RSP *Response)
+{
+    TRANSACT_FS_NODE *Node;
+    UINT64 Offset;
+    UINT32 Size;
+
+    memset(Response, 0, sizeof *Response);
+    Response->len = FUSE_PROTO_RSP_HEADER_SIZE;
+    Response->unique = Request->unique;
+
+    if (0 != Fs->Handler && Fs->Handler(Fs, Request, Response))
+        return;
+
+    switch (Request->opcode)
+    {
+    case FUSE_PROTO_OPCODE_INIT:
+        Response->len = FUSE_PROTO_RSP_SIZE(init);
+        Response->rsp.init.major = Request->req.init.major;
+        Response->rsp.init.minor = Request->req.init.minor;
+        Response->rsp.init.flags = Request->req.init.flags & Fs->InitFlags;
+        Response->rsp.init.max_write = TRANSACT_FS_DATA_SIZE;
+        break;
+
+    case FUSE_PROTO_OPCODE_STATFS:
+        Response->len = FUSE_PROTO_RSP_SIZE(statfs);
+        Response->rsp.statfs.st.blocks = 1000;
+        Response->rsp.statfs.st.bfree = 1000;
+        Response->rsp.statfs.st.frsize = 4096;
+        break;
+
+    case FUSE_PROTO_OPCODE_GETATTR:
+        Node = transact_fs_node(Fs, Request->nodeid);
+        if (0 == Node)
+        {
+            Response->error = -2/*ENOENT*/;
+            break;
+        }
+        Response->len = FUSE_PROTO_RSP_SIZE(getattr);
+        transact_fs_attr(Node, Request, &Response->rsp.getattr.attr);
+        break;
+
+    case FUSE_PROTO_OPCODE_SETATTR:
+        Node = transact_fs_node(Fs, Request->nodeid);
+        if (0 == Node)
+        {
+            Response->error = -2/*ENOENT*/;
+            break;
+        }
+        if (0 != (Request->req.setattr.valid & FUSE_PROTO_SETATTR_SIZE))
+        {
+            ASSERT(TRANSACT_FS_DATA_SIZE >= Request->req.setattr.size);
+            if (Node->Size < Request->req.setattr.size)
+                memset(Node->Data + Node->Size, 0, (size_t)(Request->req.setattr.size - Node->Size));
+            Node->Size = Request->req.setattr.size;
+        }
+        Response->len = FUSE_PROTO_RSP_SIZE(setattr);
+        transact_fs_attr(Node, Request, &Response->rsp.setattr.attr);
+        break;
+
+    case FUSE_PROTO_OPCODE_LOOKUP:
+        ASSERT(FUSE_PROTO_ROOT_INO == Request->nodeid);
+        Node = transact_fs_lookup(Fs, Request->req.lookup.name);
+        if (0 == Node)
+        {
+            Response->error = -2/*ENOENT*/;
+            break;
+        }
+        Response->len = FUSE_PROTO_RSP_SIZE(lookup);
+        transact_fs_entry(Node, Request, &Response->rsp.lookup.entry);
+        break;
+
+    case FUSE_PROTO_OPCODE_CREATE:
+        ASSERT(FUSE_PROTO_ROOT_INO == Request->nodeid);
+        Node = transact_fs_lookup(Fs, Request->req.create.name);
+        if (0 != Node)
+        {
+            Response->error = -17/*EEXIST*/;
+            break;
+        }
+        Node = transact_fs_add(Fs, Request->req.create.name, Request->req.create.mode, 0);
+        Response->len = FUSE_PROTO_RSP_SIZE(create);
+        transact_fs_entry(Node, Request, &Response->rsp.create.entry);
+        Response->rsp.create.fh = 100 + Node->Ino;
+        break;
+
+    case FUSE_PROTO_OPCODE_UNLINK:
+        ASSERT(FUSE_PROTO_ROOT_INO == Request->nodeid);
+        Node = transact_fs_lookup(Fs, Request->req.unlink.name);
+        if (0 == Node)
+        {
+            Response->error = -2/*ENOENT*/;
+            break;
+        }
+        Node->Name[0] = '\0';
+        break;
+
+    case FUSE_PROTO_OPCODE_RENAME:
+        transact_fs_rename(Fs, Request, Response,
+            Request->req.rename.newdir, Request->req.rename.name);
+        break;
+
+    case FUSE_PROTO_OPCODE_RENAME2:
+        transact_fs_rename(Fs, Request, Response,
+            Request->req.rename2.newdir, Request->req.rename2.name);
+        break;
+
+    case FUSE_PROTO_OPCODE_OPEN:
+    case FUSE_PROTO_OPCODE_OPENDIR:
+        Response->len = FUSE_PROTO_RSP_SIZE(open);
+        Response->rsp.open.fh = 100 + Request->nodeid;
+        break;
+
+    case FUSE_PROTO_OPCODE_READ:
+        Node = transact_fs_node(Fs, Request->nodeid);
+        ASSERT(0 != Node);
+        Offset = Request->req.read.offset;
+        Size = Request->req.read.size;
+        if (Offset > Node->Size)
+            Offset = Node->Size;
+        if (Size > Node->Size - Offset)
+            Size = (UINT32)(Node->Size - Offset);
+        memcpy((PUINT8)Response + FUSE_PROTO_RSP_HEADER_SIZE, Node->Data + Offset, Size);
+        Response->len += Size;
+        break;
+
+    case FUSE_PROTO_OPCODE_WRITE:
+        Node = transact_fs_node(Fs, Request->nodeid);
+        ASSERT(0 != Node);
+        Offset = Request->req.write.offset;
+        Size = Request->req.write.size;
+        ASSERT(FUSE_PROTO_REQ_SIZE(write) + Size == Request->len);
+        ASSERT(TRANSACT_FS_DATA_SIZE >= Offset + Size);
+        memcpy(Node->Data + Offset, (PUINT8)Request + FUSE_PROTO_REQ_SIZE(write), Size);
+        if (Node->Size < Offset + Size)
+            Node->Size = Offset + Size;
+        Response->len = FUSE_PROTO_RSP_SIZE(write);
+        Response->rsp.write.size = Size;
+        break;
+
+    case FUSE_PROTO_OPCODE_FALLOCATE:
+        Node = transact_fs_node(Fs, Request->nodeid);
+        ASSERT(0 != Node);
+        Offset = Request->req.fallocate.offset + Request->req.fallocate.length;
+        if (1/*FALLOC_FL_KEEP_SIZE*/ == Request->req.fallocate.mode)
+        {
+            if (Node->AllocationSize < Offset)
+                Node->AllocationSize = Offset;
+        }
+        else if (3/*FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE*/ == Request->req.fallocate.mode)
+        {
+            if (Node->AllocationSize <= Offset && Node->AllocationSize > Request->req.fallocate.offset)
+                Node->AllocationSize = Request->req.fallocate.offset;
+        }
+        else
+            Response->error = -95/*EOPNOTSUPP*/;
+        break;
+
+    case FUSE_PROTO_OPCODE_READDIR:
+    case FUSE_PROTO_OPCODE_READDIRPLUS:
+    case FUSE_PROTO_OPCODE_RELEASE:
+    case FUSE_PROTO_OPCODE_RELEASEDIR:
+    case FUSE_PROTO_OPCODE_FLUSH:
+    case FUSE_PROTO_OPCODE_FSYNC:
+    case FUSE_PROTO_OPCODE_FSYNCDIR:
+        break;
+
+    case FUSE_PROTO_OPCODE_FORGET:
+    case FUSE_PROTO_OPCODE_BATCH_FORGET:
+    case FUSE_PROTO_OPCODE_INTERRUPT:
+        Response->len = 0;
+        break;
+
+    default:
+        Response->error = -38/*ENOSYS*/;
+        break;
+    }
+}
+
+static unsigned __stdcall transact_fs_thread(void *Fs0)
+{
+    TRANSACT_FS *Fs = Fs0;
+
+    return Fs->Worker(Fs);
+}
+
+static void transact_fs_run(TRANSACT_FS *Fs, PWSTR DeviceName, PWSTR Prefix)
+{
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { .Version = sizeof VolumeParams };
+    HANDLE VolumeHandle;
+    WCHAR VolumeName[MAX_PATH];
+    HANDLE Thread;
+    DWORD ExitCode;
+    PUINT8 RequestBuf;
+    FUSE_PROTO_REQ *Request;
+    FUSE_PROTO_RSP *Response;
+    ULONG ResponseLength;
+    UINT32 Opcode;
+    DWORD BytesTransferred;
+    BOOL Success;
+    NTSTATUS Result;
+
+    if (0 != Prefix && L'\\' == Prefix[0] && L'\\' == Prefix[1])
+        wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR),
+            Prefix + 1);
+    VolumeParams.TransactTimeout = 1000;
+    VolumeParams.FsextControlCode = Fs->ControlCode;
+    Result = FspFsctlCreateVolume(DeviceName, &VolumeParams,
+        VolumeName, sizeof VolumeName, &VolumeHandle);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(INVALID_HANDLE_VALUE != VolumeHandle);
+
+    StringCbPrintfW(Fs->Root, sizeof Fs->Root, L"%s%s",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : VolumeName);
+
+    RequestBuf = malloc(FUSE_PROTO_REQ_SIZEMAX);
+    Response = malloc(FUSE_PROTO_RSP_SIZEMAX);
+    ASSERT(0 != RequestBuf && 0 != Response);
+    Request = (PVOID)RequestBuf;
+    ResponseLength = 0;
+
+    Thread = (HANDLE)_beginthreadex(0, 0, transact_fs_thread, Fs, 0, 0);
+    ASSERT(0 != Thread);
+
+    for (;;)
+    {
+        Success = DeviceIoControl(VolumeHandle, Fs->ControlCode,
+            0 != ResponseLength ? Response : 0, ResponseLength,
+            RequestBuf, FUSE_PROTO_REQ_SIZEMAX, &BytesTransferred, 0);
+        ASSERT(Success);
+        ResponseLength = 0;
+
+        if (0 == BytesTransferred)
+        {
+            /* transact timeout: done when the worker has exited and the volume is idle */
+            if (WAIT_OBJECT_0 == WaitForSingleObject(Thread, 0))
+                break;
+            continue;
+        }
+
+        ASSERT(FUSE_PROTO_REQ_HEADER_SIZE <= BytesTransferred);
+        ASSERT(Request->len == BytesTransferred);
+
+        Opcode = Request->opcode;
+        if (ARRAYSIZE(Fs->OpcodeCount) > Opcode)
+            InterlockedIncrement(&Fs->OpcodeCount[Opcode]);
+
+        transact_fs_dispatch(Fs, Request, Response);
+        ResponseLength = Response->len;
+
+        if (FUSE_FSCTL_TRANSACT != Fs->ControlCode &&
+            FUSE_PROTO_OPCODE_READ == Opcode && FUSE_PROTO_RSP_HEADER_SIZE < Response->len)
+        {
+            /* deliver the READ data at the start of the output buffer (i.e. through the MDL) */
+            memcpy(RequestBuf, (PUINT8)Response + FUSE_PROTO_RSP_HEADER_SIZE,
+                Response->len - FUSE_PROTO_RSP_HEADER_SIZE);
+            ResponseLength = FUSE_PROTO_RSP_HEADER_SIZE;
+        }
+    }
+
+    Success = CloseHandle(VolumeHandle);
+    ASSERT(Success);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    free(Response);
+    free(RequestBuf);
+
+    ASSERT(0 == ExitCode);
+}
+
+static void transact_fs_pattern(PUINT8 Buffer, ULONG Size, UINT8 Seed)
+{
+    for (ULONG I = 0; Size > I; I++)
+        Buffer[I] = (UINT8)(Seed + I * 7);
+}
+
+static unsigned transact_rw_direct_worker(TRANSACT_FS *Fs, BOOLEAN Write)
+{
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+    PUINT8 Buffer;
+    UINT8 Expected[4096];
+    DWORD BytesTransferred;
+    unsigned Result = 0;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file0", Fs->Root);
+    Handle = CreateFileW(FilePath,
+        Write ? FILE_GENERIC_WRITE : FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+
+    /* non-cached I/O requires a sector aligned buffer */
+    Buffer = VirtualAlloc(0, sizeof Expected, MEM_COMMIT, PAGE_READWRITE);
+    if (0 == Buffer)
+    {
+        Result = GetLastError();
+        CloseHandle(Handle);
+        return Result;
+    }
+
+    transact_fs_pattern(Expected, sizeof Expected, Write ? 'W' : 'R');
+    if (Write)
+    {
+        memcpy(Buffer, Expected, sizeof Expected);
+        if (!WriteFile(Handle, Buffer, sizeof Expected, &BytesTransferred, 0))
+            Result = GetLastError();
+        else if (sizeof Expected != BytesTransferred)
+            Result = ERROR_WRITE_FAULT;
+    }
+    else
+    {
+        if (!ReadFile(Handle, Buffer, sizeof Expected, &BytesTransferred, 0))
+            Result = GetLastError();
+        else if (sizeof Expected != BytesTransferred || 0 != memcmp(Buffer, Expected, sizeof Expected))
+            Result = ERROR_READ_FAULT;
+    }
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    CloseHandle(Handle);
+
+    return Result;
+}
+
+static unsigned transact_read_direct_worker(TRANSACT_FS *Fs)
+{
+    return transact_rw_direct_worker(Fs, FALSE);
+}
+
+static unsigned transact_write_direct_worker(TRANSACT_FS *Fs)
+{
+    return transact_rw_direct_worker(Fs, TRUE);
+}
+
+static void transact_read_direct_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT_DIRECT);
+    TRANSACT_FS_NODE *Node = transact_fs_add(Fs, "file0", 0100666, 4096);
+
+    transact_fs_pattern(Node->Data, 4096, 'R');
+    Fs->Worker = transact_read_direct_worker;
+    transact_fs_run(Fs, DeviceName, Prefix);
+
+    ASSERT(0 != Fs->OpcodeCount[FUSE_PROTO_OPCODE_READ]);
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_read_direct_test(void)
+{
+    transact_read_direct_dotest(L"WinFsp.Disk", 0);
+    transact_read_direct_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
+static void transact_write_direct_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT_DIRECT);
+    TRANSACT_FS_NODE *Node = transact_fs_add(Fs, "file0", 0100666, 0);
+    UINT8 Expected[4096];
+
+    Fs->Worker = transact_write_direct_worker;
+    transact_fs_run(Fs, DeviceName, Prefix);
+
+    /* the WRITE payload was received in the output buffer (i.e. through the MDL) */
+    transact_fs_pattern(Expected, sizeof Expected, 'W');
+    ASSERT(0 != Fs->OpcodeCount[FUSE_PROTO_OPCODE_WRITE]);
+    ASSERT(sizeof Expected == Node->Size);
+    ASSERT(0 == memcmp(Node->Data, Expected, sizeof Expected));
+
+    /* an extending write preallocates nothing, so there is nothing to trim on cleanup */
+    ASSERT(0 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_FALLOCATE]);
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_write_direct_test(void)
+{
+    transact_write_direct_dotest(L"WinFsp.Disk", 0);
+    transact_write_direct_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
+#define TRANSACT_ASYNC_SLOT_COUNT       4
+
+static unsigned transact_async_pend_worker(TRANSACT_FS *Fs)
+{
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file0", Fs->Root);
+    Handle = CreateFileW(FilePath,
+        FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, 0, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+    CloseHandle(Handle);
+
+    return 0;
+}
+
+static void transact_async_pend_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT_ASYNC);
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { .Version = sizeof VolumeParams };
+    HANDLE VolumeHandle;
+    WCHAR VolumeName[MAX_PATH];
+    HANDLE Thread;
+    DWORD ExitCode;
+    OVERLAPPED Overlapped[TRANSACT_ASYNC_SLOT_COUNT];
+    HANDLE Events[TRANSACT_ASYNC_SLOT_COUNT];
+    PUINT8 RequestBufs[TRANSACT_ASYNC_SLOT_COUNT];
+    FUSE_PROTO_REQ *Request;
+    FUSE_PROTO_RSP *Response;
+    ULONG ResponseLength, Index;
+    DWORD BytesTransferred, WaitResult, StartTime;
+    BOOL Success;
+    NTSTATUS Result;
+
+    transact_fs_add(Fs, "file0", 0100666, 0);
+    Fs->Worker = transact_async_pend_worker;
+
+    if (0 != Prefix && L'\\' == Prefix[0] && L'\\' == Prefix[1])
+        wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR),
+            Prefix + 1);
+    VolumeParams.TransactTimeout = 10000;
+    VolumeParams.FsextControlCode = Fs->ControlCode;
+    Result = FspFsctlCreateVolume(DeviceName, &VolumeParams,
+        VolumeName, sizeof VolumeName, &VolumeHandle);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(INVALID_HANDLE_VALUE != VolumeHandle);
+
+    StringCbPrintfW(Fs->Root, sizeof Fs->Root, L"%s%s",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : VolumeName);
+
+    Response = malloc(FUSE_PROTO_RSP_SIZEMAX);
+    ASSERT(0 != Response);
+    for (Index = 0; TRANSACT_ASYNC_SLOT_COUNT > Index; Index++)
+    {
+        RequestBufs[Index] = malloc(FUSE_PROTO_REQ_SIZEMAX);
+        ASSERT(0 != RequestBufs[Index]);
+        Events[Index] = CreateEventW(0, TRUE, FALSE, 0);
+        ASSERT(0 != Events[Index]);
+        memset(&Overlapped[Index], 0, sizeof Overlapped[Index]);
+        Overlapped[Index].hEvent = Events[Index];
+    }
+
+    /* INIT is available immediately; its reply does not ask for another request */
+    Request = (PVOID)RequestBufs[0];
+    Success = DeviceIoControl(VolumeHandle, Fs->ControlCode,
+        0, 0, RequestBufs[0], FUSE_PROTO_REQ_SIZEMAX, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(Request->len == BytesTransferred);
+    ASSERT(FUSE_PROTO_OPCODE_INIT == Request->opcode);
+    transact_fs_dispatch(Fs, Request, Response);
+    Success = DeviceIoControl(VolumeHandle, Fs->ControlCode,
+        Response, Response->len, 0, 0, &BytesTransferred, 0);
+    ASSERT(Success);
+
+    /* the volume is idle: every transact must be pended */
+    for (Index = 0; TRANSACT_ASYNC_SLOT_COUNT > Index; Index++)
+    {
+        Success = DeviceIoControl(VolumeHandle, Fs->ControlCode,
+            0, 0, RequestBufs[Index], FUSE_PROTO_REQ_SIZEMAX, 0, &Overlapped[Index]);
+        ASSERT(!Success && ERROR_IO_PENDING == GetLastError());
+    }
+
+    /* only now produce requests; the FORGET is posted later by the cache expiration */
+    Thread = (HANDLE)_beginthreadex(0, 0, transact_fs_thread, Fs, 0, 0);
+    ASSERT(0 != Thread);
+
+    StartTime = GetTickCount();
+    for (;;)
+    {
+        WaitResult = WaitForMultipleObjects(TRANSACT_ASYNC_SLOT_COUNT, Events, FALSE, 3000);
+        if (WAIT_TIMEOUT == WaitResult)
+        {
+            /* done when the worker has exited and the posted FORGET has been received */
+            if (WAIT_OBJECT_0 == WaitForSingleObject(Thread, 0) &&
+                0 != Fs->OpcodeCount[FUSE_PROTO_OPCODE_FORGET])
+                break;
+            ASSERT(60000 > GetTickCount() - StartTime);
+            continue;
+        }
+
+        Index = WaitResult - WAIT_OBJECT_0;
+        ASSERT(TRANSACT_ASYNC_SLOT_COUNT > Index);
+        Success = GetOverlappedResult(VolumeHandle, &Overlapped[Index], &BytesTransferred, FALSE);
+        ASSERT(Success);
+        ResetEvent(Events[Index]);
+
+        ResponseLength = 0;
+        if (0 != BytesTransferred)
+        {
+            Request = (PVOID)RequestBufs[Index];
+            ASSERT(FUSE_PROTO_REQ_HEADER_SIZE <= BytesTransferred);
+            ASSERT(Request->len == BytesTransferred);
+            if (ARRAYSIZE(Fs->OpcodeCount) > Request->opcode)
+                InterlockedIncrement(&Fs->OpcodeCount[Request->opcode]);
+            transact_fs_dispatch(Fs, Request, Response);
+            ResponseLength = Response->len;
+        }
+
+        Success = DeviceIoControl(VolumeHandle, Fs->ControlCode,
+            0 != ResponseLength ? Response : 0, ResponseLength,
+            RequestBufs[Index], FUSE_PROTO_REQ_SIZEMAX, 0, &Overlapped[Index]);
+        ASSERT(Success || ERROR_IO_PENDING == GetLastError());
+    }
+
+    ASSERT(0 != Fs->OpcodeCount[FUSE_PROTO_OPCODE_LOOKUP]);
+
+    /* cancel the transacts that are still pended */
+    CancelIoEx(VolumeHandle, 0);
+    for (Index = 0; TRANSACT_ASYNC_SLOT_COUNT > Index; Index++)
+    {
+        GetOverlappedResult(VolumeHandle, &Overlapped[Index], &BytesTransferred, TRUE);
+        CloseHandle(Events[Index]);
+        free(RequestBufs[Index]);
+    }
+    free(Response);
+
+    Success = CloseHandle(VolumeHandle);
+    ASSERT(Success);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(0 == ExitCode);
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_async_pend_test(void)
+{
+    transact_async_pend_dotest(L"WinFsp.Disk", 0);
+    transact_async_pend_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
+static BOOLEAN transact_copy_handler(TRANSACT_FS *Fs, FUSE_PROTO_REQ *Request,
+    FUSE_PROTO_RSP *Response)
+{
+    TRANSACT_FS_NODE *Source, *Target;
+    UINT64 Length;
+
+    if (FUSE_PROTO_OPCODE_COPY_FILE_RANGE != Request->opcode)
+        return FALSE;
+
+    Source = transact_fs_node(Fs, Request->nodeid);
+    Target = transact_fs_node(Fs, Request->req.copy_file_range.nodeid_out);
+    ASSERT(0 != Source && 0 != Target);
+    ASSERT(100 + Source->Ino == Request->req.copy_file_range.fh_in);
+    ASSERT(100 + Target->Ino == Request->req.copy_file_range.fh_out);
+
+    Length = Request->req.copy_file_range.len;
+    if (Request->req.copy_file_range.off_in > Source->Size)
+        Length = 0;
+    else if (Length > Source->Size - Request->req.copy_file_range.off_in)
+        Length = Source->Size - Request->req.copy_file_range.off_in;
+    ASSERT(TRANSACT_FS_DATA_SIZE >= Request->req.copy_file_range.off_out + Length);
+
+    memcpy(Target->Data + Request->req.copy_file_range.off_out,
+        Source->Data + Request->req.copy_file_range.off_in, (size_t)Length);
+    if (Target->Size < Request->req.copy_file_range.off_out + Length)
+        Target->Size = Request->req.copy_file_range.off_out + Length;
+
+    Response->len = FUSE_PROTO_RSP_SIZE(copy_file_range);
+    Response->rsp.copy_file_range.size = (UINT32)Length;
+    return TRUE;
+}
+
+static unsigned transact_copy_worker(TRANSACT_FS *Fs)
+{
+    WCHAR FilePath[MAX_PATH];
+    HANDLE SourceHandle, TargetHandle;
+    FUSE_IOCTL_COPY_SOURCE_OUTPUT SourceOutput;
+    FUSE_IOCTL_COPY_FILE_RANGE_INPUT Input;
+    FUSE_IOCTL_COPY_FILE_RANGE_OUTPUT Output;
+    DWORD BytesTransferred;
+    unsigned Result = 0;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file0", Fs->Root);
+    SourceHandle = CreateFileW(FilePath,
+        FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, 0, 0);
+    if (INVALID_HANDLE_VALUE == SourceHandle)
+        return GetLastError();
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file1", Fs->Root);
+    TargetHandle = CreateFileW(FilePath,
+        FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        OPEN_EXISTING, 0, 0);
+    if (INVALID_HANDLE_VALUE == TargetHandle)
+    {
+        Result = GetLastError();
+        CloseHandle(SourceHandle);
+        return Result;
+    }
+
+    if (!DeviceIoControl(SourceHandle, FUSE_IOCTL_COPY_SOURCE,
+        0, 0, &SourceOutput, sizeof SourceOutput, &BytesTransferred, 0))
+    {
+        Result = GetLastError();
+        goto exit;
+    }
+    if (sizeof SourceOutput != BytesTransferred || 0 == SourceOutput.Token)
+    {
+        Result = ERROR_INVALID_DATA;
+        goto exit;
+    }
+
+    /* a token that was not issued does not designate a copy source */
+    Input.Token = SourceOutput.Token + 1;
+    Input.SourceOffset = 0;
+    Input.TargetOffset = 4096;
+    Input.Length = 4096;
+    if (DeviceIoControl(TargetHandle, FUSE_IOCTL_COPY_FILE_RANGE,
+        &Input, sizeof Input, &Output, sizeof Output, &BytesTransferred, 0) ||
+        ERROR_INVALID_PARAMETER != GetLastError())
+    {
+        Result = ERROR_INVALID_DATA;
+        goto exit;
+    }
+
+    Input.Token = SourceOutput.Token;
+    if (!DeviceIoControl(TargetHandle, FUSE_IOCTL_COPY_FILE_RANGE,
+        &Input, sizeof Input, &Output, sizeof Output, &BytesTransferred, 0))
+    {
+        Result = GetLastError();
+        goto exit;
+    }
+    if (sizeof Output != BytesTransferred || 4096 != Output.BytesCopied ||
+        8192 != Output.FileSize)
+    {
+        Result = ERROR_INVALID_DATA;
+        goto exit;
+    }
+
+    /* the token is single-use */
+    if (DeviceIoControl(TargetHandle, FUSE_IOCTL_COPY_FILE_RANGE,
+        &Input, sizeof Input, &Output, sizeof Output, &BytesTransferred, 0) ||
+        ERROR_INVALID_PARAMETER != GetLastError())
+    {
+        Result = ERROR_INVALID_DATA;
+        goto exit;
+    }
+
+exit:
+    CloseHandle(TargetHandle);
+    CloseHandle(SourceHandle);
+
+    return Result;
+}
+
+static void transact_copy_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT);
+    TRANSACT_FS_NODE *Source = transact_fs_add(Fs, "file0", 0100666, 4096);
+    TRANSACT_FS_NODE *Target = transact_fs_add(Fs, "file1", 0100666, 0);
+
+    transact_fs_pattern(Source->Data, 4096, 'C');
+    Fs->Handler = transact_copy_handler;
+    Fs->Worker = transact_copy_worker;
+    transact_fs_run(Fs, DeviceName, Prefix);
+
+    /* the copy was offloaded to the file system and the source was opened and released */
+    ASSERT(1 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_COPY_FILE_RANGE]);
+    ASSERT(8192 == Target->Size);
+    ASSERT(0 == memcmp(Target->Data + 4096, Source->Data, 4096));
+    ASSERT(Fs->OpcodeCount[FUSE_PROTO_OPCODE_OPEN] == Fs->OpcodeCount[FUSE_PROTO_OPCODE_RELEASE]);
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_copy_test(void)
+{
+    transact_copy_dotest(L"WinFsp.Disk", 0);
+    transact_copy_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
+static BOOLEAN transact_seek_handler(TRANSACT_FS *Fs, FUSE_PROTO_REQ *Request,
+    FUSE_PROTO_RSP *Response)
+{
+    UINT64 Offset;
+
+    if (FUSE_PROTO_OPCODE_LSEEK != Request->opcode)
+        return FALSE;
+
+    /* file0 has data at [0, 4096), a hole at [4096, 8192) and data at [8192, 12288) */
+    ASSERT(FUSE_PROTO_ROOT_INO + 1 == Request->nodeid);
+    ASSERT(100 + Request->nodeid == Request->req.lseek.fh);
+
+    Offset = Request->req.lseek.offset;
+    if (12288 <= Offset)
+    {
+        Response->error = -6/*ENXIO*/;
+        return TRUE;
+    }
+    if (3/*SEEK_DATA*/ == Request->req.lseek.whence)
+        Offset = 4096 <= Offset && 8192 > Offset ? 8192 : Offset;
+    else if (4/*SEEK_HOLE*/ == Request->req.lseek.whence)
+        Offset = 4096 > Offset ? 4096 : 8192 <= Offset ? 12288 : Offset;
+    else
+        ASSERT(0);
+
+    Response->len = FUSE_PROTO_RSP_SIZE(lseek);
+    Response->rsp.lseek.offset = Offset;
+    return TRUE;
+}
+
+static unsigned transact_seek_worker(TRANSACT_FS *Fs)
+{
+    static const struct
+    {
+        UINT64 Offset;
+        UINT32 Whence;
+        DWORD Error;
+        UINT64 Expected;
+    } Tests[] =
+    {
+        { 0, FUSE_IOCTL_SEEK_DATA, 0, 0 },
+        { 0, FUSE_IOCTL_SEEK_HOLE, 0, 4096 },
+        { 4096, FUSE_IOCTL_SEEK_DATA, 0, 8192 },
+        { 6000, FUSE_IOCTL_SEEK_HOLE, 0, 6000 },
+        { 8192, FUSE_IOCTL_SEEK_HOLE, 0, 12288 },
+        { 12288, FUSE_IOCTL_SEEK_DATA, ERROR_HANDLE_EOF, 0 },
+        { 0, 0/*SEEK_SET*/, ERROR_INVALID_PARAMETER, 0 },
+    };
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+    FUSE_IOCTL_SEEK_INPUT Input;
+    FUSE_IOCTL_SEEK_OUTPUT Output;
+    DWORD BytesTransferred;
+    unsigned Result = 0;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file0", Fs->Root);
+    Handle = CreateFileW(FilePath,
+        FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, 0, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+
+    for (ULONG I = 0; ARRAYSIZE(Tests) > I && 0 == Result; I++)
+    {
+        Input.Offset = Tests[I].Offset;
+        Input.Whence = Tests[I].Whence;
+        if (!DeviceIoControl(Handle, FUSE_IOCTL_SEEK,
+            &Input, sizeof Input, &Output, sizeof Output, &BytesTransferred, 0))
+        {
+            if (Tests[I].Error != GetLastError())
+                Result = ERROR_INVALID_DATA;
+        }
+        else if (0 != Tests[I].Error ||
+            sizeof Output != BytesTransferred || Tests[I].Expected != Output.Offset)
+            Result = ERROR_INVALID_DATA;
+    }
+
+    CloseHandle(Handle);
+
+    return Result;
+}
+
+static void transact_seek_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT);
+
+    transact_fs_add(Fs, "file0", 0100666, 12288);
+    Fs->Handler = transact_seek_handler;
+    Fs->Worker = transact_seek_worker;
+    transact_fs_run(Fs, DeviceName, Prefix);
+
+    /* of the 7 seeks, the 6 with a valid whence sent LSEEK; the 7th was rejected locally */
+    ASSERT(6 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_LSEEK]);
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_seek_test(void)
+{
+    transact_seek_dotest(L"WinFsp.Disk", 0);
+    transact_seek_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
+static unsigned transact_preallocate_worker(TRANSACT_FS *Fs)
+{
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+    FILE_ALLOCATION_INFO AllocationInfo;
+    FILE_STANDARD_INFO StandardInfo;
+    unsigned Result = 0;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file0", Fs->Root);
+    Handle = CreateFileW(FilePath,
+        FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        OPEN_EXISTING, 0, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+
+    AllocationInfo.AllocationSize.QuadPart = 3 * 4096;
+    if (!SetFileInformationByHandle(Handle, FileAllocationInfo,
+        &AllocationInfo, sizeof AllocationInfo))
+        Result = GetLastError();
+    else if (!GetFileInformationByHandleEx(Handle, FileStandardInfo,
+        &StandardInfo, sizeof StandardInfo))
+        Result = GetLastError();
+    else if (4096 != StandardInfo.EndOfFile.QuadPart ||
+        3 * 4096 > StandardInfo.AllocationSize.QuadPart)
+        Result = ERROR_INVALID_DATA;
+
+    CloseHandle(Handle);
+
+    return Result;
+}
+
+static void transact_preallocate_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT);
+    TRANSACT_FS_NODE *Node = transact_fs_add(Fs, "file0", 0100666, 4096);
+
+    Fs->Worker = transact_preallocate_worker;
+    transact_fs_run(Fs, DeviceName, Prefix);
+
+    /* the space past the end of file was preallocated and then trimmed on cleanup */
+    ASSERT(2 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_FALLOCATE]);
+    ASSERT(4096 == Node->Size);
+    ASSERT(Node->Size >= Node->AllocationSize);
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_preallocate_test(void)
+{
+    transact_preallocate_dotest(L"WinFsp.Disk", 0);
+    transact_preallocate_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
+static unsigned transact_rename_replace_worker(TRANSACT_FS *Fs)
+{
+    WCHAR FilePath[MAX_PATH], NewFilePath[MAX_PATH];
+    HANDLE Handle;
+    UINT8 Buffer[4096], Expected[4096];
+    DWORD BytesTransferred;
+    unsigned Result = 0;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file0", Fs->Root);
+    StringCbPrintfW(NewFilePath, sizeof NewFilePath, L"%s\\file1", Fs->Root);
+
+    /* look up both names, so that their entries are cached */
+    if (INVALID_FILE_ATTRIBUTES == GetFileAttributesW(FilePath) ||
+        INVALID_FILE_ATTRIBUTES == GetFileAttributesW(NewFilePath))
+        return GetLastError();
+
+    if (!MoveFileExW(FilePath, NewFilePath, MOVEFILE_REPLACE_EXISTING))
+        return GetLastError();
+
+    /* the old name is gone and the new name designates the renamed file */
+    if (INVALID_FILE_ATTRIBUTES != GetFileAttributesW(FilePath))
+        return ERROR_INVALID_DATA;
+    if (ERROR_FILE_NOT_FOUND != GetLastError())
+        return GetLastError();
+
+    Handle = CreateFileW(NewFilePath,
+        FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, 0, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+
+    transact_fs_pattern(Expected, sizeof Expected, '0');
+    if (!ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0))
+        Result = GetLastError();
+    else if (sizeof Expected != BytesTransferred || 0 != memcmp(Buffer, Expected, sizeof Expected))
+        Result = ERROR_READ_FAULT;
+
+    CloseHandle(Handle);
+
+    return Result;
+}
+
+static void transact_rename_replace_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT);
+    TRANSACT_FS_NODE *Node0 = transact_fs_add(Fs, "file0", 0100666, 4096);
+    TRANSACT_FS_NODE *Node1 = transact_fs_add(Fs, "file1", 0100666, 4096);
+
+    transact_fs_pattern(Node0->Data, 4096, '0');
+    transact_fs_pattern(Node1->Data, 4096, '1');
+    Fs->Worker = transact_rename_replace_worker;
+    transact_fs_run(Fs, DeviceName, Prefix);
+
+    ASSERT(0 != Fs->OpcodeCount[FUSE_PROTO_OPCODE_RENAME] +
+        Fs->OpcodeCount[FUSE_PROTO_OPCODE_RENAME2]);
+    ASSERT(0 == strcmp("file1", Node0->Name));
+    ASSERT(0 == Node1->Name[0]);
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_rename_replace_test(void)
+{
+    transact_rename_replace_dotest(L"WinFsp.Disk", 0);
+    transact_rename_replace_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
+static BOOLEAN transact_noopen_handler(TRANSACT_FS *Fs, FUSE_PROTO_REQ *Request,
+    FUSE_PROTO_RSP *Response)
+{
+    switch (Request->opcode)
+    {
+    case FUSE_PROTO_OPCODE_OPEN:
+    case FUSE_PROTO_OPCODE_OPENDIR:
+        Response->error = -38/*ENOSYS*/;
+        return TRUE;
+
+    case FUSE_PROTO_OPCODE_READ:
+    case FUSE_PROTO_OPCODE_READDIR:
+    case FUSE_PROTO_OPCODE_READDIRPLUS:
+        /* files and directories opened without OPEN/OPENDIR have a zero file handle */
+        ASSERT(0 == Request->req.read.fh);
+        return FALSE;
+
+    case FUSE_PROTO_OPCODE_RELEASE:
+        /* only the file opened by CREATE has a file handle to release */
+        ASSERT(100 + Request->nodeid == Request->req.release.fh);
+        return FALSE;
+
+    default:
+        return FALSE;
+    }
+}
+
+static unsigned transact_noopen_worker(TRANSACT_FS *Fs)
+{
+    WCHAR FilePath[MAX_PATH];
+    HANDLE Handle;
+    WIN32_FIND_DATAW FindData;
+    UINT8 Buffer[4096], Expected[4096];
+    DWORD BytesTransferred;
+    unsigned Result = 0;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\*", Fs->Root);
+    Handle = FindFirstFileW(FilePath, &FindData);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+    FindClose(Handle);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file0", Fs->Root);
+    transact_fs_pattern(Expected, sizeof Expected, '0');
+
+    /* the second open completes locally, because OPEN is known to be unsupported */
+    for (ULONG I = 0; 2 > I && 0 == Result; I++)
+    {
+        Handle = CreateFileW(FilePath,
+            FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING,
+            FILE_FLAG_NO_BUFFERING, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+
+        if (!ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0))
+            Result = GetLastError();
+        else if (sizeof Expected != BytesTransferred ||
+            0 != memcmp(Buffer, Expected, sizeof Expected))
+            Result = ERROR_READ_FAULT;
+
+        CloseHandle(Handle);
+    }
+
+    if (0 != Result)
+        return Result;
+
+    /* a file opened by CREATE has a file handle and is still released */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file1", Fs->Root);
+    Handle = CreateFileW(FilePath,
+        FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        CREATE_NEW, 0, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+    CloseHandle(Handle);
+
+    return Result;
+}
+
+static void transact_noopen_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    TRANSACT_FS *Fs = transact_fs_create(FUSE_FSCTL_TRANSACT);
+    TRANSACT_FS_NODE *Node = transact_fs_add(Fs, "file0", 0100666, 4096);
+
+    transact_fs_pattern(Node->Data, 4096, '0');
+    Fs->Handler = transact_noopen_handler;
+    Fs->Worker = transact_noopen_worker;
+    transact_fs_run(Fs, DeviceName, Prefix);
+
+    /*
+     * ENOSYS is remembered: OPEN/OPENDIR are sent once. Files opened without OPEN/OPENDIR
+     * are never released; only the file opened by CREATE is.
+     */
+    ASSERT(1 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_OPEN]);
+    ASSERT(1 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_OPENDIR]);
+    ASSERT(0 != Fs->OpcodeCount[FUSE_PROTO_OPCODE_READ]);
+    ASSERT(1 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_CREATE]);
+    ASSERT(1 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_RELEASE]);
+    ASSERT(0 == Fs->OpcodeCount[FUSE_PROTO_OPCODE_RELEASEDIR]);
+    ASSERT(0 != transact_fs_lookup(Fs, "file1"));
+
+    transact_fs_delete(Fs);
+}
+
+static void transact_noopen_test(void)
+{
+    transact_noopen_dotest(L"WinFsp.Disk", 0);
+    transact_noopen_dotest(L"WinFsp.Net", L"\\\\winfuse-tests\\share");
+}
+
 void transact_tests(void)
 {
     TEST(transact_init_test);
+    TEST(transact_init_direct_test);
+    TEST(transact_init_async_test);
     TEST(transact_open_close_test);
     TEST(transact_open_abandon_test);
     TEST(transact_open_cancel_test);
     TEST(transact_open_bogus_test);
+    TEST(transact_read_direct_test);
+    TEST(transact_write_direct_test);
+    TEST(transact_async_pend_test);
+    TEST(transact_copy_test);
+    TEST(transact_seek_test);
+    TEST(transact_preallocate_test);
+    TEST(transact_rename_replace_test);
+    TEST(transact_noopen_test);
 }